@@ -0,0 +1,210 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ncurses.h>
+
+#include "bot.h"
+#include "common.h"
+#include "log.h"
+
+#define FIELD_UNREACHED UINT16_MAX
+#define FIELD_BLOCKED (UINT16_MAX - 1)
+
+#define BENCHMARK_TICKS 20000
+// One player for this many bots in the benchmark, for the bots to chase.
+#define BENCHMARK_BOTS_PER_PLAYER 10
+
+int flow_field_init(flow_field_t *field, int width, int height) {
+    field->width = width;
+    field->height = height;
+    field->stride = width + 2;
+    size_t cells = (size_t) field->stride * (height + 2);
+    field->distance = malloc(cells * sizeof(uint16_t));
+    field->queue = malloc(cells * sizeof(uint32_t));
+    if (field->distance == NULL || field->queue == NULL) {
+        log_error("flow_field_init: No memory for a %dx%d field", width, height);
+        flow_field_destroy(field);
+        return -1;
+    }
+    return 0;
+}
+
+void flow_field_destroy(flow_field_t *field) {
+    free(field->distance);
+    free(field->queue);
+    field->distance = NULL;
+    field->queue = NULL;
+}
+
+// Index of a board cell in the bordered grid.
+static uint32_t cell_index(const flow_field_t *field, int x, int y) {
+    return (uint32_t) ((y + 1) * field->stride + x + 1);
+}
+
+static int clamp(int value, int low, int high) {
+    return value < low ? low : value > high ? high : value;
+}
+
+void flow_field_build(flow_field_t *field, const snake_t *targets, uint32_t target_count, const snake_t *obstacles,
+                      uint32_t obstacle_count) {
+    int stride = field->stride;
+    uint16_t *distance = field->distance;
+
+    // Blocked border rows and columns around an unreached board.
+    for (int i = 0; i < stride; i++) {
+        distance[i] = FIELD_BLOCKED;
+        distance[(field->height + 1) * stride + i] = FIELD_BLOCKED;
+    }
+    for (int y = 1; y <= field->height; y++) {
+        uint16_t *row = distance + y * stride;
+        row[0] = FIELD_BLOCKED;
+        for (int x = 1; x <= field->width; x++) {
+            row[x] = FIELD_UNREACHED;
+        }
+        row[field->width + 1] = FIELD_BLOCKED;
+    }
+
+    for (uint32_t i = 0; i < obstacle_count; i++) {
+        int x = obstacles[i].x, y = obstacles[i].y;
+        if (x >= 0 && x < field->width && y >= 0 && y < field->height) {
+            distance[cell_index(field, x, y)] = FIELD_BLOCKED;
+        }
+    }
+
+    uint32_t head = 0, tail = 0;
+    for (uint32_t i = 0; i < target_count; i++) {
+        uint32_t cell = cell_index(field, clamp(targets[i].x, 0, field->width - 1),
+                                   clamp(targets[i].y, 0, field->height - 1));
+        // A target is reachable even though its own snake stands on it.
+        if (distance[cell] != 0) {
+            distance[cell] = 0;
+            field->queue[tail++] = cell;
+        }
+    }
+
+    // Every source is searched from together, so each cell is visited once no matter how many targets there are.
+    while (head < tail) {
+        uint32_t cell = field->queue[head++];
+        uint16_t next = (uint16_t) (distance[cell] + 1);
+        uint32_t neighbours[4] = {cell - stride, cell + stride, cell - 1, cell + 1};
+        for (int i = 0; i < 4; i++) {
+            if (distance[neighbours[i]] == FIELD_UNREACHED) {
+                distance[neighbours[i]] = next;
+                field->queue[tail++] = neighbours[i];
+            }
+        }
+    }
+}
+
+uint32_t flow_field_step(const flow_field_t *field, const snake_t *snake) {
+    if (snake->x < 0 || snake->x >= field->width || snake->y < 0 || snake->y >= field->height) {
+        return 0;
+    }
+
+    uint32_t cell = cell_index(field, snake->x, snake->y);
+    if (field->distance[cell] == 0) {
+        return 0;
+    }
+
+    static const uint32_t keys[4] = {KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT};
+    uint32_t neighbours[4] = {cell - field->stride, cell + field->stride, cell - 1, cell + 1};
+
+    // A bot's own cell is blocked by itself, so the best neighbour is compared against the neighbours alone. Ties
+    // are broken by player id, which keeps bots from all lining up on the same row.
+    uint16_t best = FIELD_BLOCKED;
+    uint32_t key = 0;
+    for (int i = 0; i < 4; i++) {
+        int direction = (i + (int) snake->player_id) & 3;
+        uint16_t distance = field->distance[neighbours[direction]];
+        if (distance < best) {
+            best = distance;
+            key = keys[direction];
+        }
+    }
+
+    // Standing next to a target is close enough, there is no need to share its cell.
+    return best == 0 ? 0 : key;
+}
+
+static void move_snake(snake_t *snake, uint32_t key) {
+    switch (key) {
+        case KEY_UP:
+            snake->y--;
+            break;
+        case KEY_DOWN:
+            snake->y++;
+            break;
+        case KEY_LEFT:
+            snake->x--;
+            break;
+        case KEY_RIGHT:
+            snake->x++;
+            break;
+        default:
+            break;
+    }
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void bot_benchmark(uint32_t bot_count) {
+    uint32_t player_count = bot_count / BENCHMARK_BOTS_PER_PLAYER + 1;
+    uint32_t snake_count = player_count + bot_count;
+    snake_t *snakes = malloc(sizeof(snake_t) * snake_count);
+    flow_field_t field;
+    if (snakes == NULL || flow_field_init(&field, WIDTH, HEIGHT)) {
+        log_error("bot_benchmark: No memory for %d bots", bot_count);
+        free(snakes);
+        return;
+    }
+
+    // Players come first, so they are the targets.
+    unsigned int seed = 1;
+    for (uint32_t i = 0; i < snake_count; i++) {
+        snakes[i].player_id = i + 1;
+        snakes[i].x = (int16_t) (rand_r(&seed) % WIDTH);
+        snakes[i].y = (int16_t) (rand_r(&seed) % HEIGHT);
+    }
+
+    static const uint32_t keys[4] = {KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT};
+    uint64_t moves = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int tick = 0; tick < BENCHMARK_TICKS; tick++) {
+        for (uint32_t i = 0; i < player_count; i++) {
+            snake_t *player = &snakes[i];
+            move_snake(player, keys[rand_r(&seed) & 3]);
+            player->x = (int16_t) clamp(player->x, 0, WIDTH - 1);
+            player->y = (int16_t) clamp(player->y, 0, HEIGHT - 1);
+        }
+
+        flow_field_build(&field, snakes, player_count, snakes, snake_count);
+        for (uint32_t i = player_count; i < snake_count; i++) {
+            uint32_t key = flow_field_step(&field, &snakes[i]);
+            if (key) {
+                move_snake(&snakes[i], key);
+                moves++;
+            }
+        }
+    }
+
+    double elapsed = seconds_since(&start);
+    printf("%u bots chasing %u players on a %dx%d board for %d ticks\n", bot_count, player_count, WIDTH, HEIGHT,
+           BENCHMARK_TICKS);
+    printf("%.3f s, %.0f ticks/s, %.0f bot-ticks/s, %.1f%% of bot-ticks moved\n", elapsed,
+           BENCHMARK_TICKS / elapsed, (double) bot_count * BENCHMARK_TICKS / elapsed,
+           bot_count ? 100.0 * moves / ((double) bot_count * BENCHMARK_TICKS) : 0.0);
+
+    flow_field_destroy(&field);
+    free(snakes);
+}
@@ -0,0 +1,40 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_BOT_H
+#define CSNAKE_BOT_H
+
+#include <stdint.h>
+#include "snake.h"
+
+//
+// Pathing for server side bots. Rather than searching once per bot, one breadth first search per tick starts from
+// every target at once and records each cell's distance to the nearest one. Every bot then just steps downhill, so
+// the cost of a tick barely depends on how many bots there are.
+//
+// The field is a flat row major grid with a blocked border, so a search or a step never needs a bounds check.
+//
+
+typedef struct {
+    int width;
+    int height;
+    int stride; // width + 2, for the border.
+    uint16_t *distance;
+    uint32_t *queue;
+} flow_field_t;
+
+int flow_field_init(flow_field_t *field, int width, int height);
+void flow_field_destroy(flow_field_t *field);
+// Measures every cell's distance to the nearest target. Cells taken by the obstacles cannot be passed through.
+// Targets outside the board count from the closest cell on its edge.
+void flow_field_build(flow_field_t *field, const snake_t *targets, uint32_t target_count, const snake_t *obstacles,
+                      uint32_t obstacle_count);
+// Returns the arrow key that takes the snake closer to a target, or 0 if it is there or cannot get any closer.
+uint32_t flow_field_step(const flow_field_t *field, const snake_t *snake);
+
+// Runs bots against a board of wandering players without any networking and prints how many bot-ticks per second
+// the pathing manages.
+void bot_benchmark(uint32_t bot_count);
+
+#endif //CSNAKE_BOT_H
@@ -0,0 +1,240 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "log.h"
+
+#define INITIAL_REGION_CAPACITY 1024
+
+struct checkpoint {
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+};
+
+static size_t region_size(uint32_t capacity) {
+    return sizeof(checkpoint_region_t) + sizeof(checkpoint_player_t) * capacity;
+}
+
+static size_t file_size(uint32_t capacity) {
+    return sizeof(checkpoint_header_t) + region_size(capacity) * 2;
+}
+
+static checkpoint_region_t * get_region(unsigned char *map, uint32_t capacity, uint32_t index) {
+    return (checkpoint_region_t *) (map + sizeof(checkpoint_header_t) + region_size(capacity) * index);
+}
+
+// FNV-1a over the region's fields and snakes, so a torn write is detected on recovery.
+static uint32_t region_checksum(const checkpoint_region_t *region) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *) region;
+    size_t size = offsetof(checkpoint_region_t, checksum);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    bytes = (const unsigned char *) (region + 1);
+    size = sizeof(checkpoint_player_t) * region->snake_count;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Maps the file at the given capacity, growing the file if needed. A fresh file gets an empty header.
+static int map_checkpoint(checkpoint_t *checkpoint, uint32_t capacity) {
+    size_t size = file_size(capacity);
+    if (ftruncate(checkpoint->fd, size)) {
+        log_error("map_checkpoint: ftruncate error: %s", strerror(errno));
+        return -1;
+    }
+
+    unsigned char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, checkpoint->fd, 0);
+    if (map == MAP_FAILED) {
+        log_error("map_checkpoint: mmap error: %s", strerror(errno));
+        return -1;
+    }
+
+    if (checkpoint->map) {
+        munmap(checkpoint->map, checkpoint->map_size);
+    }
+    checkpoint->map = map;
+    checkpoint->map_size = size;
+    return 0;
+}
+
+checkpoint_t * checkpoint_open(const char *path) {
+    checkpoint_t *checkpoint = malloc(sizeof(checkpoint_t));
+    checkpoint->map = NULL;
+    checkpoint->map_size = 0;
+    checkpoint->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (checkpoint->fd == -1) {
+        log_error("checkpoint_open: Could not open %s: %s", path, strerror(errno));
+        free(checkpoint);
+        return NULL;
+    }
+
+    // Any existing checkpoints are discarded; recovery reads the file before it is opened for writing.
+    if (ftruncate(checkpoint->fd, 0) || map_checkpoint(checkpoint, INITIAL_REGION_CAPACITY)) {
+        checkpoint_close(checkpoint);
+        return NULL;
+    }
+
+    checkpoint_header_t *header = (checkpoint_header_t *) checkpoint->map;
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->region_capacity = INITIAL_REGION_CAPACITY;
+    header->active_region = 0;
+    header->generation = 0;
+
+    log_info("checkpoint_open: Writing checkpoints to %s", path);
+    return checkpoint;
+}
+
+// Moves the active checkpoint into a larger file layout so the next write fits.
+static int grow_checkpoint(checkpoint_t *checkpoint, uint32_t snake_count) {
+    checkpoint_header_t *header = (checkpoint_header_t *) checkpoint->map;
+    uint32_t old_capacity = header->region_capacity;
+    uint32_t new_capacity = old_capacity;
+    while (new_capacity < snake_count) {
+        new_capacity *= 2;
+    }
+
+    // Keep a copy of the active region, since its offset changes with the capacity.
+    checkpoint_region_t *active = get_region(checkpoint->map, old_capacity, header->active_region);
+    size_t active_size = sizeof(checkpoint_region_t) + sizeof(checkpoint_player_t) * active->snake_count;
+    unsigned char *saved = malloc(active_size);
+    memcpy(saved, active, active_size);
+
+    // Invalidate the file while it is being rearranged, so a crash here is not mistaken for a checkpoint.
+    header->magic = 0;
+    if (map_checkpoint(checkpoint, new_capacity)) {
+        free(saved);
+        return -1;
+    }
+
+    header = (checkpoint_header_t *) checkpoint->map;
+    header->region_capacity = new_capacity;
+    memcpy(get_region(checkpoint->map, new_capacity, header->active_region), saved, active_size);
+    __atomic_store_n(&header->magic, CHECKPOINT_MAGIC, __ATOMIC_RELEASE);
+    free(saved);
+
+    log_info("grow_checkpoint: Checkpoint regions grew to %d snakes", new_capacity);
+    return 0;
+}
+
+int checkpoint_write(checkpoint_t *checkpoint, uint32_t next_player_id, const checkpoint_player_t *players,
+                     uint32_t player_count) {
+    checkpoint_header_t *header = (checkpoint_header_t *) checkpoint->map;
+    if (player_count > header->region_capacity && grow_checkpoint(checkpoint, player_count)) {
+        return -1;
+    }
+
+    header = (checkpoint_header_t *) checkpoint->map;
+    uint32_t target = header->active_region ^ 1;
+    checkpoint_region_t *region = get_region(checkpoint->map, header->region_capacity, target);
+
+    region->generation = header->generation + 1;
+    region->next_player_id = next_player_id;
+    region->snake_count = player_count;
+    region->reserved = 0;
+    memcpy(region + 1, players, sizeof(checkpoint_player_t) * player_count);
+    region->checksum = region_checksum(region);
+
+    // Publish the region only after it is completely written.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->generation = region->generation;
+    __atomic_store_n(&header->active_region, target, __ATOMIC_RELEASE);
+
+    // The page cache already survives a crash of this process; this only starts writeback for the host going down.
+    msync(checkpoint->map, checkpoint->map_size, MS_ASYNC);
+    return 0;
+}
+
+void checkpoint_close(checkpoint_t *checkpoint) {
+    if (checkpoint->map) {
+        msync(checkpoint->map, checkpoint->map_size, MS_SYNC);
+        munmap(checkpoint->map, checkpoint->map_size);
+    }
+    if (checkpoint->fd != -1) {
+        close(checkpoint->fd);
+    }
+    free(checkpoint);
+}
+
+// Returns the region if it is complete and matches its checksum, or NULL otherwise.
+static const checkpoint_region_t * valid_region(unsigned char *map, size_t map_size, uint32_t capacity,
+                                                uint32_t index) {
+    const checkpoint_region_t *region = get_region(map, capacity, index);
+    if (region->snake_count > capacity || (unsigned char *) (region + 1) > map + map_size) {
+        return NULL;
+    }
+    if (region->checksum != region_checksum(region)) {
+        return NULL;
+    }
+    return region;
+}
+
+int checkpoint_read(const char *path, uint32_t *next_player_id, checkpoint_player_t **players,
+                    uint32_t *player_count) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        log_error("checkpoint_read: Could not open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) || (size_t) file_stat.st_size < sizeof(checkpoint_header_t)) {
+        log_error("checkpoint_read: %s does not contain a checkpoint", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t map_size = (size_t) file_stat.st_size;
+    unsigned char *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_error("checkpoint_read: mmap error: %s", strerror(errno));
+        return -1;
+    }
+
+    const checkpoint_header_t *header = (const checkpoint_header_t *) map;
+    if (header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+        header->active_region > 1 || file_size(header->region_capacity) > map_size) {
+        log_error("checkpoint_read: %s has an unknown or incomplete header", path);
+        munmap(map, map_size);
+        return -1;
+    }
+
+    // Prefer the active region, but fall back to the other one if the active one did not survive.
+    const checkpoint_region_t *region = valid_region(map, map_size, header->region_capacity, header->active_region);
+    if (region == NULL) {
+        log_warn("checkpoint_read: Newest checkpoint is damaged, trying the previous one");
+        region = valid_region(map, map_size, header->region_capacity, header->active_region ^ 1);
+    }
+    if (region == NULL || region->generation == 0) {
+        log_error("checkpoint_read: %s has no valid checkpoint", path);
+        munmap(map, map_size);
+        return -1;
+    }
+
+    *next_player_id = region->next_player_id;
+    *player_count = region->snake_count;
+    *players = malloc(sizeof(checkpoint_player_t) * (region->snake_count ? region->snake_count : 1));
+    memcpy(*players, region + 1, sizeof(checkpoint_player_t) * region->snake_count);
+
+    log_info("checkpoint_read: Recovered %d snakes from checkpoint generation %d", region->snake_count,
+             (int) region->generation);
+
+    munmap(map, map_size);
+    return 0;
+}
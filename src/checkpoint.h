@@ -0,0 +1,56 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_CHECKPOINT_H
+#define CSNAKE_CHECKPOINT_H
+
+#include <stdint.h>
+#include "snake.h"
+
+//
+// Memory mapped world checkpoints. The file holds a header followed by two regions. Each checkpoint is written into
+// the region that is not currently active and only then is the header flipped to point at it, so a crash part way
+// through a write always leaves the previous checkpoint intact.
+//
+
+#define CHECKPOINT_MAGIC 0x43534e50 // "CSNP"
+#define CHECKPOINT_VERSION 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t region_capacity; // Snakes each region can hold.
+    uint32_t active_region;
+    uint64_t generation;
+} checkpoint_header_t;
+
+typedef struct {
+    uint64_t generation;
+    uint32_t next_player_id;
+    uint32_t snake_count;
+    uint32_t checksum;
+    uint32_t reserved;
+} checkpoint_region_t;
+
+// A player's snake and the token its client has to present to resume it.
+typedef struct {
+    snake_t snake;
+    uint32_t resume_token;
+} checkpoint_player_t;
+
+typedef struct checkpoint checkpoint_t;
+
+// Opens or creates a checkpoint file for writing. Returns NULL on failure.
+checkpoint_t * checkpoint_open(const char *path);
+// Writes the given world state as the next checkpoint. Returns 0 on success or -1 otherwise.
+int checkpoint_write(checkpoint_t *checkpoint, uint32_t next_player_id, const checkpoint_player_t *players,
+                     uint32_t player_count);
+void checkpoint_close(checkpoint_t *checkpoint);
+
+// Reads the newest valid checkpoint from the file. The players are returned in a malloc'd array owned by the caller.
+// Returns 0 on success or -1 if there is no usable checkpoint.
+int checkpoint_read(const char *path, uint32_t *next_player_id, checkpoint_player_t **players,
+                    uint32_t *player_count);
+
+#endif //CSNAKE_CHECKPOINT_H
@@ -12,13 +12,27 @@
 #include <stdbool.h>
 #include <ncurses.h>
 #include <netinet/in.h>
+#include <sys/ioctl.h>
 
 #include "socket.h"
 #include "common.h"
+#include "lockstep.h"
 #include "log.h"
 #include "messages.h"
+#include "metrics.h"
+#include "minimap.h"
+#include "player_table.h"
+#include "ring.h"
 #include "snake.h"
 
+// Scratch space read_messages decodes one message into before resetting it. Large enough for the join snapshot of a
+// world of tens of thousands of snakes.
+#define MESSAGE_ARENA_SIZE (1024 * 1024)
+
+// The server pings every second, so hearing nothing from it for this long means the connection is dead even if it
+// was never closed.
+#define SERVER_TIMEOUT_MS 15000
+
 static volatile bool running = true;
 
 static int parent_pid;
@@ -26,107 +40,420 @@ static int child_pid;
 
 static WINDOW *main_window;
 
-static GSList *players = NULL;
+static player_table_t players;
+// Where the snakes are, for moving them the way a lockstep server does.
+static lockstep_grid_t grid;
+// Whether a resync was asked for and its snapshot has not come yet, so a mismatch is only reported once.
+static bool resync_pending = false;
+
+// The part of the board that fits the terminal, which follows the player's snake, and a minimap of the whole board
+// for when that is not all of it.
+static int view_width;
+static int view_height;
+static minimap_t minimap;
+static bool minimap_shown = false;
+static volatile sig_atomic_t resized = false;
+// Whether messages came in since the board was last drawn.
+static bool frame_due = false;
+
+// Received bytes not yet handled, from the socket and then from the ring. Large enough for a whole join snapshot.
+static unsigned char rx_buffer[MESSAGE_ARENA_SIZE];
+static size_t rx_used = 0;
+
+// Whether to ask the server for a shared memory ring, when connected over a unix socket.
+static bool use_ring = false;
+static ring_t ring;
+static bool ring_attached = false;
+// Descriptors received on the socket, waiting for the MSG_RING_READY they came with.
+static int passed_fds[MAX_PASSED_FDS];
+static int passed_fd_count = 0;
+
+// Player id to resume when connecting, or 0 for a new player, and the token that proves it is ours. Replaced by what
+// the server welcomes us with.
+static uint32_t player_id = 0;
+static uint32_t resume_token = 0;
+
+// Whether to watch instead of play.
+static bool spectator = false;
+
+void client_set_player_id(uint32_t id, uint32_t token) {
+    player_id = id;
+    resume_token = token;
+}
+
+void client_set_ring(bool enabled) {
+    use_ring = enabled;
+}
+
+void client_set_spectator(bool enabled) {
+    spectator = enabled;
+}
 
 static void exit_handler(int dummy) {
     log_info("exit_handler: SIGUSR1 received");
     running = false;
 }
 
-// Draw a snake to the screen
-static void draw_snake(snake_t *snake) {
-    mvprintw(snake->y, snake->x, "O");
+static void resize_handler(int dummy) {
+    resized = true;
+}
+
+// Fits the view to the terminal, with a minimap taking up to a third of it each way if the board does not fit.
+static void layout_view() {
+    view_width = COLS < grid.width ? COLS : grid.width;
+    view_height = LINES < grid.height ? LINES : grid.height;
+    if (minimap_shown) {
+        minimap_destroy(&minimap);
+        minimap_shown = false;
+    }
+    if (view_width < grid.width || view_height < grid.height) {
+        // One column and one row go to the minimap's frame.
+        minimap_shown = minimap_init(&minimap, grid.width, grid.height, COLS / 3 - 1, LINES / 3 - 1) == 0;
+    }
+}
+
+// Start of the view along one axis, centred on the given cell but kept on the board.
+static int view_start(int center, int view_size, int board_size) {
+    int start = center - view_size / 2;
+    if (start > board_size - view_size) {
+        start = board_size - view_size;
+    }
+    return start > 0 ? start : 0;
+}
+
+// Draws the minimap in the top right corner, with the player's own block marked.
+static void draw_minimap(int own_x, int own_y) {
+    minimap_update(&minimap, grid.cells);
+    int left = COLS - minimap.width;
+    for (int block_y = 0; block_y < minimap.height; block_y++) {
+        mvaddch(block_y, left - 1, '|');
+        for (int block_x = 0; block_x < minimap.width; block_x++) {
+            mvaddch(block_y, left + block_x, (chtype) minimap_glyph(&minimap, block_x, block_y));
+        }
+    }
+    mvaddch(minimap.height, left - 1, '+');
+    for (int block_x = 0; block_x < minimap.width; block_x++) {
+        mvaddch(minimap.height, left + block_x, '-');
+    }
+    if (own_x >= 0 && own_x < grid.width && own_y >= 0 && own_y < grid.height) {
+        mvaddch(own_y / minimap.block_height, left + own_x / minimap.block_width, '@');
+    }
 }
 
-// Draw the game board
+// Draws the cells of the board in view, so a frame costs the same however large the board and however many snakes
+// are on it. Snakes off the board are not drawn.
 static void update_game_board() {
-    clear();
-    g_slist_foreach(players, (GFunc) draw_snake, NULL);
+    bool repaint = resized;
+    if (resized) {
+        resized = false;
+        struct winsize size;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) {
+            resize_term(size.ws_row, size.ws_col);
+        }
+        layout_view();
+    }
+
+    int own_x = grid.width / 2;
+    int own_y = grid.height / 2;
+    uint32_t own_slot = player_table_find(&players, player_id);
+    if (own_slot != PLAYER_SLOT_NONE) {
+        own_x = players.xs[own_slot];
+        own_y = players.ys[own_slot];
+    }
+    int left = view_start(own_x, view_width, grid.width);
+    int top = view_start(own_y, view_height, grid.height);
+
+    // Only what changed since the last frame is written out, unless the terminal was resized and has to be redrawn.
+    if (repaint) {
+        clear();
+    } else {
+        erase();
+    }
+    for (int y = 0; y < view_height; y++) {
+        const uint16_t *row = grid.cells + (size_t) (top + y) * grid.width + left;
+        for (int x = 0; x < view_width; x++) {
+            if (row[x]) {
+                mvaddch(y, x, 'O');
+            }
+        }
+    }
+    if (minimap_shown) {
+        draw_minimap(own_slot != PLAYER_SLOT_NONE ? own_x : -1, own_y);
+    }
     refresh();
 }
 
-// Checks if the given snake has the given id
-static int snake_has_same_id(const snake_t *snake, const uint32_t *player_id) {
-    return snake->player_id - *player_id;
+// Marks the cell a snake is on to be counted again by the minimap.
+static void touch_snake(uint32_t slot) {
+    if (minimap_shown) {
+        minimap_touch(&minimap, players.xs[slot], players.ys[slot]);
+    }
+}
+
+// Puts a snake where the server says it is, adding it if it is new.
+static void place_snake(const snake_t *snake) {
+    uint32_t slot = player_table_find(&players, snake->player_id);
+    if (slot == PLAYER_SLOT_NONE) {
+        slot = player_table_add(&players, NULL, -1);
+        if (slot == PLAYER_SLOT_NONE) {
+            log_error("place_snake: No memory for player %d", snake->player_id);
+            return;
+        }
+        player_table_set_id(&players, slot, snake->player_id);
+    } else {
+        lockstep_grid_remove(&grid, players.xs[slot], players.ys[slot]);
+        touch_snake(slot);
+    }
+    players.xs[slot] = snake->x;
+    players.ys[slot] = snake->y;
+    lockstep_grid_add(&grid, snake->x, snake->y);
+    touch_snake(slot);
+}
+
+// Moves the snakes by the inputs of a lockstep tick, the same way the server did.
+static void apply_tick_inputs(msg_tick_inputs *message) {
+    // Only the snakes with inputs can move, so their cells before and after the step are all the minimap needs.
+    for (uint32_t i = 0; i < message->input_count && minimap_shown; i++) {
+        uint32_t slot = player_table_find(&players, message->inputs[i].player_id);
+        if (slot != PLAYER_SLOT_NONE) {
+            touch_snake(slot);
+        }
+    }
+    if (lockstep_step(&grid, &players, message->inputs, message->input_count, NULL) < 0) {
+        log_error("apply_tick_inputs: Could not step tick %d", message->tick);
+    }
+    for (uint32_t i = 0; i < message->input_count && minimap_shown; i++) {
+        uint32_t slot = player_table_find(&players, message->inputs[i].player_id);
+        if (slot != PLAYER_SLOT_NONE) {
+            touch_snake(slot);
+        }
+    }
+}
+
+// Checks the world against the server's hash of it, asking for a new snapshot if it went astray.
+static void check_state_hash(int client_fd, msg_state_hash *message) {
+    if (resync_pending || lockstep_hash(&players) == message->hash) {
+        return;
+    }
+    log_warn("check_state_hash: World differs from the server's on tick %d, asking for a resync", message->tick);
+    msg_resync_request request;
+    request.tick = message->tick;
+    send_message(client_fd, MSG_RESYNC_REQUEST, &request);
+    resync_pending = true;
+}
+
+// Switches over to the ring the server sent along with MSG_RING_READY. Everything after it arrives through the ring.
+static void attach_ring(msg_ring_ready *message) {
+    if (ring_attached || passed_fd_count != 2) {
+        log_error("attach_ring: Expected a ring's memfd and eventfd but have %d descriptors", passed_fd_count);
+        for (int i = 0; i < passed_fd_count; i++) {
+            close(passed_fds[i]);
+        }
+        passed_fd_count = 0;
+        return;
+    }
+    passed_fd_count = 0;
+    if (ring_attach(&ring, passed_fds[0], passed_fds[1])) {
+        return;
+    }
+    ring_attached = true;
+    log_info("attach_ring: Reading from the server through a %d byte ring", message->capacity);
+}
+
+// Handles one message from the server.
+static void handle_message(int client_fd, message_t message_type, void *message_ptr) {
+    if (message_type == MSG_SERVER_WELCOME && spectator) {
+        log_info("handle_message: Watching the game.");
+    } else if (message_type == MSG_SERVER_WELCOME) {
+        msg_server_welcome *message = (msg_server_welcome *) message_ptr;
+        if (player_id != 0 && player_id != message->player_id) {
+            log_info("handle_message: Player %d could not be resumed.", player_id);
+        }
+        player_id = message->player_id;
+        resume_token = message->resume_token;
+        log_info("handle_message: Joined as player %d, use -i %d:%u to resume after a server restart.", player_id,
+                 player_id, resume_token);
+    } else if (message_type == MSG_PING) {
+        // Echo the server's timestamp so it can measure the round trip.
+        msg_pong pong;
+        pong.timestamp_us = ((msg_ping *) message_ptr)->timestamp_us;
+        send_message(client_fd, MSG_PONG, &pong);
+    } else if (message_type == MSG_SNAKE_UPDATE) {
+        msg_snake_update *message = (msg_snake_update *) message_ptr;
+
+        place_snake(&message->snake);
+
+        log_info("handle_message: Received snake update for %d", message->snake.player_id);
+    } else if (message_type == MSG_WORLD_SNAPSHOT) {
+        msg_world_snapshot *message = (msg_world_snapshot *) message_ptr;
+
+        // The snapshot is the whole world, so it replaces whatever was known before.
+        player_table_clear(&players);
+        lockstep_grid_clear(&grid);
+        if (minimap_shown) {
+            minimap_touch_all(&minimap);
+        }
+        resync_pending = false;
+        for (uint32_t i = 0; i < message->snake_count; i++) {
+            place_snake(&message->snakes[i]);
+        }
+
+        log_info("handle_message: Received world snapshot of %d snakes", message->snake_count);
+    } else if (message_type == MSG_CLIENT_DISCONNECT) {
+        msg_client_disconnect *message = (msg_client_disconnect *) message_ptr;
+
+        // Find and remove an existing snake or log error if none found.
+        uint32_t slot = player_table_find(&players, message->player_id);
+        if (slot != PLAYER_SLOT_NONE) {
+            lockstep_grid_remove(&grid, players.xs[slot], players.ys[slot]);
+            touch_snake(slot);
+            player_table_remove(&players, slot);
+            log_info("handle_message: Player %d disconnected.", message->player_id);
+        } else {
+            log_error("handle_message: Received disconnect from unknown player %d", message->player_id);
+        }
+    } else if (message_type == MSG_TICK_INPUTS) {
+        apply_tick_inputs((msg_tick_inputs *) message_ptr);
+    } else if (message_type == MSG_STATE_HASH) {
+        check_state_hash(client_fd, (msg_state_hash *) message_ptr);
+    } else if (message_type == MSG_RING_READY) {
+        attach_ring((msg_ring_ready *) message_ptr);
+    } else {
+        log_error("handle_message: Received unknown message type %d", message_type);
+    }
+}
+
+// Handles every whole message received so far, keeping a partial one for when the rest arrives. Returns false if the
+// server sent something that is not a valid message.
+static bool handle_received(int client_fd, arena_t *arena) {
+    size_t offset = 0;
+    while (offset < rx_used) {
+        message_t message_type;
+        void *message_ptr;
+        ssize_t consumed = decode_message(rx_buffer + offset, rx_used - offset, arena, &message_type, &message_ptr);
+        if (consumed < 0) {
+            log_error("handle_received: The server sent an invalid message.");
+            return false;
+        } else if (consumed == 0) {
+            if (offset == 0 && rx_used == sizeof(rx_buffer)) {
+                log_error("handle_received: The server sent a message too large to receive.");
+                return false;
+            }
+            break;
+        }
+        offset += consumed;
+
+        handle_message(client_fd, message_type, message_ptr);
+        frame_due = true;
+
+        // Everything decoded for this message is released at once.
+        arena_reset(arena);
+    }
+
+    rx_used -= offset;
+    memmove(rx_buffer, rx_buffer + offset, rx_used);
+    return true;
 }
 
 // Client process for reading messages sent from the server.
 static void read_messages(int client_fd) {
     signal(SIGUSR1, exit_handler);
+    signal(SIGWINCH, resize_handler);
+
+    static unsigned char scratch[MESSAGE_ARENA_SIZE];
+    arena_t arena;
+    arena_init(&arena, scratch, sizeof(scratch));
 
-    struct pollfd events;
-    events.fd = client_fd;
-    events.events = POLL_IN;
+    player_table_init(&players);
+    if (lockstep_grid_init(&grid, WIDTH, HEIGHT, 1)) {
+        return;
+    }
+    layout_view();
 
+    uint64_t heard_ns = metrics_now();
     while (running) {
-        poll(&events, 1, 50); // Block for 50 ms at most waiting for events on the client's fd.
+        struct pollfd events[2];
+        events[0].fd = client_fd;
+        events[0].events = POLLIN;
+        events[0].revents = 0;
+        int event_count = 1;
+        // Everything happens in response to the server, so block until it sends something or is overdue.
+        uint64_t silent_ns = metrics_now() - heard_ns;
+        uint64_t timeout_ns = SERVER_TIMEOUT_MS * 1000000ull;
+        int timeout = silent_ns < timeout_ns ? (int) ((timeout_ns - silent_ns) / 1000000) + 1 : 0;
+        bool waiting = false;
+        if (ring_attached) {
+            // The server only writes the eventfd if it knows we are about to sleep.
+            events[1].fd = ring.event_fd;
+            events[1].events = POLLIN;
+            events[1].revents = 0;
+            event_count = 2;
+            waiting = ring_prepare_wait(&ring);
+            if (!waiting) {
+                timeout = 0;
+            }
+        }
 
-        if (events.revents & POLLERR) {
-            log_error("read_messages: client socket unexpectedly closed.");
-            return;
+        poll(events, event_count, timeout);
+        if (waiting) {
+            ring_finish_wait(&ring);
         }
-        if (events.revents & POLLHUP) {
-            log_error("read_messages: the server has hung up.");
+
+        if (events[0].revents & POLLERR) {
+            log_error("read_messages: client socket unexpectedly closed.");
             return;
         }
-        if (events.revents & POLLNVAL) {
+        if (events[0].revents & POLLNVAL) {
             log_error("read_messages: client socket is not open.");
             return;
         }
 
-        if (events.revents & POLLIN) { // Data can be read from the fd.
-            // Read the message from the server
-            message_t message_type;
-            void **message_ptr = malloc(sizeof(void *));
-            ssize_t read_amount = recv_message(client_fd, &message_type, message_ptr);
+        if (events[0].revents & (POLLIN | POLLHUP)) { // Data can be read from the fd.
+            int fds[MAX_PASSED_FDS];
+            int fd_count = 0;
+            ssize_t read_amount = recv_some_fds(client_fd, rx_buffer + rx_used, sizeof(rx_buffer) - rx_used, fds,
+                                                &fd_count);
             if (read_amount == 0) {
                 log_info("read_messages: Server has shut down.");
                 break;
+            } else if (read_amount < 0) {
+                log_error("read_messages: Could not read from the server.");
+                break;
             }
+            rx_used += read_amount;
+            heard_ns = metrics_now();
 
-            if (message_type == MSG_SNAKE_UPDATE) {
-                msg_snake_update *message = (msg_snake_update *) *message_ptr;
-
-                // Find and update an existing snake or add a new one if none found.
-                GSList *existing_snake = g_slist_find_custom(players, &(message->snake.player_id),
-                                                             (GCompareFunc) snake_has_same_id);
-                if (existing_snake) {
-                    snake_t *snake = existing_snake[0].data;
-                    snake->x = message->snake.x;
-                    snake->y = message->snake.y;
+            // Passed descriptors are kept for the message they came with.
+            for (int i = 0; i < fd_count; i++) {
+                if (passed_fd_count < MAX_PASSED_FDS) {
+                    passed_fds[passed_fd_count++] = fds[i];
                 } else {
-                    snake_t *snake = malloc(sizeof(snake_t));
-                    snake->player_id = message->snake.player_id;
-                    snake->x = message->snake.x;
-                    snake->y = message->snake.y;
-                    players = g_slist_append(players, snake);
+                    close(fds[i]);
                 }
-
-                log_info("read_messages: Received snake update for %d", message->snake.player_id);
-            } else if (message_type == MSG_CLIENT_DISCONNECT) {
-                msg_client_disconnect *message = (msg_client_disconnect *) *message_ptr;
-
-                // Find and remove an existing snake or log error if none found.
-                GSList *existing_snake = g_slist_find_custom(players, &(message->player_id),
-                                                             (GCompareFunc) snake_has_same_id);
-                if (existing_snake) {
-                    players = g_slist_remove(players, existing_snake[0].data);
-                    log_info("read_messages: Player %d disconnected.", message->player_id);
-                } else {
-                    log_error("read_messages: Received disconnect from unknown player %d", message->player_id);
-                }
-            } else {
-                log_error("read_messages: Received unknown message type %d", message_type);
             }
+        }
 
-            if (*message_ptr) {
-                free(*message_ptr);
+        if (ring_attached) {
+            size_t ring_amount = ring_read(&ring, rx_buffer + rx_used, sizeof(rx_buffer) - rx_used);
+            if (ring_amount > 0) {
+                rx_used += ring_amount;
+                heard_ns = metrics_now();
             }
-            free(message_ptr);
+        }
 
-            update_game_board();
+        if (metrics_now() - heard_ns > SERVER_TIMEOUT_MS * 1000000ull) {
+            log_error("read_messages: Heard nothing from the server for %d seconds.", SERVER_TIMEOUT_MS / 1000);
+            break;
         }
 
+        if (!handle_received(client_fd, &arena)) {
+            break;
+        }
+        // Drawn once for everything that came in together rather than after each message.
+        if (frame_due || resized) {
+            update_game_board();
+            frame_due = false;
+        }
     }
 }
 
@@ -140,8 +467,11 @@ static void user_input(int client_fd) {
     sigemptyset(&signal_action.sa_mask);
     sigaction(SIGCHLD, &signal_action, NULL);
 
+    // The child process draws the board and resizes it. Resizing here as well would blank the screen.
+    signal(SIGWINCH, SIG_IGN);
+
     int input_key;
-    void *message;
+    msg_client_keypress message;
 
     while (running) {
         // Block until a key is pressed or interrupted
@@ -162,18 +492,17 @@ static void user_input(int client_fd) {
             case KEY_DOWN:
             case KEY_LEFT:
             case KEY_RIGHT:
+                if (spectator) {
+                    break;
+                }
                 // Send the key stroke message to the server
-                message = malloc(sizeof(msg_client_keypress));
-                ((msg_client_keypress *) message)->key_code = (uint32_t) input_key;
-                send_message(client_fd, MSG_CLIENT_KEYPRESS, message);
-                free(message);
+                message.key_code = (uint32_t) input_key;
+                send_message(client_fd, MSG_CLIENT_KEYPRESS, &message);
                 break;
             case 27: // Escape
                 // Send the key stroke message to the server and then terminate client
-                message = malloc(sizeof(msg_client_keypress));
-                ((msg_client_keypress *) message)->key_code = (uint32_t) input_key;
-                send_message(client_fd, MSG_CLIENT_KEYPRESS, message);
-                free(message);
+                message.key_code = (uint32_t) input_key;
+                send_message(client_fd, MSG_CLIENT_KEYPRESS, &message);
                 kill(child_pid, SIGUSR1);
                 return;
             default:
@@ -203,12 +532,33 @@ static void finalize_screen() {
 }
 
 void run_client(char *host, unsigned short port_num) {
-    int client_fd = connect_socket(host, port_num);
+    // A host that is a path is the server's unix socket.
+    bool local = host[0] == '/';
+    int client_fd = local ? connect_unix_socket(host) : connect_socket(host, port_num);
     if (client_fd < 0) {
         log_error("run_client: Could not connect to server %s:%d", host, port_num);
         return;
     }
 
+    if (spectator) {
+        msg_client_spectate spectate;
+        spectate.relay = 0;
+        send_message(client_fd, MSG_CLIENT_SPECTATE, &spectate);
+    } else {
+        msg_client_hello hello;
+        hello.player_id = player_id;
+        hello.resume_token = resume_token;
+        send_message(client_fd, MSG_CLIENT_HELLO, &hello);
+    }
+
+    if (use_ring && local) {
+        msg_ring_request request;
+        request.capacity = RING_DEFAULT_CAPACITY;
+        send_message(client_fd, MSG_RING_REQUEST, &request);
+    } else if (use_ring) {
+        log_error("run_client: A ring needs a server on the same host, reading from the socket instead.");
+    }
+
     initialize_screen();
 
     parent_pid = getpid();
@@ -227,5 +577,8 @@ void run_client(char *host, unsigned short port_num) {
         finalize_screen();
     }
 
+    if (ring_attached) {
+        ring_destroy(&ring);
+    }
     close(client_fd);
 }
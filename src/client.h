@@ -5,15 +5,81 @@
 #ifndef CSNAKE_CLIENT_H
 #define CSNAKE_CLIENT_H
 
-#include <pthread.h>
-#include "snake.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "history.h"
+#include "link.h"
+#include "ring.h"
+#include "store.h"
+#include "timer_wheel.h"
+
+// Enough for any message a client sends, plus the start of the next one.
+#define CLIENT_RX_BUFFER_SIZE 512
+// Bytes a client's socket may fall behind by before the client is disconnected.
+#define CLIENT_MAX_UNSENT (1024 * 1024)
+
+// What a client joined as.
+typedef enum {
+    ROLE_PLAYER,
+    ROLE_SPECTATOR, // Watches without a snake.
+    ROLE_RELAY // A spectator that passes the stream on to spectators of its own.
+} client_role_t;
 
 typedef struct {
     int client_socket;
-    pthread_t client_thread;
-    snake_t snake;
+    int shard; // Shard that owns the client. Only changes under clients_mutex, when the client joins.
+    int watch_id; // The client's socket in its shard's socket loop.
+    unsigned char rx_buffer[CLIENT_RX_BUFFER_SIZE]; // Received bytes not yet handled, only touched by its shard.
+    size_t rx_used;
+    // Messages queued for the next tick to hand to the send pipeline. Guarded by clients_mutex.
+    unsigned char *tx_buffer;
+    size_t tx_used;
+    size_t tx_capacity;
+    // Ticks in the send pipeline with bytes for the client. Added to by the simulation under clients_mutex, and taken
+    // from by the sender once it wrote them.
+    uint32_t inflight;
+    // Bytes the socket had no room for yet, which go out ahead of anything newer. Only touched by the sender, or by
+    // whoever holds the client once the pipeline is done with it. unsent_used is also read by the simulation.
+    unsigned char *unsent;
+    size_t unsent_used;
+    size_t unsent_capacity;
+    bool held; // Kept out of the pipeline while its socket is written to directly. Guarded by clients_mutex.
+    ring_t *ring; // Shared memory ring the client reads from instead of its socket, or NULL. Guarded by clients_mutex.
+    bool joined; // Set once the client's hello has been answered and it has a snake, or it is watching.
+    client_role_t role; // Set along with joined. Only a player has a snake in the world.
+    bool bot; // Steered by the server. A bot has no socket and is never sent anything.
+    bool awaiting_snapshot; // Joined, but its join snapshot is still being written. Guarded by clients_mutex.
+    uint32_t player_id; // Set when the client joins as a player, 0 before that or for a spectator.
+    uint32_t slot; // The client's slot in the player table, which has its snake. Guarded by clients_mutex.
+    uint32_t pending_key; // Latest arrow key since the last tick, or 0. Swapped atomically with the simulation.
+    double input_tokens; // Token bucket for input, only touched by the client's shard.
+    uint64_t input_refill_ns;
+    wheel_timer_t idle_timer; // Checks the client is still there, on its shard's timer wheel.
+    uint64_t heard_tick; // Wheel tick the client last sent anything on, only touched by its shard.
+    // The rest is guarded by clients_mutex.
+    uint64_t last_snapshot_tick; // Last tick the client was sent the snakes that moved.
+    uint64_t last_far_snapshot_tick; // Last tick far away snakes were included, for reduced detail.
+    uint64_t ping_tick; // Tick the client is next due a ping on, or 0 if it has not been given one yet.
+    link_t link;
+    position_history_t history; // Where the snake was on recent ticks.
+    uint32_t score; // Moves the snake made this session.
+    uint32_t resume_token; // What the client has to present to resume its snake after a restart.
+    uint64_t joined_ns; // When the session started, carried over hot upgrades.
+    session_end_t end_reason; // Why the session ended, recorded once the client is dropped.
 } client_t;
 
+// Asks the server to give back the snake of a player from an earlier connection, for example after a server crash.
+// The resume token is the one the server welcomed that player with.
+void client_set_player_id(uint32_t player_id, uint32_t resume_token);
+
+// Asks the server to send everything through a shared memory ring instead of the socket. Only used when connecting to
+// the server's unix socket.
+void client_set_ring(bool enabled);
+
+// Watches the game instead of playing, through a game server or a relay.
+void client_set_spectator(bool enabled);
+
 void run_client(char *host, unsigned short port_num);
 
 #endif //CSNAKE_CLIENT_H
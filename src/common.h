@@ -13,6 +13,9 @@
 #define WIDTH 38
 #define HEIGHT 20
 
+// The server applies player input once per tick.
+#define TICK_MS 50
+
 #endif //CSNAKE_COMMON_H
 
 #ifndef DEBUG
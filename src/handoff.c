@@ -0,0 +1,189 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "log.h"
+#include "socket.h"
+
+// Receives a record that must arrive with between one and max_count descriptors attached. Returns the number of
+// descriptors or -1.
+static int recv_with_fds(int fd, void *record, size_t size, int *passed_fds, int max_count) {
+    int fds[MAX_PASSED_FDS];
+    int fd_count = 0;
+
+    if (recv_fds(fd, record, size, fds, &fd_count) <= 0) {
+        log_error("recv_with_fds: The other process closed the handoff socket.");
+        return -1;
+    }
+
+    if (fd_count < 1 || fd_count > max_count) {
+        log_error("recv_with_fds: Expected up to %d descriptors but received %d", max_count, fd_count);
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    memcpy(passed_fds, fds, sizeof(int) * fd_count);
+    return fd_count;
+}
+
+// Closes the descriptors of a record that did not carry what it said it would.
+static int reject_fds(const int *fds, int fd_count, const char *record_name) {
+    log_error("reject_fds: The %s record came with %d descriptors", record_name, fd_count);
+    for (int i = 0; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    return -1;
+}
+
+int handoff_send_header(int fd, uint32_t next_player_id, uint32_t player_id_stride, uint32_t client_count,
+                        uint32_t orphan_count, const handoff_listeners_t *listeners) {
+    handoff_header_t header;
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.next_player_id = next_player_id;
+    header.client_count = client_count;
+    header.player_id_stride = player_id_stride;
+    header.orphan_count = orphan_count;
+    header.local_listener = listeners->local_fd != -1;
+    header.route_listener = listeners->route_fd != -1;
+    header.router_connection = listeners->router_fd != -1;
+
+    // Only the descriptors the server has are sent, in this order.
+    int fds[4];
+    int fd_count = 0;
+    fds[fd_count++] = listeners->listen_fd;
+    if (header.local_listener) {
+        fds[fd_count++] = listeners->local_fd;
+    }
+    if (header.route_listener) {
+        fds[fd_count++] = listeners->route_fd;
+    }
+    if (header.router_connection) {
+        fds[fd_count++] = listeners->router_fd;
+    }
+    if (send_fds(fd, &header, sizeof(header), fds, fd_count) <= 0) {
+        log_error("handoff_send_header: Could not send the listening sockets.");
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_send_client(int fd, const snake_t *snake, bool joined, uint32_t role, const handoff_session_t *session,
+                        const handoff_pending_t *pending, const unsigned char *unsent, int client_fd,
+                        const ring_t *ring) {
+    handoff_client_t record;
+    memset(&record, 0, sizeof(record));
+    record.snake = *snake;
+    record.session = *session;
+    record.pending = *pending;
+    record.joined = joined;
+    record.role = role;
+    record.ring = ring != NULL;
+
+    int fds[3] = {client_fd, ring ? ring->memory_fd : -1, ring ? ring->event_fd : -1};
+    if (send_fds(fd, &record, sizeof(record), fds, ring ? 3 : 1) <= 0) {
+        log_error("handoff_send_client: Could not send client [%d]", client_fd);
+        return -1;
+    }
+    if (pending->unsent_size > 0 && ssend(fd, (void *) unsent, pending->unsent_size) <= 0) {
+        log_error("handoff_send_client: Could not send the unsent bytes of client [%d]", client_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_send_orphans(int fd, const checkpoint_player_t *orphans, uint32_t orphan_count) {
+    if (orphan_count > 0 && ssend(fd, (void *) orphans, sizeof(checkpoint_player_t) * orphan_count) <= 0) {
+        log_error("handoff_send_orphans: Could not send %d recovered players", orphan_count);
+        return -1;
+    }
+    return 0;
+}
+
+int handoff_recv_header(int fd, handoff_header_t *header, handoff_listeners_t *listeners) {
+    int fds[4];
+    int fd_count = recv_with_fds(fd, header, sizeof(handoff_header_t), fds, 4);
+    if (fd_count < 0) {
+        return -1;
+    }
+
+    if (header->magic != HANDOFF_MAGIC || header->version != HANDOFF_VERSION) {
+        log_error("handoff_recv_header: Incompatible handoff header (magic %x, version %d)", header->magic,
+                  header->version);
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    int expected = 1 + (header->local_listener != 0) + (header->route_listener != 0) + (header->router_connection != 0);
+    if (fd_count != expected) {
+        return reject_fds(fds, fd_count, "header");
+    }
+
+    int next = 0;
+    listeners->listen_fd = fds[next++];
+    listeners->local_fd = header->local_listener ? fds[next++] : -1;
+    listeners->route_fd = header->route_listener ? fds[next++] : -1;
+    listeners->router_fd = header->router_connection ? fds[next++] : -1;
+    return 0;
+}
+
+int handoff_recv_client(int fd, snake_t *snake, bool *joined, uint32_t *role, handoff_session_t *session,
+                        handoff_pending_t *pending, unsigned char **unsent, int *client_fd, int *ring_fds) {
+    handoff_client_t record;
+    int fds[3];
+    int fd_count = recv_with_fds(fd, &record, sizeof(record), fds, 3);
+    if (fd_count < 0) {
+        return -1;
+    }
+    if (fd_count != (record.ring ? 3 : 1)) {
+        return reject_fds(fds, fd_count, "client");
+    }
+    if (record.pending.rx_used > HANDOFF_RX_SIZE) {
+        log_error("handoff_recv_client: The client record says it holds %d received bytes", record.pending.rx_used);
+        return reject_fds(fds, fd_count, "client");
+    }
+
+    *unsent = NULL;
+    if (record.pending.unsent_size > 0) {
+        *unsent = malloc(record.pending.unsent_size);
+        if (*unsent == NULL || srecv(fd, *unsent, record.pending.unsent_size) <= 0) {
+            log_error("handoff_recv_client: Could not receive %d unsent bytes", record.pending.unsent_size);
+            free(*unsent);
+            *unsent = NULL;
+            for (int i = 0; i < fd_count; i++) {
+                close(fds[i]);
+            }
+            return -1;
+        }
+    }
+
+    *snake = record.snake;
+    *session = record.session;
+    *pending = record.pending;
+    *joined = record.joined != 0;
+    *role = record.role;
+    *client_fd = fds[0];
+    ring_fds[0] = record.ring ? fds[1] : -1;
+    ring_fds[1] = record.ring ? fds[2] : -1;
+    return 0;
+}
+
+int handoff_recv_orphans(int fd, uint32_t orphan_count, checkpoint_player_t **orphans) {
+    *orphans = malloc(sizeof(checkpoint_player_t) * (orphan_count ? orphan_count : 1));
+    if (*orphans == NULL ||
+        (orphan_count > 0 && srecv(fd, *orphans, sizeof(checkpoint_player_t) * orphan_count) <= 0)) {
+        log_error("handoff_recv_orphans: Could not receive %d recovered players", orphan_count);
+        free(*orphans);
+        *orphans = NULL;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_HANDOFF_H
+#define CSNAKE_HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "checkpoint.h"
+#include "ring.h"
+#include "snake.h"
+
+//
+// Hot upgrade protocol. A running server listens on a unix socket; a newly started server connects to it and
+// receives the listening sockets followed by every live client socket together with that client's snake and whatever
+// the client was part way through: the start of a message it had not finished sending, bytes the old process had not
+// managed to send it yet, and whether it still waits for its join snapshot. A client that reads through a shared
+// memory ring also brings the ring's memfd and eventfd, so it carries on where it was. A server behind a lobby router
+// also passes on its route socket and the router's connection, so the router never notices the upgrade. Players
+// recovered from a checkpoint that have not come back yet follow the clients, so they can still resume their snakes.
+// Both ends are the same binary on the same host, so records are sent in native byte order.
+//
+
+#define HANDOFF_MAGIC 0x43534e4b // "CSNK"
+#define HANDOFF_VERSION 10
+// Received bytes a client record can carry, at least the size of a client's receive buffer.
+#define HANDOFF_RX_SIZE 512
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t next_player_id;
+    uint32_t client_count;
+    uint32_t player_id_stride; // Ids are handed out this far apart behind a router, or 1.
+    uint32_t local_listener; // Whether a unix listening socket follows the TCP one.
+    uint32_t route_listener; // Whether the route socket follows.
+    uint32_t router_connection; // Whether the router's connection follows.
+    uint32_t orphan_count; // Recovered players that have not come back yet, sent after the clients.
+} handoff_header_t;
+
+// Descriptors that come with the header. Those a server does not have are -1.
+typedef struct {
+    int listen_fd;
+    int local_fd;
+    int route_fd;
+    int router_fd;
+} handoff_listeners_t;
+
+// Progress of a player's session so far, so it is recorded as one session when it ends, and the token that resumes the
+// player after a restart.
+typedef struct {
+    uint32_t score;
+    uint32_t play_time_ms;
+    uint32_t resume_token;
+} handoff_session_t;
+
+// What a client was part way through when the server handed it off.
+typedef struct {
+    uint32_t awaiting_snapshot; // Whether the client was still waiting for its join snapshot.
+    uint32_t rx_used;
+    unsigned char rx_buffer[HANDOFF_RX_SIZE]; // Received bytes not yet handled, the start of a message.
+    uint32_t unsent_size; // Bytes still to be sent to the client, which follow the record.
+} handoff_pending_t;
+
+typedef struct {
+    snake_t snake;
+    handoff_session_t session;
+    handoff_pending_t pending;
+    uint32_t joined; // Whether the client already completed its hello.
+    uint32_t role; // What the client joined as, a client_role_t.
+    uint32_t ring; // Whether the client's ring memfd and eventfd follow its socket.
+} handoff_client_t;
+
+// Sends the header along with the listening sockets. Returns 0 on success or -1 otherwise.
+int handoff_send_header(int fd, uint32_t next_player_id, uint32_t player_id_stride, uint32_t client_count,
+                        uint32_t orphan_count, const handoff_listeners_t *listeners);
+// Sends one client socket along with the client's snake, role, session, pending work with its unsent bytes, and ring,
+// which may be NULL. Returns 0 on success or -1 otherwise.
+int handoff_send_client(int fd, const snake_t *snake, bool joined, uint32_t role, const handoff_session_t *session,
+                        const handoff_pending_t *pending, const unsigned char *unsent, int client_fd,
+                        const ring_t *ring);
+// Sends the recovered players that have not come back yet, with the tokens they resume with. Returns 0 on success or
+// -1 otherwise.
+int handoff_send_orphans(int fd, const checkpoint_player_t *orphans, uint32_t orphan_count);
+
+// Receives the header and the listening sockets. Returns 0 on success or -1 otherwise.
+int handoff_recv_header(int fd, handoff_header_t *header, handoff_listeners_t *listeners);
+// Receives one client socket with its snake, role, session and pending work. unsent is set to a buffer of the unsent
+// bytes for the caller to free, or NULL if there are none. ring_fds is set to the ring's memfd and eventfd, or to -1 if
+// the client has no ring. Returns 0 on success or -1 otherwise.
+int handoff_recv_client(int fd, snake_t *snake, bool *joined, uint32_t *role, handoff_session_t *session,
+                        handoff_pending_t *pending, unsigned char **unsent, int *client_fd, int *ring_fds);
+// Receives the number of recovered players the header announced, into a malloc'd array owned by the caller. Returns 0
+// on success or -1 otherwise.
+int handoff_recv_orphans(int fd, uint32_t orphan_count, checkpoint_player_t **orphans);
+
+#endif //CSNAKE_HANDOFF_H
@@ -0,0 +1,59 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <string.h>
+
+#include "history.h"
+
+static int slot(uint64_t tick) {
+    return (int) (tick & (HISTORY_TICKS - 1));
+}
+
+static bool on_board(int x, int y) {
+    return x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT;
+}
+
+void world_history_init(world_history_t *history) {
+    memset(history, 0, sizeof(world_history_t));
+}
+
+void world_history_begin(world_history_t *history, uint64_t tick) {
+    history->ticks[slot(tick)] = tick;
+    memset(history->counts[slot(tick)], 0, sizeof(history->counts[0]));
+}
+
+void world_history_record(world_history_t *history, uint64_t tick, position_history_t *snake_history,
+                          const snake_t *snake) {
+    if (snake_history->since_tick == 0) {
+        snake_history->since_tick = tick;
+    }
+    snake_history->positions[slot(tick)].x = snake->x;
+    snake_history->positions[slot(tick)].y = snake->y;
+
+    if (on_board(snake->x, snake->y)) {
+        uint8_t *count = &history->counts[slot(tick)][snake->y * WIDTH + snake->x];
+        if (*count < UINT8_MAX) {
+            (*count)++;
+        }
+    }
+}
+
+bool world_history_has(const world_history_t *history, uint64_t tick) {
+    return tick != 0 && history->ticks[slot(tick)] == tick;
+}
+
+bool world_history_occupied(const world_history_t *history, uint64_t tick, int x, int y,
+                            const position_history_t *self) {
+    if (!on_board(x, y)) {
+        return false;
+    }
+
+    int count = history->counts[slot(tick)][y * WIDTH + x];
+    // The snake itself does not stand in its own way.
+    if (self->since_tick != 0 && self->since_tick <= tick && self->positions[slot(tick)].x == x &&
+        self->positions[slot(tick)].y == y) {
+        count--;
+    }
+    return count > 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_HISTORY_H
+#define CSNAKE_HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "common.h"
+#include "snake.h"
+
+//
+// Recent past of the world, for judging a player's move against the world as the player saw it rather than the one
+// the server has moved on to. Each snake keeps its position on each of the last HISTORY_TICKS ticks, and the board
+// keeps how many snakes were on each cell on those ticks. Everything is indexed by tick modulo HISTORY_TICKS, so
+// recording a tick overwrites the oldest one and memory stays fixed.
+//
+
+// A power of two, and more than any rewind the server allows: 800 ms at the current tick rate.
+#define HISTORY_TICKS 16
+
+typedef struct {
+    int16_t x, y;
+} position_t;
+
+// One snake's past positions. The positions fill exactly one cache line.
+typedef struct {
+    position_t positions[HISTORY_TICKS];
+    uint64_t since_tick; // First tick recorded, or 0 if none was.
+} position_history_t;
+
+typedef struct {
+    uint64_t ticks[HISTORY_TICKS]; // Tick each slot holds, or 0 if none.
+    uint8_t counts[HISTORY_TICKS][WIDTH * HEIGHT]; // Snakes on each cell, saturating at 255.
+} world_history_t;
+
+void world_history_init(world_history_t *history);
+// Starts recording a tick, replacing the oldest one.
+void world_history_begin(world_history_t *history, uint64_t tick);
+// Records where a snake is on the tick being recorded.
+void world_history_record(world_history_t *history, uint64_t tick, position_history_t *snake_history,
+                          const snake_t *snake);
+// Whether the given tick is still in the history.
+bool world_history_has(const world_history_t *history, uint64_t tick);
+// Whether a snake other than the one with the given history was on the cell at the given tick, which must be in the
+// history. Cells off the board are never occupied.
+bool world_history_occupied(const world_history_t *history, uint64_t tick, int x, int y,
+                            const position_history_t *self);
+
+#endif //CSNAKE_HISTORY_H
@@ -0,0 +1,82 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include "link.h"
+
+// Thresholds for slowing a link down and speeding it back up. The gap between them keeps a link from flapping.
+#define SEND_QUEUE_HIGH 16384
+#define SEND_QUEUE_LOW 2048
+#define RTT_HIGH_US 300000
+#define RTT_LOW_US 150000
+// A link is backlogged once its send buffer holds more than this many milliseconds of its throughput, or
+// SEND_QUEUE_HIGH bytes while the throughput is still low or unknown.
+#define BACKLOG_MS 250
+
+void link_init(link_t *link, uint64_t now_ns) {
+    link->srtt_us = 0;
+    link->rttvar_us = 0;
+    link->throughput_bps = 0;
+    link->bytes_sent = 0;
+    link->bytes_sent_at_adapt = 0;
+    link->send_queue_at_adapt = 0;
+    link->adapted_at_ns = now_ns;
+    link->update_interval = 1;
+    link->detail = DETAIL_FULL;
+}
+
+void link_rtt_sample(link_t *link, uint32_t rtt_us) {
+    if (link->srtt_us == 0) {
+        link->srtt_us = rtt_us;
+        link->rttvar_us = rtt_us / 2;
+        return;
+    }
+
+    // RFC 6298: rttvar gets 1/4 of the new deviation and srtt 1/8 of the new sample.
+    uint32_t deviation = rtt_us > link->srtt_us ? rtt_us - link->srtt_us : link->srtt_us - rtt_us;
+    link->rttvar_us = link->rttvar_us - link->rttvar_us / 4 + deviation / 4;
+    link->srtt_us = link->srtt_us - link->srtt_us / 8 + rtt_us / 8;
+}
+
+bool link_adapt(link_t *link, int send_queue, size_t unsent, uint64_t now_ns) {
+    // Whatever was sent and is no longer queued has been delivered to the peer.
+    uint64_t elapsed_ns = now_ns - link->adapted_at_ns;
+    int64_t delivered = (int64_t) (link->bytes_sent - link->bytes_sent_at_adapt) -
+                        (send_queue - link->send_queue_at_adapt);
+    if (elapsed_ns > 0 && delivered >= 0) {
+        uint32_t sample = (uint32_t) ((uint64_t) delivered * 1000000000u / elapsed_ns);
+        link->throughput_bps = link->throughput_bps - link->throughput_bps / 4 + sample / 4;
+    }
+    link->bytes_sent_at_adapt = link->bytes_sent;
+    link->send_queue_at_adapt = send_queue;
+    link->adapted_at_ns = now_ns;
+
+    uint32_t interval = link->update_interval;
+    if (unsent > 0 || send_queue > SEND_QUEUE_HIGH || link->srtt_us > RTT_HIGH_US) {
+        if (interval < LINK_MAX_UPDATE_INTERVAL) {
+            interval *= 2;
+        }
+    } else if (send_queue < SEND_QUEUE_LOW && link->srtt_us < RTT_LOW_US) {
+        if (interval > 1) {
+            interval /= 2;
+        }
+    }
+
+    detail_level_t detail = interval >= LINK_REDUCED_DETAIL_INTERVAL ? DETAIL_REDUCED : DETAIL_FULL;
+    bool changed = interval != link->update_interval || detail != link->detail;
+    link->update_interval = interval;
+    link->detail = detail;
+    return changed;
+}
+
+bool link_backlogged(const link_t *link, size_t unsent) {
+    uint64_t budget = (uint64_t) link->throughput_bps * BACKLOG_MS / 1000;
+    if (budget < SEND_QUEUE_HIGH) {
+        budget = SEND_QUEUE_HIGH;
+    }
+    return unsent > 0 || (uint64_t) link->send_queue_at_adapt > budget;
+}
+
+const char * detail_level_name(detail_level_t detail) {
+    return detail == DETAIL_FULL ? "full" : "reduced";
+}
@@ -0,0 +1,53 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_LINK_H
+#define CSNAKE_LINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Per connection link estimates and the update rate the server picks from them. Round trip time comes from pings
+// and is smoothed the same way TCP does it, while throughput is what actually left the socket send buffer between two
+// adaptations.
+//
+
+// Snapshots go out every 1, 2, 4 or 8 ticks.
+#define LINK_MAX_UPDATE_INTERVAL 8
+// At this interval or slower, far away snakes are only refreshed on every LINK_FAR_SNAPSHOT_FACTOR'th snapshot.
+#define LINK_REDUCED_DETAIL_INTERVAL 4
+#define LINK_FAR_SNAPSHOT_FACTOR 4
+
+typedef enum {
+    DETAIL_FULL,
+    DETAIL_REDUCED
+} detail_level_t;
+
+typedef struct {
+    uint32_t srtt_us;   // Smoothed round trip time, 0 until the first sample.
+    uint32_t rttvar_us;
+    uint32_t throughput_bps;
+    uint64_t bytes_sent;
+    uint64_t bytes_sent_at_adapt;
+    int send_queue_at_adapt;
+    uint64_t adapted_at_ns;
+    uint32_t update_interval; // Ticks between snapshots.
+    detail_level_t detail;
+} link_t;
+
+void link_init(link_t *link, uint64_t now_ns);
+void link_rtt_sample(link_t *link, uint32_t rtt_us);
+// Updates the throughput estimate and picks the update rate for the link. send_queue is the number of bytes still
+// waiting in the socket's send buffer, and unsent the number the socket had no room for yet. Returns true if the update
+// interval or detail level changed.
+bool link_adapt(link_t *link, int send_queue, size_t unsent, uint64_t now_ns);
+// Whether the link is too far behind to be sent another snapshot, going by the send queue sampled on the last
+// adaptation and the number of bytes the socket has had no room for since.
+bool link_backlogged(const link_t *link, size_t unsent);
+
+const char * detail_level_name(detail_level_t detail);
+
+#endif //CSNAKE_LINK_H
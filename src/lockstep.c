@@ -0,0 +1,446 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ncurses.h>
+
+#include "lockstep.h"
+#include "log.h"
+
+// Where an input's snake goes, other than a cell of the board.
+#define TARGET_OFF_BOARD (-1)
+#define TARGET_BLOCKED (-2)
+#define NO_BAND UINT16_MAX
+
+#define BENCHMARK_TICKS 200
+// The benchmark board has this many cells for each snake.
+#define BENCHMARK_CELLS_PER_SNAKE 4
+
+typedef struct lockstep_worker {
+    lockstep_grid_t *grid;
+    int index;
+} lockstep_worker_t;
+
+static void *run_worker(void *arg);
+
+static bool on_board(const lockstep_grid_t *grid, int x, int y) {
+    return x >= 0 && x < grid->width && y >= 0 && y < grid->height;
+}
+
+int lockstep_grid_init(lockstep_grid_t *grid, int width, int height, int worker_count) {
+    memset(grid, 0, sizeof(lockstep_grid_t));
+    grid->width = width;
+    grid->height = height;
+    // A band needs at least one row.
+    grid->worker_count = worker_count < 1 ? 1 : worker_count > height ? height : worker_count;
+    size_t cells = (size_t) width * height;
+    size_t workers = (size_t) grid->worker_count;
+    grid->cells = calloc(cells, sizeof(uint16_t));
+    grid->claims = malloc(cells * sizeof(uint64_t));
+    grid->counts = malloc(workers * workers * sizeof(uint32_t));
+    grid->band_starts = malloc((workers + 1) * sizeof(uint32_t));
+    grid->band_moves = malloc(workers * sizeof(uint32_t));
+    if (grid->cells == NULL || grid->claims == NULL || grid->counts == NULL || grid->band_starts == NULL ||
+        grid->band_moves == NULL) {
+        log_error("lockstep_grid_init: No memory for a %dx%d grid", width, height);
+        lockstep_grid_destroy(grid);
+        return -1;
+    }
+    memset(grid->claims, 0xff, cells * sizeof(uint64_t));
+
+    if (grid->worker_count > 1) {
+        pthread_barrier_init(&grid->barrier, NULL, (unsigned) grid->worker_count);
+        grid->workers = malloc(sizeof(pthread_t) * workers);
+        grid->worker_args = malloc(sizeof(lockstep_worker_t) * workers);
+        for (int i = 1; i < grid->worker_count; i++) {
+            grid->worker_args[i].grid = grid;
+            grid->worker_args[i].index = i;
+            pthread_create(&grid->workers[i], NULL, run_worker, &grid->worker_args[i]);
+        }
+    }
+    return 0;
+}
+
+void lockstep_grid_destroy(lockstep_grid_t *grid) {
+    if (grid->workers) {
+        grid->stopping = true;
+        pthread_barrier_wait(&grid->barrier);
+        for (int i = 1; i < grid->worker_count; i++) {
+            pthread_join(grid->workers[i], NULL);
+        }
+        free(grid->workers);
+        free(grid->worker_args);
+        pthread_barrier_destroy(&grid->barrier);
+    }
+    free(grid->cells);
+    free(grid->claims);
+    free(grid->slots);
+    free(grid->targets);
+    free(grid->bands);
+    free(grid->order);
+    free(grid->counts);
+    free(grid->band_starts);
+    free(grid->band_moves);
+    memset(grid, 0, sizeof(lockstep_grid_t));
+}
+
+void lockstep_grid_clear(lockstep_grid_t *grid) {
+    memset(grid->cells, 0, (size_t) grid->width * grid->height * sizeof(uint16_t));
+}
+
+void lockstep_grid_add(lockstep_grid_t *grid, int x, int y) {
+    if (on_board(grid, x, y)) {
+        grid->cells[y * grid->width + x]++;
+    }
+}
+
+void lockstep_grid_remove(lockstep_grid_t *grid, int x, int y) {
+    if (on_board(grid, x, y) && grid->cells[y * grid->width + x] > 0) {
+        grid->cells[y * grid->width + x]--;
+    }
+}
+
+int lockstep_direction(uint32_t key_code) {
+    switch (key_code) {
+        case KEY_UP:
+            return LOCKSTEP_UP;
+        case KEY_DOWN:
+            return LOCKSTEP_DOWN;
+        case KEY_LEFT:
+            return LOCKSTEP_LEFT;
+        case KEY_RIGHT:
+            return LOCKSTEP_RIGHT;
+        default:
+            return -1;
+    }
+}
+
+// Moves a position one cell in a direction.
+static void step_toward(uint8_t direction, int *x, int *y) {
+    switch (direction) {
+        case LOCKSTEP_UP:
+            (*y)--;
+            break;
+        case LOCKSTEP_DOWN:
+            (*y)++;
+            break;
+        case LOCKSTEP_LEFT:
+            (*x)--;
+            break;
+        default:
+            (*x)++;
+            break;
+    }
+}
+
+// Waits for every band to reach the same point of the step.
+static void wait_for_bands(lockstep_grid_t *grid) {
+    if (grid->worker_count > 1) {
+        pthread_barrier_wait(&grid->barrier);
+    }
+}
+
+// The band of rows a snake is stepped in. Snakes off the board are stepped with the nearest row.
+static uint16_t band_of(const lockstep_grid_t *grid, int y) {
+    y = y < 0 ? 0 : y >= grid->height ? grid->height - 1 : y;
+    return (uint16_t) ((int64_t) y * grid->worker_count / grid->height);
+}
+
+// A player's claim on a cell in the current step. Claims of earlier steps compare as larger.
+static uint64_t claim_of(const lockstep_grid_t *grid, uint32_t player_id) {
+    return (uint64_t) (UINT32_MAX - grid->generation) << 32 | player_id;
+}
+
+// Sorts this thread's share of the inputs into the bands their snakes are in, so each band's inputs are together.
+static void sort_into_bands(lockstep_grid_t *grid, int index) {
+    player_table_t *table = grid->table;
+    uint32_t workers = (uint32_t) grid->worker_count;
+    uint32_t first = (uint32_t) ((uint64_t) grid->input_count * index / workers);
+    uint32_t last = (uint32_t) ((uint64_t) grid->input_count * (index + 1) / workers);
+    uint32_t *counts = grid->counts + index * workers;
+    memset(counts, 0, workers * sizeof(uint32_t));
+
+    for (uint32_t i = first; i < last; i++) {
+        uint32_t slot = player_table_find(table, grid->inputs[i].player_id);
+        grid->slots[i] = slot;
+        grid->bands[i] = slot == PLAYER_SLOT_NONE ? NO_BAND : band_of(grid, table->ys[slot]);
+        if (grid->bands[i] != NO_BAND) {
+            counts[grid->bands[i]]++;
+        } else if (grid->moved) {
+            grid->moved[i] = false;
+        }
+    }
+    wait_for_bands(grid);
+
+    // Each thread's count of each band becomes where it writes its inputs of that band.
+    if (index == 0) {
+        uint32_t offset = 0;
+        for (uint32_t band = 0; band < workers; band++) {
+            grid->band_starts[band] = offset;
+            for (uint32_t worker = 0; worker < workers; worker++) {
+                uint32_t count = grid->counts[worker * workers + band];
+                grid->counts[worker * workers + band] = offset;
+                offset += count;
+            }
+        }
+        grid->band_starts[workers] = offset;
+    }
+    wait_for_bands(grid);
+
+    for (uint32_t i = first; i < last; i++) {
+        if (grid->bands[i] != NO_BAND) {
+            grid->order[counts[grid->bands[i]]++] = i;
+        }
+    }
+    wait_for_bands(grid);
+}
+
+// Works out where each snake of a band wants to go, claiming the cell unless a snake was already on it.
+static void propose_moves(lockstep_grid_t *grid, int index) {
+    player_table_t *table = grid->table;
+    for (uint32_t k = grid->band_starts[index]; k < grid->band_starts[index + 1]; k++) {
+        uint32_t i = grid->order[k];
+        uint32_t slot = grid->slots[i];
+        int x = table->xs[slot];
+        int y = table->ys[slot];
+        step_toward(grid->inputs[i].direction, &x, &y);
+
+        if (!on_board(grid, x, y)) {
+            grid->targets[i] = TARGET_OFF_BOARD;
+            continue;
+        }
+        int32_t cell = y * grid->width + x;
+        if (grid->cells[cell] > 0) {
+            grid->targets[i] = TARGET_BLOCKED;
+            continue;
+        }
+        grid->targets[i] = cell;
+
+        // The cell may be claimed from a neighbouring band at the same time, so the lowest claim is kept atomically.
+        uint64_t claim = claim_of(grid, grid->inputs[i].player_id);
+        uint64_t seen = __atomic_load_n(&grid->claims[cell], __ATOMIC_RELAXED);
+        while (claim < seen &&
+               !__atomic_compare_exchange_n(&grid->claims[cell], &seen, claim, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    wait_for_bands(grid);
+}
+
+// Moves the snakes of a band that won their claims. A cell moved onto was empty, so no snake leaves it, and only its
+// winner moves onto it, so no two threads ever touch the same cell.
+static void resolve_moves(lockstep_grid_t *grid, int index) {
+    player_table_t *table = grid->table;
+    uint32_t moves = 0;
+    for (uint32_t k = grid->band_starts[index]; k < grid->band_starts[index + 1]; k++) {
+        uint32_t i = grid->order[k];
+        int32_t target = grid->targets[i];
+        bool moved = target == TARGET_OFF_BOARD ||
+                     (target >= 0 && __atomic_load_n(&grid->claims[target], __ATOMIC_RELAXED) ==
+                                     claim_of(grid, grid->inputs[i].player_id));
+        if (grid->moved) {
+            grid->moved[i] = moved;
+        }
+        if (!moved) {
+            continue;
+        }
+
+        uint32_t slot = grid->slots[i];
+        lockstep_grid_remove(grid, table->xs[slot], table->ys[slot]);
+        int x = table->xs[slot];
+        int y = table->ys[slot];
+        step_toward(grid->inputs[i].direction, &x, &y);
+        lockstep_grid_add(grid, x, y);
+        table->xs[slot] = (int16_t) x;
+        table->ys[slot] = (int16_t) y;
+        moves++;
+    }
+    grid->band_moves[index] = moves;
+}
+
+static void step_band(lockstep_grid_t *grid, int index) {
+    sort_into_bands(grid, index);
+    propose_moves(grid, index);
+    resolve_moves(grid, index);
+}
+
+static void *run_worker(void *arg) {
+    lockstep_worker_t worker = *(lockstep_worker_t *) arg;
+    lockstep_grid_t *grid = worker.grid;
+    while (true) {
+        pthread_barrier_wait(&grid->barrier);
+        if (grid->stopping) {
+            return NULL;
+        }
+        step_band(grid, worker.index);
+        pthread_barrier_wait(&grid->barrier);
+    }
+}
+
+// Makes room for a step's inputs. Returns false if there is no memory for them.
+static bool reserve_scratch(lockstep_grid_t *grid, uint32_t input_count) {
+    if (input_count <= grid->scratch_capacity) {
+        return true;
+    }
+    uint32_t capacity = grid->scratch_capacity ? grid->scratch_capacity : 64;
+    while (capacity < input_count) {
+        capacity *= 2;
+    }
+    uint32_t *slots = realloc(grid->slots, sizeof(uint32_t) * capacity);
+    grid->slots = slots ? slots : grid->slots;
+    int32_t *targets = realloc(grid->targets, sizeof(int32_t) * capacity);
+    grid->targets = targets ? targets : grid->targets;
+    uint16_t *bands = realloc(grid->bands, sizeof(uint16_t) * capacity);
+    grid->bands = bands ? bands : grid->bands;
+    uint32_t *order = realloc(grid->order, sizeof(uint32_t) * capacity);
+    grid->order = order ? order : grid->order;
+    if (slots == NULL || targets == NULL || bands == NULL || order == NULL) {
+        log_error("reserve_scratch: No memory to step %d inputs", input_count);
+        return false;
+    }
+    grid->scratch_capacity = capacity;
+    return true;
+}
+
+int64_t lockstep_step(lockstep_grid_t *grid, player_table_t *table, const tick_input_t *inputs, uint32_t input_count,
+                      bool *moved) {
+    if (!reserve_scratch(grid, input_count)) {
+        return -1;
+    }
+    if (grid->generation == UINT32_MAX) {
+        memset(grid->claims, 0xff, (size_t) grid->width * grid->height * sizeof(uint64_t));
+        grid->generation = 0;
+    }
+    grid->generation++;
+    grid->table = table;
+    grid->inputs = inputs;
+    grid->input_count = input_count;
+    grid->moved = moved;
+
+    // The workers are let go together, and step_band ends when every band is done.
+    wait_for_bands(grid);
+    step_band(grid, 0);
+    wait_for_bands(grid);
+
+    int64_t moves = 0;
+    for (int i = 0; i < grid->worker_count; i++) {
+        moves += grid->band_moves[i];
+    }
+    return moves;
+}
+
+// Mixes a snake into 64 well spread bits, so that summing them makes a hash that does not depend on order.
+static uint64_t mix_snake(uint32_t player_id, int16_t x, int16_t y) {
+    uint64_t value = (uint64_t) player_id << 32 | (uint64_t) (uint16_t) x << 16 | (uint16_t) y;
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdull;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ull;
+    value ^= value >> 33;
+    return value;
+}
+
+uint32_t lockstep_hash(const player_table_t *table) {
+    uint64_t hash = 0;
+    for (uint32_t slot = 0; slot < table->end; slot++) {
+        if (table->used[slot] && table->player_ids[slot] != 0) {
+            hash += mix_snake(table->player_ids[slot], table->xs[slot], table->ys[slot]);
+        }
+    }
+    return (uint32_t) (hash ^ hash >> 32);
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) + (double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Steps a random world for the benchmark, only timing the steps themselves. Returns the seconds taken, or a negative
+// number if there was no memory.
+static double run_benchmark(player_table_t *table, uint32_t snake_count, int side, int worker_count,
+                            uint64_t *moves) {
+    lockstep_grid_t grid;
+    tick_input_t *inputs = malloc(sizeof(tick_input_t) * snake_count);
+    if (inputs == NULL || lockstep_grid_init(&grid, side, side, worker_count)) {
+        free(inputs);
+        return -1;
+    }
+
+    // The same seed puts the snakes in the same places and gives them the same inputs for every run.
+    unsigned int seed = 1;
+    for (uint32_t i = 0; i < snake_count; i++) {
+        uint32_t slot = player_table_add(table, NULL, -1);
+        if (slot == PLAYER_SLOT_NONE) {
+            free(inputs);
+            lockstep_grid_destroy(&grid);
+            return -1;
+        }
+        player_table_set_id(table, slot, i + 1);
+        table->xs[slot] = (int16_t) (rand_r(&seed) % side);
+        table->ys[slot] = (int16_t) (rand_r(&seed) % side);
+        lockstep_grid_add(&grid, table->xs[slot], table->ys[slot]);
+        inputs[i].player_id = i + 1;
+    }
+
+    double elapsed = 0;
+    *moves = 0;
+    for (int tick = 0; tick < BENCHMARK_TICKS; tick++) {
+        for (uint32_t i = 0; i < snake_count; i++) {
+            inputs[i].direction = (uint8_t) (rand_r(&seed) & 3);
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        *moves += (uint64_t) lockstep_step(&grid, table, inputs, snake_count, NULL);
+        elapsed += seconds_since(&start);
+    }
+
+    free(inputs);
+    lockstep_grid_destroy(&grid);
+    return elapsed;
+}
+
+void lockstep_benchmark(uint32_t snake_count, int worker_count) {
+    int side = 1;
+    while ((uint64_t) side * side < (uint64_t) snake_count * BENCHMARK_CELLS_PER_SNAKE) {
+        side++;
+    }
+    if (side > INT16_MAX) {
+        log_error("lockstep_benchmark: Cannot fit %d snakes on a board", snake_count);
+        return;
+    }
+
+    player_table_t serial;
+    player_table_t parallel;
+    player_table_init(&serial);
+    player_table_init(&parallel);
+    uint64_t serial_moves;
+    uint64_t parallel_moves;
+    double serial_time = run_benchmark(&serial, snake_count, side, 1, &serial_moves);
+    double parallel_time = run_benchmark(&parallel, snake_count, side, worker_count, &parallel_moves);
+    if (serial_time < 0 || parallel_time < 0) {
+        log_error("lockstep_benchmark: No memory for %d snakes", snake_count);
+        player_table_destroy(&serial);
+        player_table_destroy(&parallel);
+        return;
+    }
+
+    // Both worlds were built the same way, so every snake is in the same slot of each.
+    bool same = serial_moves == parallel_moves && lockstep_hash(&serial) == lockstep_hash(&parallel) &&
+                memcmp(serial.xs, parallel.xs, sizeof(int16_t) * serial.end) == 0 &&
+                memcmp(serial.ys, parallel.ys, sizeof(int16_t) * serial.end) == 0;
+
+    printf("%u snakes on a %dx%d board for %d ticks, %.1f%% of snake-ticks moved\n", snake_count, side, side,
+           BENCHMARK_TICKS, 100.0 * serial_moves / ((double) snake_count * BENCHMARK_TICKS));
+    printf("1 thread: %.3f s, %.0f snake-ticks/s\n", serial_time, snake_count * BENCHMARK_TICKS / serial_time);
+    printf("%d threads: %.3f s, %.0f snake-ticks/s, %.2fx\n", worker_count, parallel_time,
+           snake_count * BENCHMARK_TICKS / parallel_time, serial_time / parallel_time);
+    printf("The worlds %s\n", same ? "match" : "DIFFER");
+
+    player_table_destroy(&serial);
+    player_table_destroy(&parallel);
+}
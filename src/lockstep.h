@@ -0,0 +1,94 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_LOCKSTEP_H
+#define CSNAKE_LOCKSTEP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "common.h"
+#include "player_table.h"
+
+//
+// The deterministic step shared by a lockstep server and its clients. Clients are sent only each tick's inputs and
+// step them the same way as the server, so their world matches the server's without a single position being sent. A
+// hash of the world is sent now and then, and a client whose hash differs asks for a new join snapshot.
+//
+// A step is judged entirely against the world as the tick found it: a snake moves unless the cell it moves onto held a
+// snake at the start of the tick, and of the snakes moving onto the same empty cell only the one with the lowest player
+// id does. No move depends on another, so the board can be split into bands of rows that are stepped in parallel, each
+// on a thread of its own. Every snake first proposes its move, claiming the cell it moves onto, and once every band has
+// proposed, every band resolves which of its snakes won their claims. The outcome is the same for any number of
+// threads.
+//
+
+#define LOCKSTEP_UP 0
+#define LOCKSTEP_DOWN 1
+#define LOCKSTEP_LEFT 2
+#define LOCKSTEP_RIGHT 3
+
+// One player's input in a lockstep tick, as a direction from LOCKSTEP_UP to LOCKSTEP_RIGHT.
+typedef struct {
+    uint32_t player_id;
+    uint8_t direction;
+} tick_input_t;
+
+// Snakes on each cell of the board, along with the threads that step it. Cells off the board are never occupied.
+typedef struct {
+    int width;
+    int height;
+    uint16_t *cells;
+    // For each cell, the generation and lowest player id of the snakes claiming it, packed so that the smallest value
+    // is the winning claim of the current step.
+    uint64_t *claims;
+    uint32_t generation;
+
+    int worker_count; // Bands of rows, each stepped by a thread of its own. The first is the calling thread.
+    pthread_t *workers;
+    struct lockstep_worker *worker_args;
+    pthread_barrier_t barrier;
+    bool stopping;
+
+    // The step being run, and what its phases pass on to each other. The arrays have room for scratch_capacity
+    // inputs, and counts is worker_count by worker_count.
+    player_table_t *table;
+    const tick_input_t *inputs;
+    uint32_t input_count;
+    bool *moved;
+    uint32_t scratch_capacity;
+    uint32_t *slots;
+    int32_t *targets;
+    uint16_t *bands;
+    uint32_t *order;
+    uint32_t *counts;
+    uint32_t *band_starts;
+    uint32_t *band_moves;
+} lockstep_grid_t;
+
+// Sets up an empty grid stepped by the given number of threads. Returns 0 on success or -1 if there is no memory.
+int lockstep_grid_init(lockstep_grid_t *grid, int width, int height, int worker_count);
+void lockstep_grid_destroy(lockstep_grid_t *grid);
+void lockstep_grid_clear(lockstep_grid_t *grid);
+void lockstep_grid_add(lockstep_grid_t *grid, int x, int y);
+void lockstep_grid_remove(lockstep_grid_t *grid, int x, int y);
+
+// The direction of an arrow key, or -1 for any other key.
+int lockstep_direction(uint32_t key_code);
+
+// Steps the snakes of a table by a tick's inputs, in any order but at most one per player. Inputs for players not in
+// the table are ignored. If moved is not NULL, each of its entries is set to whether the snake of that input moved.
+// Returns the number of snakes that moved, or -1 if there is no memory to step them.
+int64_t lockstep_step(lockstep_grid_t *grid, player_table_t *table, const tick_input_t *inputs, uint32_t input_count,
+                      bool *moved);
+
+// Hash of the position of every snake with a player id. It does not depend on which slots the snakes are in, so a
+// client's table hashes the same as the server's.
+uint32_t lockstep_hash(const player_table_t *table);
+
+// Steps the given number of snakes with random inputs on a board large enough to hold them, once on one thread and
+// once on the given number of threads, printing how fast each was and whether they ended up the same.
+void lockstep_benchmark(uint32_t snake_count, int worker_count);
+
+#endif //CSNAKE_LOCKSTEP_H
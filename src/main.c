@@ -4,35 +4,147 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <glib.h>
 #include <stdbool.h>
 
+#include "bot.h"
 #include "common.h"
+#include "lockstep.h"
 #include "log.h"
+#include "relay.h"
+#include "router.h"
 #include "server.h"
+#include "store.h"
 #include "client.h"
 
 int main(int argc, char **argv) {
     bool server_mode = false;
+    char *store_path = NULL;
+    uint32_t leaderboard_size = 0;
+    uint32_t lockstep_benchmark_size = 0;
+    int lockstep_threads = 1;
 
     int c;
-    while ((c = getopt(argc, argv, "s")) != -1) {
+    while ((c = getopt(argc, argv, "su:m:c:rS:T:w:E:e:b:B:l:p:P:L:I:zkj:G:V:i:RW")) != -1) {
         switch (c) {
             case 's':
                 server_mode = true;
                 break;
+            case 'u':
+                server_set_upgrade_path(optarg);
+                break;
+            case 'm':
+                server_set_metrics_path(optarg);
+                break;
+            case 'c':
+                server_set_checkpoint_path(optarg);
+                break;
+            case 'r':
+                server_set_recover(true);
+                break;
+            case 'S':
+                store_path = optarg;
+                server_set_store_path(optarg);
+                break;
+            case 'T':
+                leaderboard_size = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                server_set_worker_count(atoi(optarg));
+                break;
+            case 'E':
+                server_set_encoder_count(atoi(optarg));
+                break;
+            case 'e':
+                if (strcmp(optarg, "uring") == 0) {
+                    server_set_io_uring(true);
+                } else if (strcmp(optarg, "poll") != 0) {
+                    log_error("%s is not an I/O backend, use poll or uring\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 'b':
+                server_set_bot_count((uint32_t) strtoul(optarg, NULL, 10));
+                break;
+            case 'B':
+                bot_benchmark((uint32_t) strtoul(optarg, NULL, 10));
+                exit(0);
+            case 'l':
+                server_set_local_path(optarg);
+                break;
+            case 'p':
+                server_set_route_path(optarg);
+                break;
+            case 'P':
+                router_add_backend(optarg);
+                break;
+            case 'L':
+                server_set_rewind_limit((uint32_t) strtoul(optarg, NULL, 10));
+                break;
+            case 'I':
+                server_set_idle_timeout((uint32_t) strtoul(optarg, NULL, 10));
+                break;
+            case 'z':
+                server_set_idle_sleep(true);
+                break;
+            case 'k':
+                server_set_lockstep(true);
+                break;
+            case 'j':
+                lockstep_threads = atoi(optarg);
+                break;
+            case 'G':
+                lockstep_benchmark_size = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'V':
+                relay_set_upstream(optarg);
+                break;
+            case 'i': {
+                // The player id and the resume token it was welcomed with, as <player id>:<token>.
+                char *token = NULL;
+                uint32_t player_id = (uint32_t) strtoul(optarg, &token, 10);
+                client_set_player_id(player_id, *token == ':' ? (uint32_t) strtoul(token + 1, NULL, 10) : 0);
+                break;
+            }
+            case 'R':
+                client_set_ring(true);
+                break;
+            case 'W':
+                client_set_spectator(true);
+                break;
             default:
                 exit(0);
         }
     }
 
-    if (optind + 1 >= argc) {
-        log_error("Usage is %s [-s] <host> <port>\n", argv[0]);
+    if (leaderboard_size > 0) {
+        if (store_path == NULL) {
+            log_error("-T needs a session store given with -S\n");
+            exit(0);
+        }
+        exit(store_print_top(store_path, leaderboard_size, stdout) ? 1 : 0);
+    }
+
+    if (lockstep_benchmark_size > 0) {
+        lockstep_benchmark(lockstep_benchmark_size, lockstep_threads);
+        exit(0);
+    }
+
+    // A client can connect to the server's unix socket by giving its path in place of the host and port.
+    bool local = !server_mode && optind < argc && argv[optind][0] == '/';
+
+    if (optind + 1 >= argc && !local) {
+        log_error("Usage is %s [-s] [-u <upgrade socket>] [-m <metrics socket>] [-c <checkpoint file> [-r]] [-S <session store> [-T <top>]] [-w <workers>] [-E <encoders>] [-e poll|uring] [-b <bots>] [-B <bots>] [-l <local socket>] [-p <route socket>] [-P <backend route socket>]... [-L <rewind ms>] [-I <idle timeout ms>] [-z] [-k] [-G <snakes> [-j <threads>]] [-V <upstream>] [-i <player id>:<token>] [-R] [-W] <host> <port> | <local socket>\n", argv[0]);
         exit(0);
     }
 
     char *host = argv[optind];
+    if (local) {
+        run_client(host, 0);
+        return 0;
+    }
     char *port = argv[optind + 1];
 
     char *ptr;
@@ -42,7 +154,11 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
-    if (server_mode) {
+    if (relay_enabled()) {
+        run_relay(host, port_num);
+    } else if (router_backend_count() > 0) {
+        run_router(host, port_num);
+    } else if (server_mode) {
         run_server(host, port_num);
     } else {
         run_client(host, port_num);
@@ -2,14 +2,16 @@
  * Author: Jeremy Wood
  */
 
-#include <malloc.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <ncurses.h>
 #include "messages.h"
+#include "common.h"
 #include "log.h"
+#include "metrics.h"
 #include "socket.h"
 #include "snake.h"
 
@@ -37,6 +39,41 @@ static unsigned char * serialize_int(unsigned char *buffer, uint32_t value) {
     return buffer + 4;
 }
 
+const char * message_type_name(message_t message_type) {
+    switch (message_type) {
+        case MSG_SNAKE_UPDATE:
+            return "snake_update";
+        case MSG_CLIENT_KEYPRESS:
+            return "client_keypress";
+        case MSG_CLIENT_DISCONNECT:
+            return "client_disconnect";
+        case MSG_CLIENT_HELLO:
+            return "client_hello";
+        case MSG_SERVER_WELCOME:
+            return "server_welcome";
+        case MSG_PING:
+            return "ping";
+        case MSG_PONG:
+            return "pong";
+        case MSG_WORLD_SNAPSHOT:
+            return "world_snapshot";
+        case MSG_RING_REQUEST:
+            return "ring_request";
+        case MSG_RING_READY:
+            return "ring_ready";
+        case MSG_CLIENT_SPECTATE:
+            return "client_spectate";
+        case MSG_TICK_INPUTS:
+            return "tick_inputs";
+        case MSG_STATE_HASH:
+            return "state_hash";
+        case MSG_RESYNC_REQUEST:
+            return "resync_request";
+        default:
+            return "unknown";
+    }
+}
+
 static size_t get_message_size(message_t message_type) {
     // 1 must be added to the size to accommodate for null terminator.
     switch (message_type) {
@@ -46,6 +83,24 @@ static size_t get_message_size(message_t message_type) {
             return sizeof(msg_client_keypress) + 1;
         case MSG_CLIENT_DISCONNECT:
             return sizeof(msg_client_disconnect) + 1;
+        case MSG_CLIENT_HELLO:
+            return sizeof(msg_client_hello) + 1;
+        case MSG_SERVER_WELCOME:
+            return sizeof(msg_server_welcome) + 1;
+        case MSG_PING:
+            return sizeof(msg_ping) + 1;
+        case MSG_PONG:
+            return sizeof(msg_pong) + 1;
+        case MSG_RING_REQUEST:
+            return sizeof(msg_ring_request) + 1;
+        case MSG_RING_READY:
+            return sizeof(msg_ring_ready) + 1;
+        case MSG_CLIENT_SPECTATE:
+            return sizeof(msg_client_spectate) + 1;
+        case MSG_STATE_HASH:
+            return sizeof(msg_state_hash) + 1;
+        case MSG_RESYNC_REQUEST:
+            return sizeof(msg_resync_request) + 1;
         default:
             log_error("get_message_size: Unknown message type %d", message_type);
             return 0;
@@ -69,15 +124,64 @@ static unsigned char * serialize_msg_client_disconnect(unsigned char *buffer, ms
     return buffer;
 }
 
-static unsigned char * serialize_message(size_t *size, message_t message_type, void *message_ptr) {
-    *size = get_message_size(message_type) + 1; // Add 1 for the message type header.
-    if (*size == 1) {
-        return NULL;
+static unsigned char * serialize_msg_client_hello(unsigned char *buffer, msg_client_hello *message) {
+    buffer = serialize_int(buffer, message->player_id);
+    buffer = serialize_int(buffer, message->resume_token);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_server_welcome(unsigned char *buffer, msg_server_welcome *message) {
+    buffer = serialize_int(buffer, message->player_id);
+    buffer = serialize_int(buffer, message->resume_token);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_ping(unsigned char *buffer, msg_ping *message) {
+    buffer = serialize_int(buffer, message->timestamp_us);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_pong(unsigned char *buffer, msg_pong *message) {
+    buffer = serialize_int(buffer, message->timestamp_us);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_ring_request(unsigned char *buffer, msg_ring_request *message) {
+    buffer = serialize_int(buffer, message->capacity);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_ring_ready(unsigned char *buffer, msg_ring_ready *message) {
+    buffer = serialize_int(buffer, message->capacity);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_client_spectate(unsigned char *buffer, msg_client_spectate *message) {
+    buffer = serialize_int(buffer, message->relay);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_state_hash(unsigned char *buffer, msg_state_hash *message) {
+    buffer = serialize_int(buffer, message->tick);
+    buffer = serialize_int(buffer, message->hash);
+    return buffer;
+}
+
+static unsigned char * serialize_msg_resync_request(unsigned char *buffer, msg_resync_request *message) {
+    buffer = serialize_int(buffer, message->tick);
+    return buffer;
+}
+
+// Serializes into the given buffer, which must hold at least MAX_MESSAGE_SIZE bytes. Returns 0 if the message type
+// is unknown.
+static size_t serialize_message(unsigned char *buffer, message_t message_type, void *message_ptr) {
+    size_t size = get_message_size(message_type) + 1; // Add 1 for the message type header.
+    if (size == 1) {
+        return 0;
     }
 
     log_debug("serialize_message: Creating message of type %d", message_type);
 
-    unsigned char *buffer = malloc(*size);
     unsigned char *original_buffer = buffer;
     buffer = serialize_char(buffer, message_type);
 
@@ -93,14 +197,40 @@ static unsigned char * serialize_message(size_t *size, message_t message_type, v
         case MSG_CLIENT_DISCONNECT:
             buffer = serialize_msg_client_disconnect(buffer, (msg_client_disconnect *) message_ptr);
             break;
+        case MSG_CLIENT_HELLO:
+            buffer = serialize_msg_client_hello(buffer, (msg_client_hello *) message_ptr);
+            break;
+        case MSG_SERVER_WELCOME:
+            buffer = serialize_msg_server_welcome(buffer, (msg_server_welcome *) message_ptr);
+            break;
+        case MSG_PING:
+            buffer = serialize_msg_ping(buffer, (msg_ping *) message_ptr);
+            break;
+        case MSG_PONG:
+            buffer = serialize_msg_pong(buffer, (msg_pong *) message_ptr);
+            break;
+        case MSG_RING_REQUEST:
+            buffer = serialize_msg_ring_request(buffer, (msg_ring_request *) message_ptr);
+            break;
+        case MSG_RING_READY:
+            buffer = serialize_msg_ring_ready(buffer, (msg_ring_ready *) message_ptr);
+            break;
+        case MSG_CLIENT_SPECTATE:
+            buffer = serialize_msg_client_spectate(buffer, (msg_client_spectate *) message_ptr);
+            break;
+        case MSG_STATE_HASH:
+            buffer = serialize_msg_state_hash(buffer, (msg_state_hash *) message_ptr);
+            break;
+        case MSG_RESYNC_REQUEST:
+            buffer = serialize_msg_resync_request(buffer, (msg_resync_request *) message_ptr);
+            break;
         default:
-            free(buffer);
             log_error("serialize_message: Impossible message type.");
-            return NULL;
+            return 0;
     }
     buffer[0] = '\0';
 
-    return original_buffer;
+    return size;
 }
 
 static const unsigned char * deserialize_char(const unsigned char *message, uint8_t *value) {
@@ -109,67 +239,475 @@ static const unsigned char * deserialize_char(const unsigned char *message, uint
 }
 
 static const unsigned char * deserialize_short(const unsigned char *message, uint16_t *value) {
-    unsigned char *buffer = malloc(sizeof(uint16_t));
-    buffer[0] = message[1];
-    buffer[1] = message[0];
-    *value = *((uint16_t *) buffer);
-    free(buffer);
+    *value = (uint16_t) ((message[0] << 8) | message[1]);
     return message + 2;
 }
 
 static const unsigned char * deserialize_int(const unsigned char *message, uint32_t *value) {
-    unsigned char *buffer = malloc(sizeof(uint32_t));
-    buffer[0] = message[3];
-    buffer[1] = message[2];
-    buffer[2] = message[1];
-    buffer[3] = message[0];
-    *value = *((uint32_t *) buffer);
-    free(buffer);
+    *value = ((uint32_t) message[0] << 24) | ((uint32_t) message[1] << 16) | ((uint32_t) message[2] << 8) |
+             (uint32_t) message[3];
     return message + 4;
 }
 
-static msg_snake_update * deserialize_msg_snake_update(const unsigned char *message_ptr) {
-    msg_snake_update *message = malloc(sizeof(msg_snake_update));
+static msg_snake_update * deserialize_msg_snake_update(arena_t *arena, const unsigned char *message_ptr) {
+    msg_snake_update *message = arena_alloc(arena, sizeof(msg_snake_update));
+    if (message == NULL) {
+        return NULL;
+    }
     message_ptr = deserialize_int(message_ptr, &(message->snake.player_id));
     message_ptr = deserialize_short(message_ptr, (uint16_t *) &(message->snake.x));
     deserialize_short(message_ptr, (uint16_t *) &(message->snake.y));
     return message;
 }
 
-static msg_client_keypress * deserialize_msg_client_keypress(const unsigned char *message_ptr) {
-    msg_client_keypress *message = malloc(sizeof(msg_client_keypress));
+static msg_client_keypress * deserialize_msg_client_keypress(arena_t *arena, const unsigned char *message_ptr) {
+    msg_client_keypress *message = arena_alloc(arena, sizeof(msg_client_keypress));
+    if (message == NULL) {
+        return NULL;
+    }
     deserialize_int(message_ptr, &(message->key_code));
     return message;
 }
 
-static msg_client_disconnect * deserialize_msg_client_disconnect(const unsigned char *message_ptr) {
-    msg_client_disconnect *message = malloc(sizeof(msg_client_disconnect));
+static msg_client_disconnect * deserialize_msg_client_disconnect(arena_t *arena, const unsigned char *message_ptr) {
+    msg_client_disconnect *message = arena_alloc(arena, sizeof(msg_client_disconnect));
+    if (message == NULL) {
+        return NULL;
+    }
     deserialize_int(message_ptr, &(message->player_id));
     return message;
 }
 
-static void * deserialize_message(message_t message_type, const unsigned char *message_ptr) {
+static msg_client_hello * deserialize_msg_client_hello(arena_t *arena, const unsigned char *message_ptr) {
+    msg_client_hello *message = arena_alloc(arena, sizeof(msg_client_hello));
+    if (message == NULL) {
+        return NULL;
+    }
+    message_ptr = deserialize_int(message_ptr, &(message->player_id));
+    deserialize_int(message_ptr, &(message->resume_token));
+    return message;
+}
+
+static msg_server_welcome * deserialize_msg_server_welcome(arena_t *arena, const unsigned char *message_ptr) {
+    msg_server_welcome *message = arena_alloc(arena, sizeof(msg_server_welcome));
+    if (message == NULL) {
+        return NULL;
+    }
+    message_ptr = deserialize_int(message_ptr, &(message->player_id));
+    deserialize_int(message_ptr, &(message->resume_token));
+    return message;
+}
+
+static msg_ping * deserialize_msg_ping(arena_t *arena, const unsigned char *message_ptr) {
+    msg_ping *message = arena_alloc(arena, sizeof(msg_ping));
+    if (message == NULL) {
+        return NULL;
+    }
+    deserialize_int(message_ptr, &(message->timestamp_us));
+    return message;
+}
+
+static msg_pong * deserialize_msg_pong(arena_t *arena, const unsigned char *message_ptr) {
+    msg_pong *message = arena_alloc(arena, sizeof(msg_pong));
+    if (message == NULL) {
+        return NULL;
+    }
+    deserialize_int(message_ptr, &(message->timestamp_us));
+    return message;
+}
+
+static msg_ring_request * deserialize_msg_ring_request(arena_t *arena, const unsigned char *message_ptr) {
+    msg_ring_request *message = arena_alloc(arena, sizeof(msg_ring_request));
+    if (message == NULL) {
+        return NULL;
+    }
+    deserialize_int(message_ptr, &(message->capacity));
+    return message;
+}
+
+static msg_ring_ready * deserialize_msg_ring_ready(arena_t *arena, const unsigned char *message_ptr) {
+    msg_ring_ready *message = arena_alloc(arena, sizeof(msg_ring_ready));
+    if (message == NULL) {
+        return NULL;
+    }
+    deserialize_int(message_ptr, &(message->capacity));
+    return message;
+}
+
+static msg_client_spectate * deserialize_msg_client_spectate(arena_t *arena, const unsigned char *message_ptr) {
+    msg_client_spectate *message = arena_alloc(arena, sizeof(msg_client_spectate));
+    if (message == NULL) {
+        return NULL;
+    }
+    deserialize_int(message_ptr, &(message->relay));
+    return message;
+}
+
+static msg_state_hash * deserialize_msg_state_hash(arena_t *arena, const unsigned char *message_ptr) {
+    msg_state_hash *message = arena_alloc(arena, sizeof(msg_state_hash));
+    if (message == NULL) {
+        return NULL;
+    }
+    message_ptr = deserialize_int(message_ptr, &(message->tick));
+    deserialize_int(message_ptr, &(message->hash));
+    return message;
+}
+
+static msg_resync_request * deserialize_msg_resync_request(arena_t *arena, const unsigned char *message_ptr) {
+    msg_resync_request *message = arena_alloc(arena, sizeof(msg_resync_request));
+    if (message == NULL) {
+        return NULL;
+    }
+    deserialize_int(message_ptr, &(message->tick));
+    return message;
+}
+
+static void * deserialize_message(arena_t *arena, message_t message_type, const unsigned char *message_ptr) {
     switch (message_type) {
         case MSG_SNAKE_UPDATE:
-            return deserialize_msg_snake_update(message_ptr);
+            return deserialize_msg_snake_update(arena, message_ptr);
         case MSG_CLIENT_KEYPRESS:
-            return deserialize_msg_client_keypress(message_ptr);
+            return deserialize_msg_client_keypress(arena, message_ptr);
         case MSG_CLIENT_DISCONNECT:
-            return deserialize_msg_client_disconnect(message_ptr);
+            return deserialize_msg_client_disconnect(arena, message_ptr);
+        case MSG_CLIENT_HELLO:
+            return deserialize_msg_client_hello(arena, message_ptr);
+        case MSG_SERVER_WELCOME:
+            return deserialize_msg_server_welcome(arena, message_ptr);
+        case MSG_PING:
+            return deserialize_msg_ping(arena, message_ptr);
+        case MSG_PONG:
+            return deserialize_msg_pong(arena, message_ptr);
+        case MSG_RING_REQUEST:
+            return deserialize_msg_ring_request(arena, message_ptr);
+        case MSG_RING_READY:
+            return deserialize_msg_ring_ready(arena, message_ptr);
+        case MSG_CLIENT_SPECTATE:
+            return deserialize_msg_client_spectate(arena, message_ptr);
+        case MSG_STATE_HASH:
+            return deserialize_msg_state_hash(arena, message_ptr);
+        case MSG_RESYNC_REQUEST:
+            return deserialize_msg_resync_request(arena, message_ptr);
         default:
             log_error("deserialize_message: Impossible message type.");
             return NULL;
     }
 }
 
-void send_message(int fd, message_t message_type, void *message_ptr) {
-    size_t size;
-    unsigned char * message = serialize_message(&size, message_type, message_ptr);
+//
+// World snapshots are sorted by player id and stored as a run length and delta encoded stream of varints. Each entry
+// starts with a header varint. An even header (delta << 1) is a snake whose id is delta above the previous snake's,
+// followed by its x and y as zigzag varint deltas from the previous snake. An odd header (count << 1 | 1) is a run of
+// count snakes whose ids each follow on by one and who sit on the same cell as the previous snake, which is how
+// freshly spawned players look. A run is at most MAX_SNAPSHOT_RUN snakes, so its header always fits a byte.
+//
+
+// Bytes a snake can take at most: a 5 byte header and two 3 byte coordinates.
+#define MAX_ENCODED_SNAKE_SIZE 11
+// Type, payload length and snake count.
+#define SNAPSHOT_HEADER_SIZE 10
+// Longest run whose header fits a single byte varint.
+#define MAX_SNAPSHOT_RUN 63
+
+static unsigned char * serialize_varint(unsigned char *buffer, uint32_t value) {
+    while (value >= 0x80) {
+        *buffer++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *buffer++ = (unsigned char) value;
+    return buffer;
+}
+
+static unsigned char * serialize_zigzag(unsigned char *buffer, int32_t value) {
+    return serialize_varint(buffer, ((uint32_t) value << 1) ^ (uint32_t) (value >> 31));
+}
 
-    ssend(fd, message, size);
+// Returns NULL if the varint runs past the end of the message.
+static const unsigned char * deserialize_varint(const unsigned char *message, const unsigned char *end,
+                                                uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 35 && message < end; shift += 7) {
+        unsigned char byte = *message++;
+        *value |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return message;
+        }
+    }
+    return NULL;
+}
+
+static const unsigned char * deserialize_zigzag(const unsigned char *message, const unsigned char *end,
+                                                int32_t *value) {
+    uint32_t encoded;
+    message = deserialize_varint(message, end, &encoded);
+    *value = (int32_t) (encoded >> 1) ^ -(int32_t) (encoded & 1);
+    return message;
 }
 
-ssize_t recv_message(int fd, message_t *message_type, void **message_ptr) {
+static int compare_player_ids(const void *a, const void *b) {
+    uint32_t id_a = ((const snake_t *) a)->player_id;
+    uint32_t id_b = ((const snake_t *) b)->player_id;
+    return id_a < id_b ? -1 : id_a > id_b;
+}
+
+unsigned char * serialize_world_snapshot(snake_t *snakes, uint32_t snake_count, size_t *size) {
+    qsort(snakes, snake_count, sizeof(snake_t), compare_player_ids);
+
+    unsigned char *message = malloc(SNAPSHOT_HEADER_SIZE + (size_t) snake_count * MAX_ENCODED_SNAKE_SIZE);
+    if (message == NULL) {
+        log_error("serialize_world_snapshot: No memory to encode %d snakes", snake_count);
+        return NULL;
+    }
+    unsigned char *buffer = serialize_char(message, MSG_WORLD_SNAPSHOT);
+    unsigned char *length = buffer;
+    buffer = serialize_int(buffer + 4, snake_count);
+
+    snake_t previous = {0, 0, 0};
+    uint32_t i = 0;
+    while (i < snake_count) {
+        uint32_t run = 0;
+        while (run < MAX_SNAPSHOT_RUN && i + run < snake_count &&
+               snakes[i + run].player_id == previous.player_id + run + 1 && snakes[i + run].x == previous.x &&
+               snakes[i + run].y == previous.y) {
+            run++;
+        }
+
+        if (run > 0) {
+            buffer = serialize_varint(buffer, run << 1 | 1);
+            previous.player_id += run;
+            i += run;
+            continue;
+        }
+
+        buffer = serialize_varint(buffer, (snakes[i].player_id - previous.player_id) << 1);
+        buffer = serialize_zigzag(buffer, snakes[i].x - previous.x);
+        buffer = serialize_zigzag(buffer, snakes[i].y - previous.y);
+        previous = snakes[i];
+        i++;
+    }
+
+    *size = (size_t) (buffer - message);
+    serialize_int(length, (uint32_t) (*size - 5));
+
+    log_debug("serialize_world_snapshot: Encoded %d snakes in %d bytes", snake_count, *size);
+    return message;
+}
+
+// Decodes a world snapshot payload into snakes taken from the arena.
+static msg_world_snapshot * deserialize_msg_world_snapshot(arena_t *arena, const unsigned char *message_ptr,
+                                                           size_t size) {
+    const unsigned char *end = message_ptr + size;
+    if (size < 4) {
+        return NULL;
+    }
+
+    msg_world_snapshot *message = arena_alloc(arena, sizeof(msg_world_snapshot));
+    if (message == NULL) {
+        return NULL;
+    }
+    message_ptr = deserialize_int(message_ptr, &(message->snake_count));
+    // Every entry takes at least a byte and stands for at most MAX_SNAPSHOT_RUN snakes, which keeps a bad count from
+    // taking the whole arena.
+    if (message->snake_count > (size_t) (end - message_ptr) * MAX_SNAPSHOT_RUN) {
+        log_error("deserialize_msg_world_snapshot: %d snakes cannot fit in %d bytes", message->snake_count,
+                  end - message_ptr);
+        return NULL;
+    }
+    message->snakes = arena_alloc(arena, sizeof(snake_t) * message->snake_count);
+    if (message->snakes == NULL && message->snake_count > 0) {
+        return NULL;
+    }
+
+    snake_t previous = {0, 0, 0};
+    uint32_t i = 0;
+    while (i < message->snake_count) {
+        uint32_t header;
+        message_ptr = deserialize_varint(message_ptr, end, &header);
+        if (message_ptr == NULL) {
+            break;
+        }
+
+        if (header & 1) {
+            uint32_t run = header >> 1;
+            if (run > MAX_SNAPSHOT_RUN) {
+                break;
+            }
+            for (uint32_t j = 0; j < run && i < message->snake_count; j++) {
+                previous.player_id++;
+                message->snakes[i++] = previous;
+            }
+            continue;
+        }
+
+        int32_t dx, dy;
+        message_ptr = deserialize_zigzag(message_ptr, end, &dx);
+        if (message_ptr == NULL || (message_ptr = deserialize_zigzag(message_ptr, end, &dy)) == NULL) {
+            break;
+        }
+        previous.player_id += header >> 1;
+        previous.x = (int16_t) (previous.x + dx);
+        previous.y = (int16_t) (previous.y + dy);
+        message->snakes[i++] = previous;
+    }
+
+    if (i != message->snake_count) {
+        log_error("deserialize_msg_world_snapshot: Snapshot ended after %d of %d snakes", i, message->snake_count);
+        return NULL;
+    }
+    return message;
+}
+
+//
+// Tick inputs are sorted by player id, which the server applies them in anyway, so each input is a single varint of
+// the id delta from the previous input shifted left by two, with the direction in the low bits. An input usually takes
+// a byte or two however many snakes there are.
+//
+
+// Type, payload length, tick and the most a count can take.
+#define TICK_INPUTS_HEADER_SIZE 14
+// A 5 byte varint at most.
+#define MAX_ENCODED_INPUT_SIZE 5
+
+size_t tick_inputs_max_size(uint32_t input_count) {
+    return TICK_INPUTS_HEADER_SIZE + (size_t) input_count * MAX_ENCODED_INPUT_SIZE;
+}
+
+size_t encode_tick_inputs(unsigned char *message, uint32_t tick, const tick_input_t *inputs, uint32_t input_count) {
+    unsigned char *buffer = serialize_char(message, MSG_TICK_INPUTS);
+    unsigned char *length = buffer;
+    buffer = serialize_int(buffer + 4, tick);
+    buffer = serialize_varint(buffer, input_count);
+
+    uint32_t previous_id = 0;
+    for (uint32_t i = 0; i < input_count; i++) {
+        buffer = serialize_varint(buffer, (inputs[i].player_id - previous_id) << 2 | (inputs[i].direction & 3));
+        previous_id = inputs[i].player_id;
+    }
+
+    size_t size = (size_t) (buffer - message);
+    serialize_int(length, (uint32_t) (size - 5));
+    return size;
+}
+
+// Decodes a tick inputs payload into inputs taken from the arena.
+static msg_tick_inputs * deserialize_msg_tick_inputs(arena_t *arena, const unsigned char *message_ptr, size_t size) {
+    const unsigned char *end = message_ptr + size;
+    if (size < 5) {
+        return NULL;
+    }
+
+    msg_tick_inputs *message = arena_alloc(arena, sizeof(msg_tick_inputs));
+    if (message == NULL) {
+        return NULL;
+    }
+    message_ptr = deserialize_int(message_ptr, &(message->tick));
+    message_ptr = deserialize_varint(message_ptr, end, &(message->input_count));
+    // Every input takes at least a byte, which keeps a bad count from taking the whole arena.
+    if (message_ptr == NULL || message->input_count > (size_t) (end - message_ptr)) {
+        return NULL;
+    }
+    message->inputs = arena_alloc(arena, sizeof(tick_input_t) * message->input_count);
+    if (message->inputs == NULL && message->input_count > 0) {
+        return NULL;
+    }
+
+    uint32_t previous_id = 0;
+    for (uint32_t i = 0; i < message->input_count; i++) {
+        uint32_t entry;
+        message_ptr = deserialize_varint(message_ptr, end, &entry);
+        if (message_ptr == NULL) {
+            log_error("deserialize_msg_tick_inputs: Inputs ended after %d of %d", i, message->input_count);
+            return NULL;
+        }
+        previous_id += entry >> 2;
+        message->inputs[i].player_id = previous_id;
+        message->inputs[i].direction = (uint8_t) (entry & 3);
+    }
+    return message;
+}
+
+static bool is_variable_length(message_t message_type) {
+    return message_type == MSG_WORLD_SNAPSHOT || message_type == MSG_TICK_INPUTS;
+}
+
+static void * deserialize_variable_message(arena_t *arena, message_t message_type, const unsigned char *payload,
+                                           size_t size) {
+    if (message_type == MSG_TICK_INPUTS) {
+        return deserialize_msg_tick_inputs(arena, payload, size);
+    }
+    return deserialize_msg_world_snapshot(arena, payload, size);
+}
+
+ssize_t send_serialized_message(int fd, const unsigned char *message, size_t size) {
+    ssize_t written_amount = ssend(fd, (void *) message, size);
+    if (written_amount > 0) {
+        metrics_message_out(message[0], size);
+    }
+    return written_amount;
+}
+
+size_t encode_message(unsigned char *buffer, message_t message_type, void *message_ptr) {
+    size_t size = serialize_message(buffer, message_type, message_ptr);
+    if (size > 0) {
+        metrics_message_out(message_type, size);
+    }
+    return size;
+}
+
+ssize_t send_message(int fd, message_t message_type, void *message_ptr) {
+    unsigned char message[MAX_MESSAGE_SIZE];
+    size_t size = serialize_message(message, message_type, message_ptr);
+    if (size == 0) {
+        return 0;
+    }
+
+    ssize_t written_amount = ssend(fd, message, size);
+    if (written_amount > 0) {
+        metrics_message_out(message_type, size);
+    }
+    return written_amount;
+}
+
+// Reads the length and payload of a variable length message, with the payload read into the arena as well.
+static ssize_t recv_variable_message(int fd, arena_t *arena, message_t message_type, void **message_ptr) {
+    unsigned char length_buffer[4];
+    uint32_t length;
+    ssize_t read_amount;
+    do {
+        read_amount = srecv(fd, length_buffer, sizeof(length_buffer));
+    } while (read_amount < 0 && errno == EINTR);
+    if (read_amount <= 0) {
+        return read_amount;
+    }
+    deserialize_int(length_buffer, &length);
+
+    unsigned char *payload = arena_alloc(arena, length);
+    if (payload == NULL) {
+        log_error("recv_variable_message: No room for a %d byte message", length);
+        errno = ENOMEM;
+        return -1;
+    }
+    do {
+        read_amount = srecv(fd, payload, length);
+    } while (read_amount < 0 && errno == EINTR);
+    if (read_amount <= 0) {
+        return read_amount;
+    }
+
+    *message_ptr = deserialize_variable_message(arena, message_type, payload, length);
+    if (*message_ptr == NULL) {
+        log_error("recv_variable_message: Could not decode message type %d", message_type);
+        errno = EINVAL;
+        return -1;
+    }
+
+    metrics_message_in(message_type, length + 5);
+    return length + 4;
+}
+
+ssize_t recv_message(int fd, arena_t *arena, message_t *message_type, void **message_ptr) {
+    *message_ptr = NULL;
+
     ssize_t read_amount = srecv(fd, message_type, 1);
 
     if (read_amount <= 0) {
@@ -178,18 +716,78 @@ ssize_t recv_message(int fd, message_t *message_type, void **message_ptr) {
 
     log_debug("recv_message: Read message type: %d", *message_type);
 
+    if (is_variable_length(*message_type)) {
+        return recv_variable_message(fd, arena, *message_type, message_ptr);
+    }
+
     size_t size = get_message_size(*message_type);
     if (size == 0) {
         return 0;
     }
 
-    char *read_buffer = malloc(size);
-    read_amount = srecv(fd, read_buffer, size);
+    unsigned char read_buffer[MAX_MESSAGE_SIZE];
+    do {
+        // The type byte is already consumed, so an interrupt must not abandon the rest of the message.
+        read_amount = srecv(fd, read_buffer, size);
+    } while (read_amount < 0 && errno == EINTR);
     if (read_amount <= 0) {
         return read_amount;
     }
 
-    *message_ptr = deserialize_message(*message_type, (unsigned char *) read_buffer);
-    //free(read_buffer);
+    *message_ptr = deserialize_message(arena, *message_type, read_buffer);
+    if (*message_ptr == NULL) {
+        log_error("recv_message: No room to decode message type %d", *message_type);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    metrics_message_in(*message_type, size + 1);
     return size;
-}
\ No newline at end of file
+}
+ssize_t decode_message(const unsigned char *buffer, size_t size, arena_t *arena, message_t *message_type,
+                       void **message_ptr) {
+    *message_ptr = NULL;
+    if (size < 1) {
+        return 0;
+    }
+    *message_type = buffer[0];
+
+    if (is_variable_length(*message_type)) {
+        uint32_t length;
+        if (size < 5) {
+            return 0;
+        }
+        deserialize_int(buffer + 1, &length);
+        if (size - 5 < length) {
+            return 0;
+        }
+        *message_ptr = deserialize_variable_message(arena, *message_type, buffer + 5, length);
+        if (*message_ptr == NULL) {
+            log_error("decode_message: Could not decode message type %d", *message_type);
+            errno = EINVAL;
+            return -1;
+        }
+        metrics_message_in(*message_type, length + 5);
+        return length + 5;
+    }
+
+    size_t body_size = get_message_size(*message_type);
+    if (body_size == 0) {
+        log_error("decode_message: Unknown message type %d", *message_type);
+        errno = EINVAL;
+        return -1;
+    }
+    if (size - 1 < body_size) {
+        return 0;
+    }
+
+    *message_ptr = deserialize_message(arena, *message_type, buffer + 1);
+    if (*message_ptr == NULL) {
+        log_error("decode_message: No room to decode message type %d", *message_type);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    metrics_message_in(*message_type, body_size + 1);
+    return body_size + 1;
+}
@@ -7,6 +7,8 @@
 
 #include <stdint.h>
 #include <glib.h>
+#include "lockstep.h"
+#include "pool.h"
 #include "snake.h"
 
 typedef uint8_t message_t;
@@ -26,7 +28,110 @@ typedef struct {
 } msg_client_disconnect;
 #define MSG_CLIENT_DISCONNECT 2
 
-void send_message(int fd, message_t message_type, void *message_ptr);
-ssize_t recv_message(int fd, message_t *message_type, void **message_ptr);
+// First message a client sends. A player_id of 0 asks for a new player, anything else asks to resume that player
+// with the resume_token it was welcomed with.
+typedef struct {
+    uint32_t player_id;
+    uint32_t resume_token;
+} msg_client_hello;
+#define MSG_CLIENT_HELLO 3
+
+// Reply to MSG_CLIENT_HELLO with the player id the client was given, and the token it needs to resume that player
+// after a server restart.
+typedef struct {
+    uint32_t player_id;
+    uint32_t resume_token;
+} msg_server_welcome;
+#define MSG_SERVER_WELCOME 4
+
+// Sent by the server to measure round trip time. The client echoes the timestamp back in a MSG_PONG.
+typedef struct {
+    uint32_t timestamp_us;
+} msg_ping;
+#define MSG_PING 5
+
+typedef struct {
+    uint32_t timestamp_us;
+} msg_pong;
+#define MSG_PONG 6
+
+// The whole world in one message, sent to a client when it joins. Unlike most other messages this one has a variable
+// length: the type is followed by a 4 byte payload length and the compressed snakes, with no null terminator.
+typedef struct {
+    uint32_t snake_count;
+    snake_t *snakes;
+} msg_world_snapshot;
+#define MSG_WORLD_SNAPSHOT 7
+
+// Asks the server to send everything after this through a shared memory ring of about the given capacity in bytes.
+// Only a client connected over a unix socket can ask, since the ring is passed to it along with MSG_RING_READY.
+typedef struct {
+    uint32_t capacity;
+} msg_ring_request;
+#define MSG_RING_REQUEST 8
+
+// Last message the server sends on the socket of a client that asked for a ring. The ring's memfd and eventfd come
+// with it as SCM_RIGHTS, and every message from then on is written to the ring instead.
+typedef struct {
+    uint32_t capacity;
+} msg_ring_ready;
+#define MSG_RING_READY 9
+
+// First message of a read-only client, sent in place of MSG_CLIENT_HELLO. The client is welcomed as player 0 and then
+// sent everything a player is, but has no snake and only its escape key is heeded.
+typedef struct {
+    uint32_t relay; // Whether the client is a relay passing the stream on to spectators of its own.
+} msg_client_spectate;
+#define MSG_CLIENT_SPECTATE 10
+
+// The inputs a lockstep server stepped a tick with, sorted by player id. Clients step them the same way to move the
+// snakes themselves. Variable length like MSG_WORLD_SNAPSHOT: the type is followed by a
+// 4 byte payload length, then the tick, the input count and the inputs as varints of the id delta and direction.
+typedef struct {
+    uint32_t tick;
+    uint32_t input_count;
+    tick_input_t *inputs;
+} msg_tick_inputs;
+#define MSG_TICK_INPUTS 11
+
+// Hash of the world after a lockstep tick, for clients to check their own simulation against.
+typedef struct {
+    uint32_t tick;
+    uint32_t hash;
+} msg_state_hash;
+#define MSG_STATE_HASH 12
+
+// Sent by a lockstep client whose world no longer matches the server's. It is sent a new join snapshot.
+typedef struct {
+    uint32_t tick;
+} msg_resync_request;
+#define MSG_RESYNC_REQUEST 13
+
+// Short name of a message type for logs and metrics.
+const char * message_type_name(message_t message_type);
+
+// Returns the number of bytes written, or 0 or less if the message could not be sent.
+ssize_t send_message(int fd, message_t message_type, void *message_ptr);
+
+// Serializes a message into a buffer of at least MAX_MESSAGE_SIZE bytes to be sent later, counting it as sent.
+// Returns its size, or 0 if the message type is unknown.
+size_t encode_message(unsigned char *buffer, message_t message_type, void *message_ptr);
+
+// Serializes a world snapshot into a malloc'd buffer, so one encoding can be sent to any number of clients. The snakes
+// are sorted by player id in place, which is what makes their ids and positions compress well.
+unsigned char * serialize_world_snapshot(snake_t *snakes, uint32_t snake_count, size_t *size);
+// Most bytes encode_tick_inputs can take for the given number of inputs.
+size_t tick_inputs_max_size(uint32_t input_count);
+// Serializes a tick's inputs into a buffer of at least tick_inputs_max_size bytes, so one encoding can be sent to every
+// lockstep client. The inputs must be sorted by player id. Returns the size of the message.
+size_t encode_tick_inputs(unsigned char *buffer, uint32_t tick, const tick_input_t *inputs, uint32_t input_count);
+// Sends a message that was already serialized.
+ssize_t send_serialized_message(int fd, const unsigned char *message, size_t size);
+// Reads one message and decodes it into memory taken from the given arena, so it stays valid until the arena is reset.
+ssize_t recv_message(int fd, arena_t *arena, message_t *message_type, void **message_ptr);
+// Decodes the first message in a buffer of bytes received without blocking. Returns the number of bytes the message
+// took up, 0 if the buffer does not hold a whole message yet, or -1 if the bytes are not a valid message.
+ssize_t decode_message(const unsigned char *buffer, size_t size, arena_t *arena, message_t *message_type,
+                       void **message_ptr);
 
 #endif //CSNAKE_MESSAGES_H
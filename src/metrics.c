@@ -0,0 +1,327 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "log.h"
+#include "messages.h"
+#include "socket.h"
+
+#define HISTOGRAM_BUCKETS 14
+
+typedef struct {
+    uint64_t buckets[HISTOGRAM_BUCKETS]; // Not cumulative; summed up when rendered.
+    uint64_t sum;
+    uint64_t count;
+} histogram_t;
+
+typedef struct metrics_shard {
+    struct metrics_shard *next;
+    int in_use;
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t messages_in[METRICS_MESSAGE_TYPES];
+    uint64_t bytes_in[METRICS_MESSAGE_TYPES];
+    uint64_t messages_out[METRICS_MESSAGE_TYPES];
+    uint64_t bytes_out[METRICS_MESSAGE_TYPES];
+    histogram_t histograms[HISTOGRAM_COUNT];
+} metrics_shard_t;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    double scale; // Multiplies raw values into the unit in the metric name.
+    uint64_t bounds[HISTOGRAM_BUCKETS - 1]; // The last bucket is +Inf.
+} histogram_info_t;
+
+static const histogram_info_t histogram_info[HISTOGRAM_COUNT] = {
+    {"csnake_broadcast_fanout", "Clients a snake's move was sent to on the tick it moved.", 1,
+        {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384}},
+    {"csnake_clients_mutex_wait_seconds", "Time spent waiting for the client list lock.", 1e-9,
+        {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 50000000, 100000000}},
+    {"csnake_tick_duration_seconds", "Time spent simulating one tick.", 1e-9,
+        {1000, 5000, 10000, 50000, 100000, 500000, 1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+         100000000}},
+    {"csnake_tick_encode_seconds", "Time an encoder spent on its share of one tick's messages.", 1e-9,
+        {1000, 5000, 10000, 50000, 100000, 500000, 1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+         100000000}},
+    {"csnake_tick_send_seconds", "Time spent writing out one tick's messages.", 1e-9,
+        {1000, 5000, 10000, 50000, 100000, 500000, 1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+         100000000}},
+    {"csnake_store_commit_batch", "Sessions flushed to the session store by one fdatasync.", 1,
+        {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384}},
+};
+
+static const char *counter_names[COUNTER_COUNT] = {
+    "csnake_connections_opened_total",
+    "csnake_connections_closed_total",
+    "csnake_inputs_dropped_total",
+    "csnake_inputs_coalesced_total",
+    "csnake_moves_blocked_total",
+    "csnake_moves_forgiven_total",
+    "csnake_sessions_stored_total",
+    "csnake_clients_timed_out_total",
+    "csnake_lockstep_resyncs_total",
+    "csnake_ticks_skipped_total",
+};
+
+// Shards are only ever pushed onto this list, so a scrape can walk it without a lock.
+static metrics_shard_t *shards = NULL;
+static __thread metrics_shard_t *local_shard = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static metrics_sampler_fn sampler = NULL;
+
+static volatile bool serving = false;
+static pthread_t metrics_thread;
+static int metrics_socket = -1;
+static char *metrics_path = NULL;
+
+// A finished thread leaves its counts in its shard and frees it up for the next thread.
+static void release_shard(void *shard_ptr) {
+    metrics_shard_t *shard = (metrics_shard_t *) shard_ptr;
+    __atomic_store_n(&shard->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static metrics_shard_t * get_shard(void) {
+    if (local_shard) {
+        return local_shard;
+    }
+
+    pthread_once(&shard_key_once, create_shard_key);
+
+    metrics_shard_t *shard;
+    for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&shard->in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(metrics_shard_t));
+        shard->in_use = 1;
+        shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, false, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+static void add(uint64_t *value, uint64_t amount) {
+    __atomic_fetch_add(value, amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static uint8_t type_index(uint8_t message_type) {
+    return message_type < METRICS_MESSAGE_TYPES ? message_type : METRICS_MESSAGE_TYPES - 1;
+}
+
+void metrics_count(int counter, uint64_t value) {
+    add(&get_shard()->counters[counter], value);
+}
+
+void metrics_message_in(uint8_t message_type, uint64_t bytes) {
+    metrics_shard_t *shard = get_shard();
+    add(&shard->messages_in[type_index(message_type)], 1);
+    add(&shard->bytes_in[type_index(message_type)], bytes);
+}
+
+void metrics_message_out(uint8_t message_type, uint64_t bytes) {
+    metrics_shard_t *shard = get_shard();
+    add(&shard->messages_out[type_index(message_type)], 1);
+    add(&shard->bytes_out[type_index(message_type)], bytes);
+}
+
+void metrics_observe(int histogram, uint64_t value) {
+    histogram_t *target = &get_shard()->histograms[histogram];
+    const uint64_t *bounds = histogram_info[histogram].bounds;
+
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && value > bounds[bucket]) {
+        bucket++;
+    }
+
+    add(&target->buckets[bucket], 1);
+    add(&target->sum, value);
+    add(&target->count, 1);
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void metrics_set_sampler(metrics_sampler_fn fn) {
+    sampler = fn;
+}
+
+static uint64_t sum_counter(size_t offset) {
+    uint64_t total = 0;
+    for (metrics_shard_t *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+        total += load((const uint64_t *) ((const unsigned char *) shard + offset));
+    }
+    return total;
+}
+
+#define SUM_FIELD(field) sum_counter(offsetof(metrics_shard_t, field))
+
+static void render_message_counter(FILE *out, const char *name, const char *help, size_t offset) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int type = 0; type < METRICS_MESSAGE_TYPES; type++) {
+        uint64_t total = sum_counter(offset + sizeof(uint64_t) * type);
+        if (total) {
+            fprintf(out, "%s{type=\"%s\"} %llu\n", name, message_type_name((message_t) type),
+                    (unsigned long long) total);
+        }
+    }
+}
+
+static void render_histogram(FILE *out, int histogram) {
+    const histogram_info_t *info = &histogram_info[histogram];
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+
+    uint64_t cumulative = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        cumulative += SUM_FIELD(histograms[histogram].buckets[bucket]);
+        if (bucket < HISTOGRAM_BUCKETS - 1) {
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", info->name, info->bounds[bucket] * info->scale,
+                    (unsigned long long) cumulative);
+        } else {
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", info->name, (unsigned long long) cumulative);
+        }
+    }
+    fprintf(out, "%s_sum %g\n", info->name, SUM_FIELD(histograms[histogram].sum) * info->scale);
+    fprintf(out, "%s_count %llu\n", info->name, (unsigned long long) SUM_FIELD(histograms[histogram].count));
+}
+
+void metrics_render(FILE *out) {
+    for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+        fprintf(out, "# TYPE %s counter\n%s %llu\n", counter_names[counter], counter_names[counter],
+                (unsigned long long) SUM_FIELD(counters[counter]));
+    }
+
+    render_message_counter(out, "csnake_messages_received_total", "Messages received by type.",
+                           offsetof(metrics_shard_t, messages_in));
+    render_message_counter(out, "csnake_bytes_received_total", "Bytes received by message type.",
+                           offsetof(metrics_shard_t, bytes_in));
+    render_message_counter(out, "csnake_messages_sent_total", "Messages sent by type.",
+                           offsetof(metrics_shard_t, messages_out));
+    render_message_counter(out, "csnake_bytes_sent_total", "Bytes sent by message type.",
+                           offsetof(metrics_shard_t, bytes_out));
+
+    for (int histogram = 0; histogram < HISTOGRAM_COUNT; histogram++) {
+        render_histogram(out, histogram);
+    }
+
+    if (sampler) {
+        sampler(out);
+    }
+}
+
+// Answers one scrape. Requests are read but not parsed, so both HTTP scrapers and plain socket tools work.
+static void serve_scrape(int fd) {
+    struct pollfd request;
+    request.fd = fd;
+    request.events = POLLIN;
+    if (poll(&request, 1, 100) > 0) {
+        char discard[1024];
+        if (read(fd, discard, sizeof(discard)) < 0) {
+            log_debug("serve_scrape: read error: %s", strerror(errno));
+        }
+    }
+
+    char *body = NULL;
+    size_t body_size = 0;
+    FILE *out = open_memstream(&body, &body_size);
+    metrics_render(out);
+    fclose(out);
+
+    char header[128];
+    int header_size = snprintf(header, sizeof(header),
+                               "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\n\r\n", body_size);
+    ssend(fd, header, (size_t) header_size);
+    ssend(fd, body, body_size);
+    free(body);
+}
+
+static void * serve_metrics(void *dummy) {
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+    struct pollfd events;
+    events.fd = metrics_socket;
+    events.events = POLLIN;
+
+    while (serving) {
+        // metrics_stop shuts the socket down to wake this up.
+        if (poll(&events, 1, -1) <= 0 || !serving) {
+            continue;
+        }
+
+        int scrape_fd = accept(metrics_socket, NULL, NULL);
+        if (scrape_fd < 0) {
+            log_error("serve_metrics: accept error: %s", strerror(errno));
+            continue;
+        }
+        serve_scrape(scrape_fd);
+        close(scrape_fd);
+    }
+
+    return NULL;
+}
+
+int metrics_start(const char *path) {
+    metrics_socket = listen_unix_socket(path);
+    if (metrics_socket == -1) {
+        log_error("metrics_start: Could not serve metrics on %s", path);
+        return -1;
+    }
+
+    metrics_path = strdup(path);
+    serving = true;
+    pthread_create(&metrics_thread, NULL, serve_metrics, NULL);
+    log_info("metrics_start: Serving metrics on %s", path);
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (!serving) {
+        return;
+    }
+
+    serving = false;
+    shutdown(metrics_socket, SHUT_RDWR);
+    pthread_join(metrics_thread, NULL);
+    close(metrics_socket);
+    unlink(metrics_path);
+    free(metrics_path);
+    metrics_socket = -1;
+}
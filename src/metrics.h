@@ -0,0 +1,62 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_METRICS_H
+#define CSNAKE_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Server metrics. Every thread counts into its own shard with relaxed atomic adds, and a scrape sums the shards
+// without taking any lock. The totals are served in the Prometheus text format over a unix socket.
+//
+
+// Message types are counted up to this value; anything above it is counted as the last type.
+#define METRICS_MESSAGE_TYPES 16
+
+enum {
+    COUNTER_CONNECTIONS_OPENED,
+    COUNTER_CONNECTIONS_CLOSED,
+    COUNTER_INPUTS_DROPPED,    // Over the client's input rate limit.
+    COUNTER_INPUTS_COALESCED,  // Replaced by a later input before the tick applied them.
+    COUNTER_MOVES_BLOCKED,     // Onto a cell taken in the world the player saw.
+    COUNTER_MOVES_FORGIVEN,    // Onto a cell taken by now, but free in the world the player saw.
+    COUNTER_SESSIONS_STORED,   // Finished sessions flushed to the session store.
+    COUNTER_CLIENTS_TIMED_OUT, // Disconnected for sending nothing for too long.
+    COUNTER_LOCKSTEP_RESYNCS,  // Lockstep clients sent a new snapshot after their world went astray.
+    COUNTER_TICKS_SKIPPED,     // Slept through by an idle simulation instead of being run.
+    COUNTER_COUNT
+};
+
+enum {
+    HISTOGRAM_FANOUT,       // Clients a snake's move was sent to on the tick it moved.
+    HISTOGRAM_LOCK_WAIT,    // Nanoseconds spent waiting for clients_mutex.
+    HISTOGRAM_TICK,         // Nanoseconds spent simulating one tick.
+    HISTOGRAM_TICK_ENCODE,  // Nanoseconds an encoder spent on its share of one tick's messages.
+    HISTOGRAM_TICK_SEND,    // Nanoseconds spent writing out one tick's messages.
+    HISTOGRAM_COMMIT_BATCH, // Sessions flushed to the session store by one fdatasync.
+    HISTOGRAM_COUNT
+};
+
+// Writes extra metrics at scrape time, for values such as gauges that are cheaper to sample than to count.
+typedef void (*metrics_sampler_fn)(FILE *out);
+
+void metrics_count(int counter, uint64_t value);
+void metrics_message_in(uint8_t message_type, uint64_t bytes);
+void metrics_message_out(uint8_t message_type, uint64_t bytes);
+void metrics_observe(int histogram, uint64_t value);
+
+// Monotonic clock in nanoseconds, for timing histograms.
+uint64_t metrics_now(void);
+
+void metrics_set_sampler(metrics_sampler_fn sampler);
+// Writes every metric in the Prometheus text format.
+void metrics_render(FILE *out);
+
+// Serves metrics on a unix socket at the given path until metrics_stop is called. Returns 0 if the endpoint started.
+int metrics_start(const char *path);
+void metrics_stop(void);
+
+#endif //CSNAKE_METRICS_H
@@ -0,0 +1,136 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "minimap.h"
+
+// From empty to full. Any occupied cell shows up as at least the second glyph.
+static const char DENSITY_GLYPHS[] = " .:-=+*#%";
+#define DENSITY_LEVELS ((int) sizeof(DENSITY_GLYPHS) - 1)
+
+int minimap_init(minimap_t *map, int board_width, int board_height, int max_width, int max_height) {
+    memset(map, 0, sizeof(minimap_t));
+    max_width = max_width > 0 ? max_width : 1;
+    max_height = max_height > 0 ? max_height : 1;
+    map->board_width = board_width;
+    map->board_height = board_height;
+    map->block_width = (board_width + max_width - 1) / max_width;
+    map->block_height = (board_height + max_height - 1) / max_height;
+    map->width = (board_width + map->block_width - 1) / map->block_width;
+    map->height = (board_height + map->block_height - 1) / map->block_height;
+
+    size_t blocks = (size_t) map->width * map->height;
+    map->occupied = calloc(blocks, sizeof(uint32_t));
+    map->dirty = calloc(blocks, sizeof(bool));
+    map->dirty_blocks = malloc(sizeof(uint32_t) * blocks);
+    map->column_counts = malloc(sizeof(uint32_t) * board_width);
+    if (map->occupied == NULL || map->dirty == NULL || map->dirty_blocks == NULL || map->column_counts == NULL) {
+        minimap_destroy(map);
+        return -1;
+    }
+    minimap_touch_all(map);
+    return 0;
+}
+
+void minimap_destroy(minimap_t *map) {
+    free(map->occupied);
+    free(map->dirty);
+    free(map->dirty_blocks);
+    free(map->column_counts);
+    memset(map, 0, sizeof(minimap_t));
+}
+
+static void touch_block(minimap_t *map, uint32_t block) {
+    if (!map->dirty[block]) {
+        map->dirty[block] = true;
+        map->dirty_blocks[map->dirty_count++] = block;
+    }
+}
+
+void minimap_touch(minimap_t *map, int x, int y) {
+    if (x < 0 || x >= map->board_width || y < 0 || y >= map->board_height) {
+        return;
+    }
+    touch_block(map, (uint32_t) ((y / map->block_height) * map->width + x / map->block_width));
+}
+
+void minimap_touch_all(minimap_t *map) {
+    for (uint32_t block = 0; block < (uint32_t) (map->width * map->height); block++) {
+        touch_block(map, block);
+    }
+}
+
+// Counts the occupied cells of one block.
+static uint32_t count_block(const minimap_t *map, const uint16_t *cells, uint32_t block) {
+    int left = (int) (block % map->width) * map->block_width;
+    int top = (int) (block / map->width) * map->block_height;
+    int right = left + map->block_width < map->board_width ? left + map->block_width : map->board_width;
+    int bottom = top + map->block_height < map->board_height ? top + map->block_height : map->board_height;
+
+    uint32_t occupied = 0;
+    for (int y = top; y < bottom; y++) {
+        const uint16_t *row = cells + (size_t) y * map->board_width;
+        for (int x = left; x < right; x++) {
+            occupied += row[x] != 0;
+        }
+    }
+    return occupied;
+}
+
+// Counts every block, a band of block_height rows at a time. Each row of cells is added into a count per column,
+// then each block sums its columns.
+static void count_all_blocks(minimap_t *map, const uint16_t *cells) {
+    for (int block_y = 0; block_y < map->height; block_y++) {
+        int top = block_y * map->block_height;
+        int bottom = top + map->block_height < map->board_height ? top + map->block_height : map->board_height;
+
+        uint32_t *columns = map->column_counts;
+        memset(columns, 0, sizeof(uint32_t) * map->board_width);
+        for (int y = top; y < bottom; y++) {
+            const uint16_t *row = cells + (size_t) y * map->board_width;
+            for (int x = 0; x < map->board_width; x++) {
+                columns[x] += row[x] != 0;
+            }
+        }
+
+        uint32_t *occupied = map->occupied + (size_t) block_y * map->width;
+        for (int block_x = 0; block_x < map->width; block_x++) {
+            int left = block_x * map->block_width;
+            int right = left + map->block_width < map->board_width ? left + map->block_width : map->board_width;
+            uint32_t sum = 0;
+            for (int x = left; x < right; x++) {
+                sum += columns[x];
+            }
+            occupied[block_x] = sum;
+        }
+    }
+}
+
+void minimap_update(minimap_t *map, const uint16_t *cells) {
+    uint32_t blocks = (uint32_t) (map->width * map->height);
+    if (map->dirty_count > blocks / 4) {
+        // Counting a few blocks at a time only pays off while few of them changed.
+        count_all_blocks(map, cells);
+        memset(map->dirty, 0, sizeof(bool) * blocks);
+    } else {
+        for (uint32_t i = 0; i < map->dirty_count; i++) {
+            uint32_t block = map->dirty_blocks[i];
+            map->occupied[block] = count_block(map, cells, block);
+            map->dirty[block] = false;
+        }
+    }
+    map->dirty_count = 0;
+}
+
+char minimap_glyph(const minimap_t *map, int block_x, int block_y) {
+    uint32_t occupied = map->occupied[block_y * map->width + block_x];
+    if (occupied == 0) {
+        return DENSITY_GLYPHS[0];
+    }
+    uint32_t area = (uint32_t) (map->block_width * map->block_height);
+    // Rounding up keeps a lone cell off the blank glyph and lets a full block, however small, reach the last one.
+    return DENSITY_GLYPHS[(occupied * (DENSITY_LEVELS - 1) + area - 1) / area];
+}
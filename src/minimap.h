@@ -0,0 +1,48 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_MINIMAP_H
+#define CSNAKE_MINIMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Downsampled view of a whole board, for when the board is larger than the terminal. The board is split into blocks
+// of cells, one per glyph, and each block keeps how many of its cells are occupied. A block is only counted again
+// after one of its cells changed, so keeping the map up to date costs as much as the moves since the last frame,
+// however large the board is. Counting every block at once goes a whole row of cells at a time, a loop the compiler
+// can vectorize.
+//
+
+typedef struct {
+    int board_width;
+    int board_height;
+    int width; // In blocks.
+    int height;
+    int block_width; // In cells.
+    int block_height;
+    uint32_t *occupied; // Occupied cells in each block.
+    bool *dirty; // Blocks to count again on the next update, each of which is also in dirty_blocks once.
+    uint32_t *dirty_blocks;
+    uint32_t dirty_count;
+    uint32_t *column_counts; // Scratch space for counting every block, one entry per column of the board.
+} minimap_t;
+
+// Sets up a map of a board that fits in the given number of glyphs, with every block to be counted. Returns 0 on
+// success or -1 if there is no memory.
+int minimap_init(minimap_t *map, int board_width, int board_height, int max_width, int max_height);
+void minimap_destroy(minimap_t *map);
+
+// Marks the block holding the cell to be counted again. Cells off the board are ignored.
+void minimap_touch(minimap_t *map, int x, int y);
+// Marks every block to be counted again.
+void minimap_touch_all(minimap_t *map);
+// Counts the marked blocks again from the board's cells, given as the number of snakes on each cell, row by row.
+void minimap_update(minimap_t *map, const uint16_t *cells);
+
+// Glyph for how full a block is, from a space for an empty block to '%' for a full one.
+char minimap_glyph(const minimap_t *map, int block_x, int block_y);
+
+#endif //CSNAKE_MINIMAP_H
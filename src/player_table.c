@@ -0,0 +1,157 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "player_table.h"
+
+#define INITIAL_CAPACITY 64
+
+void player_table_init(player_table_t *table) {
+    memset(table, 0, sizeof(player_table_t));
+    table->free_head = PLAYER_SLOT_NONE;
+}
+
+void player_table_destroy(player_table_t *table) {
+    free(table->used);
+    free(table->player_ids);
+    free(table->xs);
+    free(table->ys);
+    free(table->moved_ticks);
+    free(table->sockets);
+    free(table->owners);
+    free(table->next_free);
+    free(table->slots_by_id);
+    player_table_init(table);
+}
+
+// Grows a column to the given number of entries. The column is left as it was if there is no memory.
+static bool grow_column(void **column, size_t entry_size, uint32_t capacity) {
+    void *grown = realloc(*column, entry_size * capacity);
+    if (grown == NULL) {
+        return false;
+    }
+    *column = grown;
+    return true;
+}
+
+// Doubles the number of slots. The capacity only goes up once every column has the room.
+static bool grow_table(player_table_t *table) {
+    uint32_t capacity = table->capacity ? table->capacity * 2 : INITIAL_CAPACITY;
+    if (!grow_column((void **) &table->used, sizeof(bool), capacity) ||
+        !grow_column((void **) &table->player_ids, sizeof(uint32_t), capacity) ||
+        !grow_column((void **) &table->xs, sizeof(int16_t), capacity) ||
+        !grow_column((void **) &table->ys, sizeof(int16_t), capacity) ||
+        !grow_column((void **) &table->moved_ticks, sizeof(uint64_t), capacity) ||
+        !grow_column((void **) &table->sockets, sizeof(int), capacity) ||
+        !grow_column((void **) &table->owners, sizeof(void *), capacity) ||
+        !grow_column((void **) &table->next_free, sizeof(uint32_t), capacity)) {
+        return false;
+    }
+    table->capacity = capacity;
+    return true;
+}
+
+uint32_t player_table_add(player_table_t *table, void *owner, int socket) {
+    uint32_t slot = table->free_head;
+    if (slot != PLAYER_SLOT_NONE) {
+        table->free_head = table->next_free[slot];
+    } else {
+        if (table->end == table->capacity && !grow_table(table)) {
+            return PLAYER_SLOT_NONE;
+        }
+        slot = table->end++;
+    }
+
+    table->used[slot] = true;
+    table->player_ids[slot] = 0;
+    table->xs[slot] = 0;
+    table->ys[slot] = 0;
+    table->moved_ticks[slot] = 0;
+    table->sockets[slot] = socket;
+    table->owners[slot] = owner;
+    table->count++;
+    return slot;
+}
+
+void player_table_remove(player_table_t *table, uint32_t slot) {
+    player_table_set_id(table, slot, 0);
+    table->used[slot] = false;
+    table->sockets[slot] = -1;
+    table->owners[slot] = NULL;
+    table->next_free[slot] = table->free_head;
+    table->free_head = slot;
+    table->count--;
+}
+
+void player_table_clear(player_table_t *table) {
+    for (uint32_t slot = 0; slot < table->end; slot++) {
+        uint32_t player_id = table->player_ids[slot];
+        if (table->used[slot] && player_id < table->id_capacity) {
+            table->slots_by_id[player_id] = 0;
+        }
+    }
+    table->end = 0;
+    table->count = 0;
+    table->free_head = PLAYER_SLOT_NONE;
+}
+
+// Makes room in the index for the given id, then indexes the players whose ids were only scanned for until now.
+static void grow_index(player_table_t *table, uint32_t player_id) {
+    uint32_t capacity = table->id_capacity ? table->id_capacity : INITIAL_CAPACITY;
+    while (capacity <= player_id) {
+        capacity *= 2;
+    }
+    if (capacity > PLAYER_ID_INDEX_LIMIT) {
+        capacity = PLAYER_ID_INDEX_LIMIT;
+    }
+    if (!grow_column((void **) &table->slots_by_id, sizeof(uint32_t), capacity)) {
+        return;
+    }
+    memset(table->slots_by_id + table->id_capacity, 0, sizeof(uint32_t) * (capacity - table->id_capacity));
+
+    for (uint32_t slot = 0; slot < table->end; slot++) {
+        uint32_t id = table->player_ids[slot];
+        if (table->used[slot] && id >= table->id_capacity && id < capacity) {
+            table->slots_by_id[id] = slot + 1;
+        }
+    }
+    table->id_capacity = capacity;
+}
+
+void player_table_set_id(player_table_t *table, uint32_t slot, uint32_t player_id) {
+    uint32_t old_id = table->player_ids[slot];
+    if (old_id != 0 && old_id < table->id_capacity && table->slots_by_id[old_id] == slot + 1) {
+        table->slots_by_id[old_id] = 0;
+    }
+    table->player_ids[slot] = player_id;
+    if (player_id == 0) {
+        return;
+    }
+
+    if (player_id >= table->id_capacity && player_id < PLAYER_ID_INDEX_LIMIT) {
+        grow_index(table, player_id);
+    }
+    if (player_id < table->id_capacity) {
+        table->slots_by_id[player_id] = slot + 1;
+    }
+}
+
+uint32_t player_table_find(const player_table_t *table, uint32_t player_id) {
+    if (player_id == 0) {
+        return PLAYER_SLOT_NONE;
+    }
+    if (player_id < table->id_capacity) {
+        return table->slots_by_id[player_id] ? table->slots_by_id[player_id] - 1 : PLAYER_SLOT_NONE;
+    }
+
+    // Too large an id for the index, or no memory to grow it when it was set.
+    for (uint32_t slot = 0; slot < table->end; slot++) {
+        if (table->used[slot] && table->player_ids[slot] == player_id) {
+            return slot;
+        }
+    }
+    return PLAYER_SLOT_NONE;
+}
@@ -0,0 +1,60 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_PLAYER_TABLE_H
+#define CSNAKE_PLAYER_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Dense table of players, kept by both the server and the client. Every player has a slot, and each of its fields is
+// kept in an array of its own indexed by slot, so a loop over the world runs through contiguous memory instead of
+// chasing list nodes. Freed slots go on a free list and are handed out again before the table grows, which keeps the
+// slots in use packed at the start of the arrays. A second array indexed by player id finds a player's slot in
+// constant time.
+//
+// The table is not thread safe. Growing it moves the arrays, so every access must hold whatever lock guards the table.
+//
+
+#define PLAYER_SLOT_NONE UINT32_MAX
+
+// The id index is only grown this far, so a few huge ids cannot take up all memory. Players with larger ids are still
+// found, by a scan of the id column.
+#define PLAYER_ID_INDEX_LIMIT (1u << 24)
+
+typedef struct {
+    uint32_t capacity;
+    uint32_t end; // Every slot in use is below this.
+    uint32_t count; // Slots in use.
+    uint32_t free_head; // Most recently freed slot, or PLAYER_SLOT_NONE.
+    // The columns, one entry per slot.
+    bool *used;
+    uint32_t *player_ids; // 0 for a player without an id.
+    int16_t *xs;
+    int16_t *ys;
+    uint64_t *moved_ticks; // Tick the player last moved on, for a table kept by something that counts ticks.
+    int *sockets; // The player's connection, or -1.
+    void **owners; // Whatever the keeper of the table has for the player, or NULL.
+    uint32_t *next_free; // For a free slot, the one freed before it.
+    // Slot plus one of each indexed player id, 0 for none.
+    uint32_t *slots_by_id;
+    uint32_t id_capacity;
+} player_table_t;
+
+void player_table_init(player_table_t *table);
+void player_table_destroy(player_table_t *table);
+
+// Takes a slot for a player with no id yet, at 0,0. Returns PLAYER_SLOT_NONE if there is no memory for it.
+uint32_t player_table_add(player_table_t *table, void *owner, int socket);
+void player_table_remove(player_table_t *table, uint32_t slot);
+// Frees every slot.
+void player_table_clear(player_table_t *table);
+
+// Gives the player in a slot an id, or takes it away with 0.
+void player_table_set_id(player_table_t *table, uint32_t slot, uint32_t player_id);
+// Returns the slot of the player with the given id, or PLAYER_SLOT_NONE.
+uint32_t player_table_find(const player_table_t *table, uint32_t player_id);
+
+#endif //CSNAKE_PLAYER_TABLE_H
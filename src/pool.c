@@ -0,0 +1,115 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "log.h"
+
+struct pool_slab {
+    pool_slab_t *next;
+    // Objects follow the slab header.
+};
+
+// Free objects store the next free object in their first bytes, so every object must be able to hold a pointer.
+static size_t pool_object_size(size_t object_size) {
+    size_t size = object_size < sizeof(void *) ? sizeof(void *) : object_size;
+    return (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+void pool_init(pool_t *pool, size_t object_size, size_t objects_per_slab) {
+    pool->object_size = pool_object_size(object_size);
+    pool->objects_per_slab = objects_per_slab;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->in_use = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+}
+
+// Adds a new slab and threads its objects onto the free list. Must be called with the pool locked.
+static int pool_grow(pool_t *pool) {
+    size_t header_size = pool_object_size(sizeof(pool_slab_t));
+    pool_slab_t *slab = malloc(header_size + pool->object_size * pool->objects_per_slab);
+    if (slab == NULL) {
+        log_error("pool_grow: Could not allocate a slab of %d objects", pool->objects_per_slab);
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    unsigned char *objects = (unsigned char *) slab + header_size;
+    for (size_t i = pool->objects_per_slab; i > 0; i--) {
+        void *object = objects + (i - 1) * pool->object_size;
+        *(void **) object = pool->free_list;
+        pool->free_list = object;
+    }
+
+    log_debug("pool_grow: Pool of %d byte objects grew to %d objects", pool->object_size,
+              pool->in_use + pool->objects_per_slab);
+    return 0;
+}
+
+void * pool_alloc(pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->free_list == NULL && pool_grow(pool)) {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+
+    void *object = pool->free_list;
+    pool->free_list = *(void **) object;
+    pool->in_use++;
+
+    pthread_mutex_unlock(&pool->mutex);
+    return object;
+}
+
+void pool_free(pool_t *pool, void *object) {
+    if (object == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    *(void **) object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->slabs) {
+        pool_slab_t *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+    pool->in_use = 0;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void arena_init(arena_t *arena, void *buffer, size_t size) {
+    arena->base = buffer;
+    arena->size = size;
+    arena->used = 0;
+}
+
+void * arena_alloc(arena_t *arena, size_t size) {
+    uintptr_t current = (uintptr_t) (arena->base + arena->used);
+    size_t start = arena->used + (ARENA_ALIGNMENT - current % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+    if (start + size > arena->size) {
+        log_error("arena_alloc: Arena of %d bytes cannot fit %d more bytes", arena->size, size);
+        return NULL;
+    }
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+void arena_reset(arena_t *arena) {
+    arena->used = 0;
+}
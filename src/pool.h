@@ -0,0 +1,52 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_POOL_H
+#define CSNAKE_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+//
+// Fixed size object pool for long lived records such as clients and snakes. Objects are carved out of slabs that are
+// only allocated when the pool grows past its high water mark, and freed objects are kept on a free list for reuse.
+//
+
+typedef struct pool_slab pool_slab_t;
+
+typedef struct {
+    size_t object_size;
+    size_t objects_per_slab;
+    void *free_list;
+    pool_slab_t *slabs;
+    size_t in_use;
+    pthread_mutex_t mutex;
+} pool_t;
+
+void pool_init(pool_t *pool, size_t object_size, size_t objects_per_slab);
+void * pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *object);
+// Releases every slab. Objects still in use become invalid.
+void pool_destroy(pool_t *pool);
+
+//
+// Bump allocator for short lived data such as decoded messages. Allocations come out of a caller supplied buffer and
+// are all released at once by arena_reset at the end of each tick. An arena is not thread safe and is meant to be
+// owned by a single thread.
+//
+
+typedef struct {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
+#define ARENA_ALIGNMENT 8
+
+void arena_init(arena_t *arena, void *buffer, size_t size);
+// Returns NULL if the arena does not have enough space left.
+void * arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+
+#endif //CSNAKE_POOL_H
@@ -0,0 +1,96 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "queue.h"
+
+void mpsc_queue_init(mpsc_queue_t *queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(mpsc_queue_t *queue, queue_node_t *node) {
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    // Producers are ordered by this exchange. The previous node is linked afterwards, and until then the consumer
+    // sees the queue end at the previous node.
+    queue_node_t *previous = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&previous->next, node, __ATOMIC_RELEASE);
+}
+
+queue_node_t * mpsc_queue_pop(mpsc_queue_t *queue) {
+    queue_node_t *tail = queue->tail;
+    queue_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    // The stub only marks an empty queue and is skipped over.
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // The tail is the last node. It can only be taken once something is behind it, so the stub is pushed back.
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    mpsc_queue_push(queue, &queue->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+int spsc_queue_init(spsc_queue_t *queue, uint32_t capacity) {
+    uint32_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    queue->entries = malloc(sizeof(void *) * size);
+    if (queue->entries == NULL) {
+        return -1;
+    }
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    return 0;
+}
+
+void spsc_queue_destroy(spsc_queue_t *queue) {
+    free(queue->entries);
+    queue->entries = NULL;
+}
+
+bool spsc_queue_push(spsc_queue_t *queue, void *entry) {
+    uint64_t tail = queue->tail;
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) > queue->mask) {
+        return false;
+    }
+    queue->entries[tail & queue->mask] = entry;
+    // The entry is written before the consumer can see it.
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void * spsc_queue_pop(spsc_queue_t *queue) {
+    uint64_t head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    void *entry = queue->entries[head & queue->mask];
+    // The entry is read before the producer can reuse its place.
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return entry;
+}
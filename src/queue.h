@@ -0,0 +1,54 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_QUEUE_H
+#define CSNAKE_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Lock-free multiple producer, single consumer queue for passing events between server threads. Nodes are intrusive:
+// embed a queue_node_t as the first member of the event struct and cast back after popping. Pushing never blocks or
+// fails; only the thread that owns the queue may pop from it.
+//
+
+typedef struct queue_node {
+    struct queue_node *next;
+} queue_node_t;
+
+typedef struct {
+    queue_node_t *head; // Last node pushed, swapped by producers.
+    queue_node_t *tail; // Next node to pop, only touched by the consumer.
+    queue_node_t stub;
+} mpsc_queue_t;
+
+void mpsc_queue_init(mpsc_queue_t *queue);
+void mpsc_queue_push(mpsc_queue_t *queue, queue_node_t *node);
+// Returns NULL if the queue is empty. It can also return NULL while a push is halfway done, in which case the
+// producer's wakeup that follows the push is the cue to try again.
+queue_node_t * mpsc_queue_pop(mpsc_queue_t *queue);
+
+//
+// Bounded lock-free single producer, single consumer queue of pointers, for handing work from one pipeline stage to the
+// next. The capacity is fixed when the queue is made, so a stage that gets ahead of the next one finds the queue full
+// instead of piling up work.
+//
+
+typedef struct {
+    void **entries;
+    uint32_t mask; // Capacity minus one, the capacity being a power of two.
+    uint64_t head; // Next entry to pop, only moved by the consumer.
+    uint64_t tail; // Next entry to push, only moved by the producer.
+} spsc_queue_t;
+
+// Makes room for at least the given number of entries. Returns 0 on success or -1 if there is no memory.
+int spsc_queue_init(spsc_queue_t *queue, uint32_t capacity);
+void spsc_queue_destroy(spsc_queue_t *queue);
+// Returns false if the queue is full.
+bool spsc_queue_push(spsc_queue_t *queue, void *entry);
+// Returns NULL if the queue is empty.
+void * spsc_queue_pop(spsc_queue_t *queue);
+
+#endif //CSNAKE_QUEUE_H
@@ -0,0 +1,580 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "log.h"
+#include "messages.h"
+#include "metrics.h"
+#include "pool.h"
+#include "relay.h"
+#include "snake.h"
+#include "socket.h"
+#include "timer_wheel.h"
+
+// Room for a whole join snapshot from upstream, and for decoding it.
+#define UPSTREAM_BUFFER_SIZE (1024 * 1024)
+#define SNAKES_PER_SLAB 64
+// Enough for any message a spectator sends, plus the start of the next one.
+#define SPECTATOR_RX_SIZE 64
+// A spectator this far behind is disconnected rather than buffered for without end.
+#define MAX_BACKLOG (8 * 1024 * 1024)
+
+// The relay wakes up this often to turn its timer wheel.
+#define TIMER_TICK_MS 100
+// Like a game server, the relay pings its spectators every second and gives up on those it hears nothing from.
+#define PING_INTERVAL_MS 1000
+#define HELLO_TIMEOUT_MS 5000
+#define IDLE_TIMEOUT_MS 10000
+#define RECONNECT_INTERVAL_MS 1000
+
+typedef struct {
+    int fd;
+    bool watching; // Sent its join snapshot, and everything since.
+    unsigned char rx_buffer[SPECTATOR_RX_SIZE];
+    size_t rx_used;
+    // Bytes the spectator's socket had no room for yet.
+    unsigned char *tx_buffer;
+    size_t tx_used;
+    size_t tx_capacity;
+    wheel_timer_t idle_timer;
+    uint64_t heard_tick;
+} spectator_t;
+
+static char *upstream_address = NULL;
+static int upstream_fd = -1;
+static unsigned char upstream_rx[UPSTREAM_BUFFER_SIZE];
+static size_t upstream_used = 0;
+static unsigned char upstream_scratch[UPSTREAM_BUFFER_SIZE];
+
+// The world as the relay was told it, by player id, and its encoding as a join snapshot, or NULL once it changed.
+static GHashTable *world = NULL;
+static pool_t snake_pool;
+static unsigned char *snapshot = NULL;
+static size_t snapshot_size = 0;
+
+// Messages from upstream to pass on to every watching spectator, collected over one read.
+static unsigned char *broadcast = NULL;
+static size_t broadcast_used = 0;
+static size_t broadcast_capacity = 0;
+
+static GSList *spectators = NULL;
+static timer_wheel_t wheel;
+
+static volatile bool running = true;
+static int relay_socket = -1;
+
+void relay_set_upstream(char *address) {
+    upstream_address = address;
+}
+
+bool relay_enabled(void) {
+    return upstream_address != NULL;
+}
+
+static void interrupt_handler(int dummy) {
+    log_info("interrupt_handler: SIGINT received. Shutting down relay...");
+    running = false;
+    shutdown(relay_socket, SHUT_RDWR);
+}
+
+// Appends bytes to a growing buffer. Returns false if there is no memory for them.
+static bool append_bytes(unsigned char **buffer, size_t *used, size_t *capacity, const void *bytes, size_t size) {
+    if (*capacity - *used < size) {
+        size_t new_capacity = *capacity ? *capacity : 1024;
+        while (new_capacity - *used < size) {
+            new_capacity *= 2;
+        }
+        unsigned char *new_buffer = realloc(*buffer, new_capacity);
+        if (new_buffer == NULL) {
+            return false;
+        }
+        *buffer = new_buffer;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *used, bytes, size);
+    *used += size;
+    return true;
+}
+
+static void broadcast_bytes(const unsigned char *bytes, size_t size) {
+    if (!append_bytes(&broadcast, &broadcast_used, &broadcast_capacity, bytes, size)) {
+        log_error("broadcast_bytes: No memory to pass on %zu bytes", size);
+    }
+}
+
+static void broadcast_message(message_t message_type, void *message_ptr) {
+    unsigned char message[MAX_MESSAGE_SIZE];
+    broadcast_bytes(message, encode_message(message, message_type, message_ptr));
+}
+
+static void broadcast_update(const snake_t *snake) {
+    msg_snake_update update;
+    update.snake = *snake;
+    broadcast_message(MSG_SNAKE_UPDATE, &update);
+}
+
+static void forget_snapshot() {
+    free(snapshot);
+    snapshot = NULL;
+}
+
+static void update_world(const snake_t *update) {
+    snake_t *snake = g_hash_table_lookup(world, GUINT_TO_POINTER(update->player_id));
+    if (snake == NULL) {
+        snake = pool_alloc(&snake_pool);
+        if (snake == NULL) {
+            log_error("update_world: No memory for player %d", update->player_id);
+            return;
+        }
+        g_hash_table_insert(world, GUINT_TO_POINTER(update->player_id), snake);
+    }
+    *snake = *update;
+    forget_snapshot();
+}
+
+static void remove_from_world(uint32_t player_id) {
+    snake_t *snake = g_hash_table_lookup(world, GUINT_TO_POINTER(player_id));
+    if (snake) {
+        g_hash_table_remove(world, GUINT_TO_POINTER(player_id));
+        pool_free(&snake_pool, snake);
+        forget_snapshot();
+    }
+}
+
+static void broadcast_departure(gpointer key, gpointer value, gpointer dummy) {
+    msg_client_disconnect message;
+    message.player_id = GPOINTER_TO_UINT(key);
+    broadcast_message(MSG_CLIENT_DISCONNECT, &message);
+    pool_free(&snake_pool, value);
+}
+
+// Takes on the world from a join snapshot. The first one is all there is, but one that comes after reconnecting
+// upstream is passed on as the difference from what the spectators already have, so they never notice.
+static void replace_world(msg_world_snapshot *message) {
+    GHashTable *new_world = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (uint32_t i = 0; i < message->snake_count; i++) {
+        snake_t *incoming = &message->snakes[i];
+        gpointer key = GUINT_TO_POINTER(incoming->player_id);
+        snake_t *snake = g_hash_table_lookup(world, key);
+        if (snake) {
+            g_hash_table_remove(world, key);
+        } else {
+            snake = pool_alloc(&snake_pool);
+            if (snake == NULL) {
+                log_error("replace_world: No memory for player %d", incoming->player_id);
+                continue;
+            }
+            snake->player_id = 0;
+        }
+        if (snake->player_id != incoming->player_id || snake->x != incoming->x || snake->y != incoming->y) {
+            broadcast_update(incoming);
+        }
+        *snake = *incoming;
+        g_hash_table_insert(new_world, key, snake);
+    }
+
+    // Whoever is left is gone.
+    g_hash_table_foreach(world, broadcast_departure, NULL);
+    g_hash_table_destroy(world);
+    world = new_world;
+    forget_snapshot();
+
+    log_info("replace_world: Watching a world of %d snakes", message->snake_count);
+}
+
+static void handle_upstream_message(message_t message_type, void *message_ptr, const unsigned char *bytes,
+                                    size_t size) {
+    if (message_type == MSG_SNAKE_UPDATE) {
+        update_world(&((msg_snake_update *) message_ptr)->snake);
+        broadcast_bytes(bytes, size);
+    } else if (message_type == MSG_CLIENT_DISCONNECT) {
+        remove_from_world(((msg_client_disconnect *) message_ptr)->player_id);
+        broadcast_bytes(bytes, size);
+    } else if (message_type == MSG_WORLD_SNAPSHOT) {
+        replace_world((msg_world_snapshot *) message_ptr);
+    } else if (message_type == MSG_PING) {
+        // Upstream's pings are answered here; the relay pings its own spectators.
+        msg_pong pong;
+        pong.timestamp_us = ((msg_ping *) message_ptr)->timestamp_us;
+        send_message(upstream_fd, MSG_PONG, &pong);
+    } else if (message_type != MSG_SERVER_WELCOME) {
+        log_error("handle_upstream_message: Received unexpected message type %d", message_type);
+    }
+}
+
+static void disconnect_upstream() {
+    close(upstream_fd);
+    upstream_fd = -1;
+    upstream_used = 0;
+}
+
+static void connect_upstream() {
+    if (upstream_address[0] == '/') {
+        upstream_fd = connect_unix_socket(upstream_address);
+    } else {
+        char host[256];
+        const char *colon = strrchr(upstream_address, ':');
+        if (colon == NULL || colon - upstream_address >= (long) sizeof(host)) {
+            log_error("connect_upstream: %s is neither host:port nor a path", upstream_address);
+            running = false;
+            return;
+        }
+        memcpy(host, upstream_address, (size_t) (colon - upstream_address));
+        host[colon - upstream_address] = '\0';
+        upstream_fd = connect_socket(host, (unsigned short) strtoul(colon + 1, NULL, 10));
+    }
+    if (upstream_fd < 0) {
+        upstream_fd = -1;
+        return;
+    }
+
+    msg_client_spectate spectate;
+    spectate.relay = 1;
+    if (send_message(upstream_fd, MSG_CLIENT_SPECTATE, &spectate) <= 0) {
+        disconnect_upstream();
+        return;
+    }
+    log_info("connect_upstream: Watching %s", upstream_address);
+}
+
+// Reads what upstream sent, updating the world and collecting what is to be passed on.
+static void read_upstream() {
+    ssize_t read_amount = recv(upstream_fd, upstream_rx + upstream_used, sizeof(upstream_rx) - upstream_used,
+                               MSG_DONTWAIT);
+    if (read_amount == 0 || (read_amount < 0 && errno != EAGAIN && errno != EINTR)) {
+        log_error("read_upstream: Lost %s, reconnecting", upstream_address);
+        disconnect_upstream();
+        return;
+    } else if (read_amount < 0) {
+        return;
+    }
+    upstream_used += read_amount;
+
+    arena_t arena;
+    arena_init(&arena, upstream_scratch, sizeof(upstream_scratch));
+    size_t offset = 0;
+    while (offset < upstream_used) {
+        message_t message_type;
+        void *message_ptr;
+        ssize_t consumed = decode_message(upstream_rx + offset, upstream_used - offset, &arena, &message_type,
+                                          &message_ptr);
+        if (consumed < 0 || (consumed == 0 && offset == 0 && upstream_used == sizeof(upstream_rx))) {
+            log_error("read_upstream: %s sent something that is not a message, reconnecting", upstream_address);
+            disconnect_upstream();
+            return;
+        } else if (consumed == 0) {
+            break;
+        }
+        handle_upstream_message(message_type, message_ptr, upstream_rx + offset, (size_t) consumed);
+        offset += consumed;
+        arena_reset(&arena);
+    }
+    upstream_used -= offset;
+    memmove(upstream_rx, upstream_rx + offset, upstream_used);
+}
+
+static void drop_spectator(spectator_t *spectator) {
+    log_info("drop_spectator: Dropping spectator [%d]", spectator->fd);
+    spectators = g_slist_remove(spectators, spectator);
+    timer_wheel_cancel(&wheel, &spectator->idle_timer);
+    close(spectator->fd);
+    free(spectator->tx_buffer);
+    free(spectator);
+}
+
+static void queue_bytes(spectator_t *spectator, const unsigned char *bytes, size_t size) {
+    if (!append_bytes(&spectator->tx_buffer, &spectator->tx_used, &spectator->tx_capacity, bytes, size)) {
+        log_error("queue_bytes: No memory to queue %zu bytes for [%d]", size, spectator->fd);
+    }
+}
+
+// Passes what was collected from upstream on to every watching spectator.
+static void flush_broadcast() {
+    if (broadcast_used == 0) {
+        return;
+    }
+    for (GSList *node = spectators; node != NULL; node = node->next) {
+        spectator_t *spectator = (spectator_t *) node->data;
+        if (spectator->watching) {
+            queue_bytes(spectator, broadcast, broadcast_used);
+        }
+    }
+    broadcast_used = 0;
+}
+
+// Writes as much of what is queued for the spectator as its socket takes. Returns false if the spectator is gone or
+// too far behind to keep.
+static bool write_spectator(spectator_t *spectator) {
+    if (spectator->tx_used == 0) {
+        return true;
+    }
+    ssize_t written_amount = send(spectator->fd, spectator->tx_buffer, spectator->tx_used,
+                                  MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written_amount < 0 && errno != EAGAIN && errno != EINTR) {
+        return false;
+    } else if (written_amount > 0) {
+        spectator->tx_used -= written_amount;
+        memmove(spectator->tx_buffer, spectator->tx_buffer + written_amount, spectator->tx_used);
+    }
+    if (spectator->tx_used > MAX_BACKLOG) {
+        log_error("write_spectator: Spectator [%d] is %zu bytes behind", spectator->fd, spectator->tx_used);
+        return false;
+    }
+    return true;
+}
+
+static void collect_snake(gpointer key, gpointer value, gpointer next) {
+    *(*(snake_t **) next)++ = *(snake_t *) value;
+}
+
+// Welcomes a spectator and sends it the world. Everything passed on from now on follows the snapshot. Returns false if
+// the world could not be encoded.
+static bool start_watching(spectator_t *spectator) {
+    msg_server_welcome welcome;
+    welcome.player_id = 0;
+    welcome.resume_token = 0;
+    unsigned char message[MAX_MESSAGE_SIZE];
+    queue_bytes(spectator, message, encode_message(message, MSG_SERVER_WELCOME, &welcome));
+
+    if (snapshot == NULL) {
+        // Encoded once for every spectator that joins until the world changes.
+        guint count = g_hash_table_size(world);
+        snake_t *snakes = malloc(sizeof(snake_t) * (count ? count : 1));
+        if (snakes != NULL) {
+            snake_t *next = snakes;
+            g_hash_table_foreach(world, collect_snake, &next);
+            snapshot = serialize_world_snapshot(snakes, count, &snapshot_size);
+            free(snakes);
+        }
+        if (snapshot == NULL) {
+            log_error("start_watching: No memory to send [%d] the world", spectator->fd);
+            return false;
+        }
+    }
+    queue_bytes(spectator, snapshot, snapshot_size);
+    spectator->watching = true;
+    return true;
+}
+
+// Returns false if the spectator is to be dropped.
+static bool handle_spectator_message(spectator_t *spectator, message_t message_type, void *message_ptr) {
+    if (message_type == MSG_CLIENT_SPECTATE && !spectator->watching) {
+        if (!start_watching(spectator)) {
+            return false;
+        }
+        log_info("handle_spectator_message: [%d] is watching%s", spectator->fd,
+                 ((msg_client_spectate *) message_ptr)->relay ? " as a relay" : "");
+    } else if (message_type == MSG_CLIENT_HELLO) {
+        log_error("handle_spectator_message: [%d] tried to play, but a relay can only be watched", spectator->fd);
+        return false;
+    } else if (message_type == MSG_CLIENT_KEYPRESS) {
+        return ((msg_client_keypress *) message_ptr)->key_code != 27;
+    } else if (message_type != MSG_PONG) {
+        log_error("handle_spectator_message: [%d] sent unexpected message type %d", spectator->fd, message_type);
+    }
+    return true;
+}
+
+// Reads from a spectator. Returns false if the spectator is to be dropped.
+static bool read_spectator(spectator_t *spectator) {
+    ssize_t read_amount = recv(spectator->fd, spectator->rx_buffer + spectator->rx_used,
+                               sizeof(spectator->rx_buffer) - spectator->rx_used, MSG_DONTWAIT);
+    if (read_amount == 0 || (read_amount < 0 && errno != EAGAIN && errno != EINTR)) {
+        return false;
+    } else if (read_amount < 0) {
+        return true;
+    }
+    spectator->rx_used += read_amount;
+    spectator->heard_tick = wheel.now;
+
+    unsigned char scratch[MAX_MESSAGE_SIZE];
+    arena_t arena;
+    arena_init(&arena, scratch, sizeof(scratch));
+    size_t offset = 0;
+    while (offset < spectator->rx_used) {
+        message_t message_type;
+        void *message_ptr;
+        ssize_t consumed = decode_message(spectator->rx_buffer + offset, spectator->rx_used - offset, &arena,
+                                          &message_type, &message_ptr);
+        if (consumed < 0 || message_type == MSG_WORLD_SNAPSHOT) {
+            log_error("read_spectator: [%d] sent an invalid message", spectator->fd);
+            return false;
+        } else if (consumed == 0) {
+            break;
+        }
+        offset += consumed;
+        if (!handle_spectator_message(spectator, message_type, message_ptr)) {
+            return false;
+        }
+        arena_reset(&arena);
+    }
+    spectator->rx_used -= offset;
+    memmove(spectator->rx_buffer, spectator->rx_buffer + offset, spectator->rx_used);
+    return true;
+}
+
+static void arm_idle_timer(spectator_t *spectator) {
+    uint64_t timeout_ms = spectator->watching ? IDLE_TIMEOUT_MS : HELLO_TIMEOUT_MS;
+    timer_wheel_add(&wheel, &spectator->idle_timer, spectator->heard_tick + timeout_ms / TIMER_TICK_MS, spectator);
+}
+
+// Drops a spectator that went quiet, or sets its timer again if it was heard from since.
+static void handle_idle_timer(wheel_timer_t *timer, void *dummy) {
+    spectator_t *spectator = (spectator_t *) timer->data;
+    uint64_t timeout_ms = spectator->watching ? IDLE_TIMEOUT_MS : HELLO_TIMEOUT_MS;
+    if (wheel.now - spectator->heard_tick < timeout_ms / TIMER_TICK_MS) {
+        arm_idle_timer(spectator);
+        return;
+    }
+    log_info("handle_idle_timer: Heard nothing from spectator [%d]", spectator->fd);
+    drop_spectator(spectator);
+}
+
+static void accept_spectator() {
+    int fd = accept(relay_socket, NULL, NULL);
+    if (fd < 0) {
+        if (running && errno != EINTR) {
+            log_error("accept_spectator: accept error: %s", strerror(errno));
+        }
+        return;
+    }
+    spectator_t *spectator = calloc(1, sizeof(spectator_t));
+    if (spectator == NULL) {
+        log_error("accept_spectator: No memory for [%d]", fd);
+        close(fd);
+        return;
+    }
+    spectator->fd = fd;
+    spectator->heard_tick = wheel.now;
+    arm_idle_timer(spectator);
+    spectators = g_slist_prepend(spectators, spectator);
+    log_info("accept_spectator: Accepted spectator [%d]", fd);
+}
+
+void run_relay(char *host, unsigned short port_num) {
+    signal(SIGINT, interrupt_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    relay_socket = listen_socket(host, port_num);
+    if (relay_socket == -1) {
+        log_error("run_relay: Could not open relay socket.");
+        return;
+    }
+
+    pool_init(&snake_pool, sizeof(snake_t), SNAKES_PER_SLAB);
+    world = g_hash_table_new(g_direct_hash, g_direct_equal);
+    timer_wheel_init(&wheel, metrics_now() / (TIMER_TICK_MS * 1000000ull));
+
+    struct pollfd *events = NULL;
+    guint capacity = 0;
+    uint64_t next_ping = 0;
+    uint64_t next_connect = 0;
+
+    while (running) {
+        uint64_t now = metrics_now();
+        timer_wheel_advance(&wheel, now / (TIMER_TICK_MS * 1000000ull), handle_idle_timer, NULL);
+
+        if (upstream_fd == -1 && now >= next_connect) {
+            connect_upstream();
+            next_connect = now + RECONNECT_INTERVAL_MS * 1000000ull;
+        }
+        if (now >= next_ping) {
+            msg_ping ping;
+            ping.timestamp_us = (uint32_t) (now / 1000);
+            broadcast_message(MSG_PING, &ping);
+            next_ping = now + PING_INTERVAL_MS * 1000000ull;
+        }
+
+        guint needed = 2 + g_slist_length(spectators);
+        if (needed > capacity) {
+            capacity = needed * 2;
+            events = realloc(events, sizeof(struct pollfd) * capacity);
+        }
+
+        // The listening socket, upstream, then the spectators in list order.
+        events[0].fd = relay_socket;
+        events[0].events = POLLIN;
+        events[1].fd = upstream_fd;
+        events[1].events = POLLIN;
+        guint count = 2;
+        for (GSList *node = spectators; node != NULL; node = node->next) {
+            spectator_t *spectator = (spectator_t *) node->data;
+            events[count].fd = spectator->fd;
+            events[count++].events = (short) (POLLIN | (spectator->tx_used ? POLLOUT : 0));
+        }
+
+        // Sleep until the next ping, reconnect or spectator timeout, unless the ping left anything to pass on.
+        uint64_t wake = next_ping;
+        if (upstream_fd == -1 && next_connect < wake) {
+            wake = next_connect;
+        }
+        uint64_t wheel_next = timer_wheel_next(&wheel);
+        if (wheel_next != UINT64_MAX && wheel_next * TIMER_TICK_MS * 1000000ull < wake) {
+            wake = wheel_next * TIMER_TICK_MS * 1000000ull;
+        }
+        int timeout = 0;
+        if (!broadcast_used) {
+            uint64_t after = metrics_now();
+            timeout = wake > after ? (int) ((wake - after) / 1000000) + 1 : 0;
+        }
+        if (poll(events, count, timeout) < 0) {
+            if (errno != EINTR) {
+                log_error("run_relay: poll error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        if (upstream_fd != -1 && events[1].revents) {
+            read_upstream();
+        }
+        // Spectators that start watching below get a snapshot that already has what was just read.
+        flush_broadcast();
+
+        guint index = 2;
+        GSList *node = spectators;
+        while (node != NULL) {
+            GSList *next = node->next;
+            spectator_t *spectator = (spectator_t *) node->data;
+            bool keep = true;
+            if (events[index++].revents & (POLLIN | POLLHUP | POLLERR)) {
+                keep = read_spectator(spectator);
+            }
+            if (keep) {
+                keep = write_spectator(spectator);
+            }
+            if (!keep) {
+                drop_spectator(spectator);
+            }
+            node = next;
+        }
+
+        if (events[0].revents) {
+            accept_spectator();
+        }
+    }
+
+    while (spectators) {
+        drop_spectator((spectator_t *) spectators->data);
+    }
+    if (upstream_fd != -1) {
+        disconnect_upstream();
+    }
+    free(events);
+    free(broadcast);
+    forget_snapshot();
+    g_hash_table_destroy(world);
+    pool_destroy(&snake_pool);
+    close(relay_socket);
+
+    log_info("run_relay: Relay shutdown complete.");
+}
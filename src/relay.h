@@ -0,0 +1,23 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_RELAY_H
+#define CSNAKE_RELAY_H
+
+#include <stdbool.h>
+
+//
+// Spectator relay. A relay watches a game server as a single spectator and passes what it is sent on to any number of
+// spectators of its own, so watchers cost the game server nothing. The relay keeps its own copy of the world to give
+// each new spectator a join snapshot, and forwards the updates that follow byte for byte. It speaks to its spectators
+// just like a game server does, so relays can watch other relays and be chained into a tree.
+//
+
+// Watches the game server or relay at the given address, either host:port or the path of a unix socket.
+void relay_set_upstream(char *address);
+bool relay_enabled(void);
+
+void run_relay(char *host, unsigned short port_num);
+
+#endif //CSNAKE_RELAY_H
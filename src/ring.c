@@ -0,0 +1,177 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "ring.h"
+
+// The data starts on its own page after the header.
+#define RING_DATA_OFFSET 4096
+
+// Not every libc has a wrapper for this.
+static int memfd_create_fd(const char *name) {
+    return (int) syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+}
+
+static int map_ring(ring_t *ring, size_t map_size) {
+    void *memory = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memory_fd, 0);
+    if (memory == MAP_FAILED) {
+        log_error("map_ring: Could not map the ring: %s", strerror(errno));
+        return -1;
+    }
+    ring->header = (ring_header_t *) memory;
+    ring->data = (unsigned char *) memory + RING_DATA_OFFSET;
+    ring->map_size = map_size;
+    return 0;
+}
+
+int ring_create(ring_t *ring, size_t capacity) {
+    memset(ring, 0, sizeof(ring_t));
+
+    size_t rounded = RING_MIN_CAPACITY;
+    while (rounded < capacity && rounded < RING_MAX_CAPACITY) {
+        rounded *= 2;
+    }
+    ring->capacity = rounded;
+
+    ring->memory_fd = memfd_create_fd("csnake-ring");
+    if (ring->memory_fd < 0) {
+        log_error("ring_create: memfd_create error: %s", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(ring->memory_fd, RING_DATA_OFFSET + rounded)) {
+        log_error("ring_create: ftruncate error: %s", strerror(errno));
+        close(ring->memory_fd);
+        return -1;
+    }
+    if (map_ring(ring, RING_DATA_OFFSET + rounded)) {
+        close(ring->memory_fd);
+        return -1;
+    }
+
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0) {
+        log_error("ring_create: eventfd error: %s", strerror(errno));
+        munmap(ring->header, ring->map_size);
+        close(ring->memory_fd);
+        return -1;
+    }
+
+    // A fresh memfd is zero filled, so only the capacity needs setting.
+    ring->header->capacity = (uint32_t) rounded;
+    return 0;
+}
+
+int ring_attach(ring_t *ring, int memory_fd, int event_fd) {
+    memset(ring, 0, sizeof(ring_t));
+    ring->memory_fd = memory_fd;
+    ring->event_fd = event_fd;
+
+    struct stat status;
+    if (fstat(memory_fd, &status)) {
+        log_error("ring_attach: fstat error: %s", strerror(errno));
+        goto fail;
+    }
+    if (status.st_size <= RING_DATA_OFFSET || map_ring(ring, (size_t) status.st_size)) {
+        log_error("ring_attach: The ring has a size of %ld bytes", (long) status.st_size);
+        goto fail;
+    }
+
+    // The capacity must agree with the mapping, or indexing could run off the end of it.
+    ring->capacity = ring->header->capacity;
+    if (ring->capacity == 0 || (ring->capacity & (ring->capacity - 1)) != 0 ||
+        RING_DATA_OFFSET + ring->capacity != ring->map_size) {
+        log_error("ring_attach: The ring has an invalid capacity of %d", ring->capacity);
+        munmap(ring->header, ring->map_size);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close(memory_fd);
+    close(event_fd);
+    return -1;
+}
+
+void ring_destroy(ring_t *ring) {
+    munmap(ring->header, ring->map_size);
+    close(ring->memory_fd);
+    close(ring->event_fd);
+}
+
+size_t ring_used(ring_t *ring) {
+    uint64_t tail = __atomic_load_n(&ring->header->tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+    return (size_t) (tail - head);
+}
+
+bool ring_write(ring_t *ring, const void *bytes, size_t size) {
+    ring_header_t *header = ring->header;
+    uint64_t tail = header->tail;
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (size > ring->capacity - (size_t) (tail - head)) {
+        return false;
+    }
+
+    size_t offset = (size_t) (tail & (ring->capacity - 1));
+    size_t first = ring->capacity - offset < size ? ring->capacity - offset : size;
+    memcpy(ring->data + offset, bytes, first);
+    memcpy(ring->data, (const unsigned char *) bytes + first, size - first);
+
+    // Publishing the tail and checking for a sleeping consumer must not be reordered, or a consumer that went to sleep
+    // in between would miss the write. The consumer does the same the other way round.
+    __atomic_store_n(&header->tail, tail + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        if (write(ring->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log_error("ring_write: Could not wake the consumer: %s", strerror(errno));
+        }
+    }
+    return true;
+}
+
+size_t ring_read(ring_t *ring, void *buffer, size_t size) {
+    ring_header_t *header = ring->header;
+    uint64_t head = header->head;
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    // The producer's side of the ring is not trusted to stay within the capacity.
+    size_t available = (size_t) (tail - head) < ring->capacity ? (size_t) (tail - head) : ring->capacity;
+    if (size > available) {
+        size = available;
+    }
+
+    size_t offset = (size_t) (head & (ring->capacity - 1));
+    size_t first = ring->capacity - offset < size ? ring->capacity - offset : size;
+    memcpy(buffer, ring->data + offset, first);
+    memcpy((unsigned char *) buffer + first, ring->data, size - first);
+
+    __atomic_store_n(&header->head, head + size, __ATOMIC_RELEASE);
+    return size;
+}
+
+bool ring_prepare_wait(ring_t *ring) {
+    __atomic_store_n(&ring->header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->header->tail, __ATOMIC_SEQ_CST) != ring->header->head) {
+        __atomic_store_n(&ring->header->consumer_waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void ring_finish_wait(ring_t *ring) {
+    __atomic_store_n(&ring->header->consumer_waiting, 0, __ATOMIC_RELAXED);
+    uint64_t count;
+    if (read(ring->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_error("ring_finish_wait: Could not read the eventfd: %s", strerror(errno));
+    }
+}
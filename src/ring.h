@@ -0,0 +1,65 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_RING_H
+#define CSNAKE_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Single producer, single consumer byte ring in shared memory, used by the server to write to clients on the same
+// host without going through a socket. The ring lives in a memfd that is passed to the client together with an
+// eventfd, which the producer only writes when the consumer has said it is going to sleep. Both ends carry the same
+// message framing as a socket would, so the consumer decodes the bytes it reads just like received ones.
+//
+
+// Capacity a client gets if it does not ask for one.
+#define RING_DEFAULT_CAPACITY (2 * 1024 * 1024)
+#define RING_MIN_CAPACITY (64 * 1024)
+#define RING_MAX_CAPACITY (64 * 1024 * 1024)
+
+// Lives at the start of the shared memory. Each counter has a cache line to itself so the two ends do not fight over
+// one. The counters only ever grow, and are taken modulo the capacity to index the data.
+typedef struct {
+    uint64_t head; // Bytes read so far, only written by the consumer.
+    char head_padding[56];
+    uint64_t tail; // Bytes written so far, only written by the producer.
+    char tail_padding[56];
+    uint32_t capacity;
+    uint32_t consumer_waiting; // Set by a consumer about to block on the eventfd.
+} ring_header_t;
+
+typedef struct {
+    ring_header_t *header;
+    unsigned char *data;
+    size_t capacity;
+    size_t map_size;
+    int memory_fd;
+    int event_fd;
+} ring_t;
+
+// Creates a ring of at least the given capacity, rounded up to a power of two within the limits above. Returns 0 on
+// success or -1 otherwise.
+int ring_create(ring_t *ring, size_t capacity);
+// Maps a ring created by another process from its memfd and eventfd, taking ownership of both. Returns 0 on success
+// or -1 otherwise, in which case the descriptors are closed.
+int ring_attach(ring_t *ring, int memory_fd, int event_fd);
+void ring_destroy(ring_t *ring);
+
+// Bytes written but not yet read.
+size_t ring_used(ring_t *ring);
+// Writes all of the bytes, or none if they do not fit. Wakes the consumer if it is waiting. Returns false if the bytes
+// did not fit.
+bool ring_write(ring_t *ring, const void *bytes, size_t size);
+// Reads up to size bytes. Returns how many were read.
+size_t ring_read(ring_t *ring, void *buffer, size_t size);
+// Tells the producer to wake the consumer on its next write. Returns false if there is already something to read, in
+// which case the consumer should not block.
+bool ring_prepare_wait(ring_t *ring);
+// Called by the consumer once it is awake again, to clear the eventfd.
+void ring_finish_wait(ring_t *ring);
+
+#endif //CSNAKE_RING_H
@@ -0,0 +1,359 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "log.h"
+#include "messages.h"
+#include "metrics.h"
+#include "router.h"
+#include "socket.h"
+
+// Backends are asked how many players they have this often, and those that are down are reconnected to.
+#define LOAD_INTERVAL_MS 1000
+// A player has this long to send a hello before the router gives up on them.
+#define HELLO_TIMEOUT_MS 5000
+// How long to wait before peeking again at a player whose hello has only partly arrived.
+#define PARTIAL_HELLO_RETRY_MS 10
+
+typedef struct {
+    char *path;
+    int fd; // Connection to the backend's route socket, or -1 while it is down.
+    uint32_t load; // Players the backend had when it last answered.
+    uint32_t routed; // Players sent to it since it was last asked.
+} backend_t;
+
+// A player whose hello the router is waiting for.
+typedef struct {
+    int fd;
+    uint64_t accepted_ns;
+    uint64_t retry_ns; // Not polled until then, after only part of the hello arrived.
+} pending_player_t;
+
+static backend_t *backends = NULL;
+static int backend_count = 0;
+static GSList *pending = NULL;
+static volatile bool running = true;
+static int router_socket = -1;
+
+int route_send(int fd, route_message_type_t type, uint32_t backend, uint32_t value, int client_fd) {
+    route_message_t message;
+    message.magic = ROUTE_MAGIC;
+    message.type = type;
+    message.backend = backend;
+    message.value = value;
+    ssize_t written_amount = client_fd == -1 ? ssend(fd, &message, sizeof(message))
+                                             : send_fds(fd, &message, sizeof(message), &client_fd, 1);
+    return written_amount == sizeof(message) ? 0 : -1;
+}
+
+int route_recv(int fd, route_message_t *message, int *client_fd) {
+    int fds[MAX_PASSED_FDS];
+    int fd_count = 0;
+    *client_fd = -1;
+    if (recv_fds(fd, message, sizeof(route_message_t), fds, &fd_count) != sizeof(route_message_t)) {
+        for (int i = 0; i < fd_count; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    // Only a client message brings a socket, and only the one.
+    int expected = message->type == ROUTE_CLIENT ? 1 : 0;
+    for (int i = expected; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    if (message->magic != ROUTE_MAGIC || fd_count < expected) {
+        log_error("route_recv: Received something that is not a route message");
+        if (expected && fd_count > 0) {
+            close(fds[0]);
+        }
+        return -1;
+    }
+    if (expected) {
+        *client_fd = fds[0];
+    }
+    return 0;
+}
+
+void router_add_backend(char *path) {
+    backends = realloc(backends, sizeof(backend_t) * (backend_count + 1));
+    backends[backend_count].path = path;
+    backends[backend_count].fd = -1;
+    backends[backend_count].load = 0;
+    backends[backend_count].routed = 0;
+    backend_count++;
+}
+
+int router_backend_count(void) {
+    return backend_count;
+}
+
+static void interrupt_handler(int dummy) {
+    log_info("interrupt_handler: SIGINT received. Shutting down router...");
+    running = false;
+    shutdown(router_socket, SHUT_RDWR);
+}
+
+static void disconnect_backend(backend_t *backend) {
+    log_error("disconnect_backend: Lost the backend at %s", backend->path);
+    close(backend->fd);
+    backend->fd = -1;
+}
+
+// Connects to the backends that are down and asks the rest for their load.
+static void check_backends() {
+    for (int i = 0; i < backend_count; i++) {
+        backend_t *backend = &backends[i];
+        if (backend->fd == -1) {
+            backend->fd = connect_unix_socket(backend->path);
+            if (backend->fd == -1) {
+                continue;
+            }
+            if (route_send(backend->fd, ROUTE_HELLO, (uint32_t) i, (uint32_t) backend_count, -1)) {
+                disconnect_backend(backend);
+                continue;
+            }
+            log_info("check_backends: Connected to backend %d at %s", i, backend->path);
+            backend->load = 0;
+        }
+        backend->routed = 0;
+        if (route_send(backend->fd, ROUTE_LOAD_QUERY, 0, 0, -1)) {
+            disconnect_backend(backend);
+        }
+    }
+}
+
+static void handle_backend(backend_t *backend) {
+    route_message_t message;
+    int client_fd;
+    if (route_recv(backend->fd, &message, &client_fd)) {
+        disconnect_backend(backend);
+        return;
+    }
+    if (client_fd != -1) {
+        close(client_fd);
+    }
+    if (message.type == ROUTE_LOAD) {
+        backend->load = message.value;
+    } else {
+        log_error("handle_backend: Unexpected message type %d from %s", message.type, backend->path);
+    }
+}
+
+// The backend for a player: the one whose ids the player's comes from if it is resuming, otherwise the one with the
+// fewest players. A spectator is sent to the one with the most, where there is the most to watch. Returns NULL if every
+// backend is down.
+static backend_t * choose_backend(uint32_t player_id, bool spectator) {
+    if (player_id != 0) {
+        backend_t *home = &backends[(player_id - 1) % (uint32_t) backend_count];
+        if (home->fd != -1) {
+            return home;
+        }
+        log_warn("choose_backend: The room of player %d is down, sending the player elsewhere", player_id);
+    }
+
+    backend_t *best = NULL;
+    for (int i = 0; i < backend_count; i++) {
+        uint32_t load = backends[i].load + backends[i].routed;
+        if (backends[i].fd != -1 && (best == NULL || (spectator ? load > best->load + best->routed
+                                                                 : load < best->load + best->routed))) {
+            best = &backends[i];
+        }
+    }
+    return best;
+}
+
+// Passes a player on to a backend. The router is done with the player either way.
+static void route_player(int fd, uint32_t player_id, bool spectator) {
+    backend_t *backend;
+    while ((backend = choose_backend(player_id, spectator)) != NULL) {
+        if (route_send(backend->fd, ROUTE_CLIENT, 0, 0, fd) == 0) {
+            if (!spectator) {
+                backend->routed++;
+            }
+            log_info("route_player: Sent [%d] to the backend at %s", fd, backend->path);
+            break;
+        }
+        disconnect_backend(backend);
+    }
+    if (backend == NULL) {
+        log_error("route_player: Every backend is down, turning away [%d]", fd);
+    }
+    close(fd);
+}
+
+// Peeks at what a player sent so far. Returns true once the player is done with, routed or turned away.
+static bool peek_hello(pending_player_t *player) {
+    unsigned char buffer[MAX_MESSAGE_SIZE];
+    ssize_t size = recv(player->fd, buffer, sizeof(buffer), MSG_PEEK | MSG_DONTWAIT);
+    if (size == 0 || (size < 0 && errno != EAGAIN && errno != EINTR)) {
+        log_info("peek_hello: [%d] went away before its hello", player->fd);
+        close(player->fd);
+        return true;
+    } else if (size < 0) {
+        return false;
+    }
+
+    unsigned char scratch[MAX_MESSAGE_SIZE];
+    arena_t arena;
+    arena_init(&arena, scratch, sizeof(scratch));
+    message_t message_type;
+    void *message_ptr;
+    ssize_t consumed = decode_message(buffer, (size_t) size, &arena, &message_type, &message_ptr);
+    if (consumed < 0) {
+        log_error("peek_hello: [%d] sent an invalid message", player->fd);
+        close(player->fd);
+        return true;
+    } else if (consumed == 0) {
+        // Peeking leaves the bytes readable, so the rest is waited for without polling.
+        player->retry_ns = metrics_now() + PARTIAL_HELLO_RETRY_MS * 1000000ull;
+        return false;
+    }
+
+    // A client that does not start with a hello is the backend's to turn away.
+    uint32_t player_id = message_type == MSG_CLIENT_HELLO ? ((msg_client_hello *) message_ptr)->player_id : 0;
+    route_player(player->fd, player_id, message_type == MSG_CLIENT_SPECTATE);
+    return true;
+}
+
+static void accept_player() {
+    int fd = accept(router_socket, NULL, NULL);
+    if (fd < 0) {
+        if (running && errno != EINTR) {
+            log_error("accept_player: accept error: %s", strerror(errno));
+        }
+        return;
+    }
+    pending_player_t *player = malloc(sizeof(pending_player_t));
+    if (player == NULL) {
+        log_error("accept_player: No memory for [%d]", fd);
+        close(fd);
+        return;
+    }
+    player->fd = fd;
+    player->accepted_ns = metrics_now();
+    player->retry_ns = 0;
+    pending = g_slist_prepend(pending, player);
+}
+
+// Handles the players that sent something, and turns away those that waited too long without a hello. The events
+// are those of the players that were polled at the given time, in the order of the pending list.
+static void handle_pending(struct pollfd *events, uint64_t polled_ns) {
+    uint64_t now = metrics_now();
+    int index = 0;
+    GSList *node = pending;
+    while (node != NULL) {
+        GSList *next = node->next;
+        pending_player_t *player = (pending_player_t *) node->data;
+
+        bool polled = player->retry_ns <= polled_ns;
+        bool ready = polled ? events[index++].revents != 0 : player->retry_ns <= now;
+        bool done = ready && peek_hello(player);
+        if (!done && now - player->accepted_ns > HELLO_TIMEOUT_MS * 1000000ull) {
+            log_info("handle_pending: [%d] sent no hello, turning it away", player->fd);
+            close(player->fd);
+            done = true;
+        }
+        if (done) {
+            pending = g_slist_delete_link(pending, node);
+            free(player);
+        }
+        node = next;
+    }
+}
+
+void run_router(char *host, unsigned short port_num) {
+    signal(SIGINT, interrupt_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    router_socket = listen_socket(host, port_num);
+    if (router_socket == -1) {
+        log_error("run_router: Could not open router socket.");
+        return;
+    }
+    log_info("run_router: Routing players over %d backends", backend_count);
+
+    struct pollfd *events = NULL;
+    int capacity = 0;
+    uint64_t next_check = 0;
+
+    while (running) {
+        uint64_t now = metrics_now();
+        if (now >= next_check) {
+            check_backends();
+            next_check = now + LOAD_INTERVAL_MS * 1000000ull;
+        }
+
+        int needed = 1 + backend_count + (int) g_slist_length(pending);
+        if (needed > capacity) {
+            capacity = needed * 2;
+            events = realloc(events, sizeof(struct pollfd) * capacity);
+        }
+
+        // The listening socket, then the backends, then the players not waiting on a retry.
+        int count = 0;
+        events[count].fd = router_socket;
+        events[count++].events = POLLIN;
+        for (int i = 0; i < backend_count; i++) {
+            events[count].fd = backends[i].fd;
+            events[count++].events = POLLIN;
+        }
+        int first_player = count;
+        // Waking up for the next load check also turns away players past their hello timeout, close enough.
+        int timeout = (int) ((next_check - now) / 1000000) + 1;
+        for (GSList *node = pending; node != NULL; node = node->next) {
+            pending_player_t *player = (pending_player_t *) node->data;
+            if (player->retry_ns > now) {
+                timeout = PARTIAL_HELLO_RETRY_MS;
+                continue;
+            }
+            events[count].fd = player->fd;
+            events[count++].events = POLLIN;
+        }
+
+        if (poll(events, (nfds_t) count, timeout) < 0) {
+            if (errno != EINTR) {
+                log_error("run_router: poll error: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        for (int i = 0; i < backend_count; i++) {
+            if (backends[i].fd != -1 && events[1 + i].revents) {
+                handle_backend(&backends[i]);
+            }
+        }
+        handle_pending(events + first_player, now);
+        if (events[0].revents) {
+            accept_player();
+        }
+    }
+
+    for (GSList *node = pending; node != NULL; node = node->next) {
+        close(((pending_player_t *) node->data)->fd);
+        free(node->data);
+    }
+    g_slist_free(pending);
+    pending = NULL;
+
+    for (int i = 0; i < backend_count; i++) {
+        if (backends[i].fd != -1) {
+            close(backends[i].fd);
+        }
+    }
+    free(events);
+    close(router_socket);
+
+    log_info("run_router: Router shutdown complete.");
+}
@@ -0,0 +1,53 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_ROUTER_H
+#define CSNAKE_ROUTER_H
+
+#include <stdint.h>
+
+//
+// Lobby router. A router accepts players on a single address and spreads them over several server processes on the
+// same host, each of them a room with a world of its own. It reads nothing from a player but a peek at the hello,
+// then passes the connection to a backend over the backend's route socket and forgets about it, so the game itself
+// never goes through the router.
+//
+// Each backend only hands out the player ids that fall to its index, so ids are unique across the rooms and a player
+// who comes back is sent to the room that has their snake. Everyone else goes to the room with the fewest players,
+// which the router asks every backend for once a second. A backend that goes down only takes its own room with it;
+// the router keeps trying to reconnect to it.
+//
+// Both ends are the same binary on the same host, so messages are sent in native byte order.
+//
+
+#define ROUTE_MAGIC 0x43535254 // "CSRT"
+
+typedef enum {
+    ROUTE_HELLO, // Router to backend, first on a connection. Gives the backend its index and the number of backends.
+    ROUTE_CLIENT, // Router to backend. A player's socket comes with it, the player's hello still unread.
+    ROUTE_LOAD_QUERY, // Router to backend, answered with ROUTE_LOAD.
+    ROUTE_LOAD // Backend to router. Gives the number of players connected to the backend.
+} route_message_type_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t backend; // The backend's index, for ROUTE_HELLO.
+    uint32_t value; // The number of backends for ROUTE_HELLO, or of players for ROUTE_LOAD.
+} route_message_t;
+
+// Sends a message, along with a client socket unless client_fd is -1. Returns 0 on success or -1 otherwise.
+int route_send(int fd, route_message_type_t type, uint32_t backend, uint32_t value, int client_fd);
+// Receives a message. client_fd is set to the socket that came with it, or -1. Returns 0 on success or -1 if the
+// connection closed or sent something that is not a route message.
+int route_recv(int fd, route_message_t *message, int *client_fd);
+
+// Adds a backend by the path of its route socket. Backends keep the order they are added in, which gives their index.
+void router_add_backend(char *path);
+// Whether any backends were added, which makes this process a router.
+int router_backend_count(void);
+
+void run_router(char *host, unsigned short port_num);
+
+#endif //CSNAKE_ROUTER_H
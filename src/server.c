@@ -7,220 +7,3097 @@
 #include <sys/types.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <glib.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/sockios.h>
 
+#include "bot.h"
+#include "checkpoint.h"
 #include "client.h"
+#include "handoff.h"
+#include "history.h"
+#include "lockstep.h"
 #include "socket.h"
 #include "common.h"
 #include "log.h"
 #include "messages.h"
+#include "metrics.h"
+#include "player_table.h"
+#include "pool.h"
+#include "queue.h"
+#include "ring.h"
+#include "router.h"
 #include "snake.h"
+#include "snapshot.h"
+#include "store.h"
+#include "timer_wheel.h"
 
-static GSList *clients = NULL;
+// Scratch space each shard decodes one message into before resetting it.
+#define CLIENT_ARENA_SIZE 1024
+#define CLIENTS_PER_SLAB 64
+
+#define CHECKPOINT_INTERVAL_MS 1000
+
+// Clients are pinged, and their update rate reconsidered, once per this many ticks.
+#define PING_INTERVAL_TICKS (1000 / TICK_MS)
+
+// Shards count time in wheel ticks this long.
+#define TIMER_TICK_MS 100
+// A connection has this long to say hello.
+#define HELLO_TIMEOUT_MS 5000
+// A joined client answers a ping every second, so hearing nothing for this long means it is gone.
+#define DEFAULT_IDLE_TIMEOUT_MS 10000
+// With reduced detail, snakes within this many cells of the client's own snake still get every snapshot.
+#define NEAR_DISTANCE 10
+
+// Disconnects are remembered this long so joining clients can catch up on those that happened after their snapshot.
+#define DEPARTURE_LOG_SIZE 1024
+
+// Each client may send this many inputs per second on average, with bursts of up to INPUT_BURST. Anything more is
+// dropped before it reaches the simulation.
+#define INPUT_RATE (2 * 1000 / TICK_MS)
+#define INPUT_BURST 10
+
+// Players on the leaderboard served with the metrics.
+#define LEADERBOARD_METRICS_SIZE 10
+
+// Input is judged against the world up to this far back, to be fair to players on slow links.
+#define DEFAULT_REWIND_LIMIT_MS 150
+
+// With no players to chase, bots gather at a random spot that moves this often.
+#define BOT_RALLY_TICKS (5000 / TICK_MS)
+
+// Lockstep clients are sent a hash of the world to check theirs against once per this many ticks.
+#define LOCKSTEP_HASH_TICKS (1000 / TICK_MS)
+
+// Ticks that can wait between two stages of the send pipeline before the stage ahead has to wait.
+#define PIPELINE_DEPTH 4
+// Tick results in circulation: enough for both stage queues to be full, with the simulation, an encoder and the sender
+// each working on one more.
+#define TICK_RESULT_COUNT (PIPELINE_DEPTH * 2 + 3)
+
+// What a shard is asked to do through its inbox.
+typedef enum {
+    SHARD_ADOPT_CLIENT, // Take over a new connection, or a client moving in from another shard.
+    SHARD_SEND_SNAPSHOT // A world copy is ready for a joining client.
+} shard_event_type_t;
+
+typedef struct {
+    queue_node_t node; // Must come first.
+    shard_event_type_t type;
+    client_t *client;
+    uint32_t player_id;
+    uint32_t slot; // The client's slot when the event was posted, for an event that may outlive the client.
+    world_copy_t *copy;
+    uint64_t copy_tick;
+} shard_event_t;
+
+// Worker thread that owns the connections of a share of the clients. Clients are partitioned by player id, so a
+// client is moved to its shard once it has joined. Other threads only talk to a shard through its inbox.
+typedef struct {
+    int index;
+    pthread_t thread;
+    int wake_fd; // Written after every push to the inbox.
+    mpsc_queue_t inbox;
+    // The rest is only touched by the shard's own thread.
+    GSList *clients;
+    socket_loop_t *loop;
+    arena_t *arena;
+    int timer_fd; // Fires when the wheel next has timers due, to turn it. Left unset while it has none.
+    uint64_t timer_tick; // Wheel tick timer_fd is set for, or UINT64_MAX if it is not set.
+    timer_wheel_t wheel; // Deadlines for the shard's clients to be heard from by.
+} shard_t;
+
+// A snake as a tick sends it.
+typedef struct {
+    snake_t snake;
+    uint64_t moved_tick;
+} sent_snake_t;
+
+// A client a tick has messages for, with what its encoder needs to know to pick the snakes to send it.
+typedef struct {
+    client_t *client;
+    int fd;
+    ring_t *ring;
+    uint32_t player_id;
+    int16_t x; // Where the client's own snake is, for telling near snakes from far ones.
+    int16_t y;
+    bool snapshot; // Whether it is sent the snakes that moved since the ticks below.
+    bool reduced;
+    bool far_due;
+    uint64_t since;
+    uint64_t far_since;
+    bool lockstep; // Whether it is sent the tick's inputs and hash.
+    // The client's messages, starting with whatever it had queued. Written by its encoder, then by the sender. The
+    // buffer stays with the slot once the sender is done with it, and goes to the next client added in its place.
+    unsigned char *buffer;
+    size_t used;
+    size_t capacity;
+} tick_recipient_t;
+
+// What the simulation hands to the send pipeline at the end of a tick. Only the recipients' buffers and the fanout
+// counts change after that, so the encoders and the sender read the rest without a lock while the next tick runs.
+// Results go round from the simulation through the pipeline and back, keeping every array and buffer they grew, so a
+// tick in steady state allocates nothing.
+typedef struct {
+    uint64_t tick;
+    sent_snake_t *snakes;
+    uint32_t snake_count;
+    uint32_t snake_capacity;
+    uint32_t *fanouts; // Recipients each snake was sent to, counted by the encoders.
+    unsigned char *inputs; // The tick's encoded lockstep inputs, if inputs_size is not 0.
+    size_t inputs_size;
+    size_t inputs_capacity;
+    bool hash_due;
+    msg_state_hash hash;
+    tick_recipient_t *recipients;
+    uint32_t recipient_count;
+    uint32_t recipient_capacity;
+} tick_result_t;
+
+// Passes tick results from one stage of the pipeline to the next. The semaphores count the results waiting and the
+// room left, so a stage sleeps until it has something to pop or room to push.
+typedef struct {
+    spsc_queue_t queue;
+    sem_t filled;
+    sem_t room;
+} stage_queue_t;
+
+static shard_t *shards = NULL;
+static int shard_count = 0;
+// Used to spread clients that have not joined yet over the shards. Guarded by clients_mutex.
+static uint32_t next_shard = 0;
+
+// The send pipeline. Each tick's result goes from the simulation to every encoder, which encodes its share of the
+// recipients' messages, and from every encoder to the sender, which writes the whole tick out. Pushed in place of a
+// result to stop the stages.
+static int encoder_count = 1;
+static stage_queue_t *encode_queues = NULL;
+static stage_queue_t *send_queues = NULL;
+static pthread_t *encoder_threads = NULL;
+static pthread_t sender_thread;
+static tick_result_t pipeline_stop;
+// Every tick result, and those the sender is done with for the simulation to fill again.
+static tick_result_t *tick_results = NULL;
+static stage_queue_t free_results;
+// Signalled each time the sender finishes a tick, for threads waiting on it to be done with a client.
+static pthread_mutex_t pipeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_sent = PTHREAD_COND_INITIALIZER;
+
+// Every connected client and bot, and the snakes of those in the world. A slot only has a player id while its client
+// has a snake. Guarded by clients_mutex.
+static player_table_t players;
+static pool_t client_pool;
+static bool use_io_uring = false;
 static pthread_mutex_t clients_mutex;
 static volatile bool running = true;
 
-static int server_socket;
+static int server_socket;
+
+// Unix listening socket for clients on the same host, or -1.
+static char *local_path = NULL;
+static int local_socket = -1;
+
+// Player ids are handed out in order and carried across hot upgrades so they stay unique for connected clients.
+// Behind a router, only every player_id_stride-th id is this server's.
+static uint32_t next_player_id = 1;
+static uint32_t player_id_stride = 1;
+
+// Unix socket a lobby router passes players in through, and the router's connection to it, or -1.
+static char *route_path = NULL;
+static int route_socket = -1;
+static int router_fd = -1;
+static int router_watch_id = -1;
+// Loop the main thread accepts connections and router messages on.
+static socket_loop_t *server_loop = NULL;
+
+static char *upgrade_path = NULL;
+static int upgrade_socket = -1;
+static volatile bool upgrading = false;
+
+static char *metrics_path = NULL;
+
+// Finished sessions are recorded here, if a store was given.
+static char *store_path = NULL;
+static store_t *session_store = NULL;
+static char *checkpoint_path = NULL;
+static bool recover_checkpoint = false;
+static pthread_t checkpoint_thread;
+static pthread_cond_t checkpoint_wake; // Signalled under clients_mutex to stop the checkpoint thread early.
+static pthread_t simulation_thread;
+// Number of the last tick that was run. Guarded by clients_mutex.
+static uint64_t tick = 0;
+
+// World copy for join snapshots, refreshed at the end of a tick when clients are waiting to join. Everything here is
+// guarded by clients_mutex.
+static world_copy_t *latest_copy = NULL;
+static GSList *joining = NULL;
+// Last tick on which a snake moved, joined or left, so an unchanged world reuses the latest copy.
+static uint64_t world_changed_tick = 0;
+
+// Bots live in the player table like players, but have no socket and are steered by the simulation thread. The field
+// and the buffers used to build it are only touched by the simulation thread.
+static uint32_t bot_count = 0;
+static flow_field_t bot_field;
+static snake_t *bot_targets = NULL;
+static snake_t *bot_obstacles = NULL;
+static guint bot_buffer_capacity = 0;
+static snake_t bot_rally;
+
+static struct {
+    uint64_t tick;
+    uint32_t player_id;
+} departures[DEPARTURE_LOG_SIZE];
+static uint64_t departure_count = 0;
+
+// Where the snakes were on recent ticks, and how far back input may be judged. Guarded by clients_mutex.
+static world_history_t world_history;
+static uint32_t rewind_limit_ms = DEFAULT_REWIND_LIMIT_MS;
+
+// Clients that send nothing for this long are disconnected, or never if 0.
+static uint32_t idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+
+// In lockstep mode players are sent each tick's inputs and move the snakes themselves. Where the snakes are, for
+// judging moves the way the clients do, and the buffer the inputs of a tick are gathered in are guarded by
+// clients_mutex.
+static bool lockstep = false;
+static lockstep_grid_t lockstep_grid;
+static tick_input_t *tick_inputs = NULL;
+static bool *tick_moved = NULL;
+static uint32_t tick_inputs_capacity = 0;
+
+// With idle sleep on, the simulation sleeps through ticks that would change nothing instead of running them, until
+// something wakes it or a client is due a ping. Whatever gives an idle simulation work signals simulation_wake under
+// clients_mutex.
+static bool idle_sleep = false;
+static bool simulation_idle = false; // Set while the simulation sleeps. Read without the lock by queue_input.
+static pthread_cond_t simulation_wake;
+
+// Players recovered from a checkpoint that have not reconnected yet, keyed by player id.
+static GHashTable *orphaned_snakes = NULL;
+static checkpoint_player_t *recovered_snakes = NULL;
+
+void server_set_upgrade_path(char *path) {
+    upgrade_path = path;
+}
+
+void server_set_metrics_path(char *path) {
+    metrics_path = path;
+}
+
+void server_set_store_path(char *path) {
+    store_path = path;
+}
+
+void server_set_checkpoint_path(char *path) {
+    checkpoint_path = path;
+}
+
+void server_set_recover(bool recover) {
+    recover_checkpoint = recover;
+}
+
+void server_set_worker_count(int count) {
+    shard_count = count;
+}
+
+void server_set_encoder_count(int count) {
+    encoder_count = count < 1 ? 1 : count;
+}
+
+void server_set_io_uring(bool enabled) {
+    use_io_uring = enabled;
+}
+
+void server_set_bot_count(uint32_t count) {
+    bot_count = count;
+}
+
+void server_set_local_path(char *path) {
+    local_path = path;
+}
+
+void server_set_route_path(char *path) {
+    route_path = path;
+}
+
+void server_set_rewind_limit(uint32_t limit_ms) {
+    // The tick the player saw must still be in the history, next to the one being recorded.
+    uint32_t max_ms = (HISTORY_TICKS - 2) * TICK_MS;
+    if (limit_ms > max_ms) {
+        log_warn("server_set_rewind_limit: Limiting the rewind to %d ms", max_ms);
+        limit_ms = max_ms;
+    }
+    rewind_limit_ms = limit_ms;
+}
+
+void server_set_lockstep(bool enabled) {
+    lockstep = enabled;
+}
+
+void server_set_idle_timeout(uint32_t timeout_ms) {
+    // Anything shorter would disconnect players whose pong is merely a little late.
+    uint32_t min_ms = 2 * PING_INTERVAL_TICKS * TICK_MS;
+    if (timeout_ms != 0 && timeout_ms < min_ms) {
+        log_warn("server_set_idle_timeout: Raising the idle timeout to %d ms", min_ms);
+        timeout_ms = min_ms;
+    }
+    idle_timeout_ms = timeout_ms;
+}
+
+void server_set_idle_sleep(bool enabled) {
+    idle_sleep = enabled;
+}
+
+// Locks the player table, recording how long the lock took to get.
+static void lock_clients() {
+    uint64_t start = metrics_now();
+    pthread_mutex_lock(&clients_mutex);
+    metrics_observe(HISTOGRAM_LOCK_WAIT, metrics_now() - start);
+}
+
+// Wakes the simulation if it is sleeping through idle ticks. Must be called with the lock held.
+static void wake_simulation() {
+    if (__atomic_load_n(&simulation_idle, __ATOMIC_SEQ_CST)) {
+        pthread_cond_signal(&simulation_wake);
+    }
+}
+
+// Whether the client has a snake in the world, as opposed to not having joined yet or only watching.
+static bool has_snake(client_t *client) {
+    return client->joined && client->role == ROLE_PLAYER;
+}
+
+// Whether the client is sent tick inputs rather than positions. Spectators have no inputs to send, and relays pass on
+// what they are sent to clients that may not simulate, so both are sent positions either way.
+static bool is_lockstep_client(client_t *client) {
+    return lockstep && client->role == ROLE_PLAYER && !client->bot;
+}
+
+// The snake in the given slot of the player table. Must be called with the lock held.
+static snake_t snake_at(uint32_t slot) {
+    snake_t snake;
+    snake.player_id = players.player_ids[slot];
+    snake.x = players.xs[slot];
+    snake.y = players.ys[slot];
+    return snake;
+}
+
+// Puts a client's snake into the world. Must be called with the lock held.
+static void place_snake(client_t *client, const snake_t *snake) {
+    client->player_id = snake->player_id;
+    player_table_set_id(&players, client->slot, snake->player_id);
+    players.xs[client->slot] = snake->x;
+    players.ys[client->slot] = snake->y;
+    if (lockstep) {
+        lockstep_grid_add(&lockstep_grid, snake->x, snake->y);
+    }
+}
+
+// Takes a client and its snake, if it has one, out of the player table. Must be called with the lock held.
+static void remove_player(client_t *client) {
+    if (lockstep && has_snake(client)) {
+        lockstep_grid_remove(&lockstep_grid, players.xs[client->slot], players.ys[client->slot]);
+    }
+    player_table_remove(&players, client->slot);
+}
+
+// Hands out the next player id. Must be called with the lock held.
+static uint32_t take_player_id() {
+    uint32_t player_id = next_player_id;
+    next_player_id += player_id_stride;
+    return player_id;
+}
+
+// Picks the token a new player's client has to present to resume its snake, so a player id alone is not enough to
+// take over somebody else's snake. Never 0, which is what a client without a token sends.
+static uint32_t new_resume_token() {
+    uint32_t token = 0;
+    while (token == 0) {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            log_error("new_resume_token: getrandom error: %s", strerror(errno));
+            token = (uint32_t) rand() ^ (uint32_t) metrics_now();
+        }
+    }
+    return token;
+}
+
+// Makes room for the given number of bytes after the used part of a buffer of messages. Returns false if there is no
+// memory for them.
+static bool reserve_buffer(unsigned char **buffer, size_t used, size_t *capacity, size_t size) {
+    if (*capacity - used < size) {
+        size_t grown = *capacity ? *capacity * 2 : 1024;
+        while (grown - used < size) {
+            grown *= 2;
+        }
+        unsigned char *bigger = realloc(*buffer, grown);
+        if (bigger == NULL) {
+            log_error("reserve_buffer: No memory for %d more bytes", size);
+            return false;
+        }
+        *buffer = bigger;
+        *capacity = grown;
+    }
+    return true;
+}
+
+static bool reserve_tx(client_t *client, size_t size) {
+    return reserve_buffer(&client->tx_buffer, client->tx_used, &client->tx_capacity, size);
+}
+
+// Queues a message for a client. It goes out with the next tick once flush_clients is called, which whoever holds the
+// lock must do before letting go of it. Must be called with the lock held.
+static void send_to_client(client_t *client, message_t message_type, void *message_ptr) {
+    if (client->bot || !reserve_tx(client, MAX_MESSAGE_SIZE)) {
+        return;
+    }
+    client->tx_used += encode_message(client->tx_buffer + client->tx_used, message_type, message_ptr);
+}
+
+// Copies bytes into a client's ring. A client too far behind to make room is disconnected, which its shard notices as
+// the socket closing. Returns the bytes written or -1.
+static ssize_t write_to_ring(client_t *client, const unsigned char *bytes, size_t size) {
+    if (!ring_write(client->ring, bytes, size)) {
+        log_error("write_to_ring: No room for %d bytes in the ring of [%d], disconnecting it", size,
+                  client->client_socket);
+        client->end_reason = SESSION_ERROR;
+        shutdown(client->client_socket, SHUT_RDWR);
+        return -1;
+    }
+    return (ssize_t) size;
+}
+
+// Whether the send pipeline still has bytes to write to the client. Whatever is queued for it now has to go out after
+// them, with the next tick it gets handed to the pipeline on.
+static bool in_pipeline(client_t *client) {
+    return __atomic_load_n(&client->inflight, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Waits for the sender to write everything the pipeline has for a client. The simulation must not be able to hand the
+// client to the pipeline again, because it is out of the player table, waiting on a snapshot or held.
+static void wait_for_pipeline(client_t *client) {
+    pthread_mutex_lock(&pipeline_mutex);
+    while (in_pipeline(client)) {
+        pthread_cond_wait(&pipeline_sent, &pipeline_mutex);
+    }
+    pthread_mutex_unlock(&pipeline_mutex);
+}
+
+// Makes sure what was queued for clients goes out. The sender is the only thread that writes to client sockets, and
+// it writes whatever is queued for a client with the next tick the client is handed to the pipeline on, so nothing is
+// written while the lock is held. All that is left to do here is wake a simulation sleeping through idle ticks to run
+// that tick. Must be called with the lock held.
+static void flush_clients() {
+    wake_simulation();
+}
+
+// Puts bytes behind whatever the client's socket had no room for. A client that falls too far behind is disconnected,
+// which its shard notices as the socket closing. Only for whoever writes the client's socket, which is the sender or
+// the thread holding the client. Returns false if the client was disconnected.
+static bool queue_unsent(client_t *client, const unsigned char *bytes, size_t size) {
+    if (size == 0) {
+        return true;
+    }
+    if (client->unsent_used + size > CLIENT_MAX_UNSENT ||
+        !reserve_buffer(&client->unsent, client->unsent_used, &client->unsent_capacity, size)) {
+        log_error("queue_unsent: Client [%d] is %d bytes behind, disconnecting it", client->client_socket,
+                  client->unsent_used + size);
+        client->end_reason = SESSION_ERROR;
+        shutdown(client->client_socket, SHUT_RDWR);
+        __atomic_store_n(&client->unsent_used, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    memcpy(client->unsent + client->unsent_used, bytes, size);
+    __atomic_store_n(&client->unsent_used, client->unsent_used + size, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Takes bytes the socket accepted off the front of the client's unsent bytes.
+static void consume_unsent(client_t *client, size_t size) {
+    size_t left = client->unsent_used - size;
+    memmove(client->unsent, client->unsent + size, left);
+    __atomic_store_n(&client->unsent_used, left, __ATOMIC_RELAXED);
+}
+
+// Writes as much of the client's unsent bytes as its socket has room for, for a client the pipeline is done with and
+// that is held out of it. Returns false if the socket failed.
+static bool write_unsent(client_t *client) {
+    if (client->unsent_used == 0) {
+        return true;
+    }
+    ssize_t written_amount;
+    do {
+        written_amount = send(client->client_socket, client->unsent, client->unsent_used, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (written_amount < 0 && errno == EINTR);
+    if (written_amount < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    client->link.bytes_sent += written_amount;
+    consume_unsent(client, (size_t) written_amount);
+    return true;
+}
+
+// Sends a connected client the position of the snake in the given slot.
+static void update_snake(client_t *connected_client, uint32_t slot) {
+    if (!connected_client->joined) {
+        return;
+    }
+    msg_snake_update message;
+    message.snake = snake_at(slot);
+    send_to_client(connected_client, MSG_SNAKE_UPDATE, &message);
+}
+
+static void send_ping(client_t *client) {
+    msg_ping ping;
+    ping.timestamp_us = (uint32_t) (metrics_now() / 1000);
+    send_to_client(client, MSG_PING, &ping);
+}
+
+// Lets a connected client know that a player disconnected.
+static void send_client_disconnect(client_t *connected_client, uint32_t player_id) {
+    // A client still waiting on its join snapshot catches up from the departure log instead.
+    if (!connected_client->joined || connected_client->awaiting_snapshot) {
+        return;
+    }
+    msg_client_disconnect message;
+    message.player_id = player_id;
+    send_to_client(connected_client, MSG_CLIENT_DISCONNECT, &message);
+}
+
+// Lets every connected client know that a player disconnected. Must be called with the lock held.
+static void broadcast_disconnect(uint32_t player_id) {
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client) {
+            send_client_disconnect(client, player_id);
+        }
+    }
+}
+
+// Introduces the snake in the given slot to the lockstep clients, which only learn of moves through inputs. Everyone
+// else picks it up with their next snapshot. Must be called with the lock held.
+static void broadcast_new_snake(uint32_t slot) {
+    for (uint32_t other = 0; other < players.end; other++) {
+        client_t *client = (client_t *) players.owners[other];
+        if (client && is_lockstep_client(client) && !client->awaiting_snapshot) {
+            update_snake(client, slot);
+        }
+    }
+}
+
+// Sends a client every snake that moved or joined since the given tick. Must be called with the lock held.
+static void send_moves_since(client_t *client, uint64_t since_tick) {
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        if (players.player_ids[slot] != 0 && players.moved_ticks[slot] > since_tick) {
+            update_snake(client, slot);
+        }
+    }
+}
+
+// Records a disconnect for clients whose join snapshot was taken before it. Must be called with the lock held.
+static void log_departure(uint32_t player_id) {
+    // The disconnect happens between ticks, so only copies from the next tick on leave the player out.
+    departures[departure_count % DEPARTURE_LOG_SIZE].tick = tick + 1;
+    departures[departure_count % DEPARTURE_LOG_SIZE].player_id = player_id;
+    departure_count++;
+    world_changed_tick = tick + 1;
+}
+
+// Sends the disconnects that happened after a join snapshot was taken. Must be called with the lock held.
+static void send_departures_since(client_t *client, uint64_t since_tick) {
+    uint64_t first = departure_count > DEPARTURE_LOG_SIZE ? departure_count - DEPARTURE_LOG_SIZE : 0;
+    if (first > 0 && departures[first % DEPARTURE_LOG_SIZE].tick > since_tick) {
+        log_warn("send_departures_since: Player %d may have missed disconnects while joining", client->player_id);
+    }
+
+    for (uint64_t i = first; i < departure_count; i++) {
+        if (departures[i % DEPARTURE_LOG_SIZE].tick > since_tick) {
+            msg_client_disconnect message;
+            message.player_id = departures[i % DEPARTURE_LOG_SIZE].player_id;
+            send_to_client(client, MSG_CLIENT_DISCONNECT, &message);
+        }
+    }
+}
+
+static void wake_shard(shard_t *shard) {
+    uint64_t one = 1;
+    if (write(shard->wake_fd, &one, sizeof(one)) < 0) {
+        log_error("wake_shard: Could not wake shard %d: %s", shard->index, strerror(errno));
+    }
+}
+
+static void post_to_shard(int index, shard_event_type_t type, client_t *client, world_copy_t *copy,
+                          uint64_t copy_tick) {
+    shard_event_t *event = malloc(sizeof(shard_event_t));
+    if (event == NULL) {
+        log_error("post_to_shard: No memory for an event for shard %d", index);
+        return;
+    }
+    event->type = type;
+    event->client = client;
+    event->player_id = client->player_id;
+    event->slot = client->slot;
+    event->copy = copy;
+    event->copy_tick = copy_tick;
+    mpsc_queue_push(&shards[index].inbox, &event->node);
+    wake_shard(&shards[index]);
+}
+
+// Makes a copy of the world and hands it to the shards of the clients waiting on a join snapshot. Must be called with
+// the lock held, at the end of a tick.
+static void publish_world_copy() {
+    if (latest_copy && latest_copy->tick >= world_changed_tick) {
+        // Nothing changed since the last copy, so it is still the current world.
+        latest_copy->tick = tick;
+    } else {
+        world_copy_t *copy = world_copy_new(tick, players.count);
+        for (uint32_t slot = 0; slot < players.end; slot++) {
+            if (players.player_ids[slot] != 0) {
+                copy->snakes[copy->snake_count++] = snake_at(slot);
+            }
+        }
+        if (latest_copy) {
+            world_copy_unref(latest_copy);
+        }
+        latest_copy = copy;
+    }
+
+    for (GSList *node = joining; node != NULL; node = node->next) {
+        client_t *client = (client_t *) node->data;
+        post_to_shard(client->shard, SHARD_SEND_SNAPSHOT, client, world_copy_ref(latest_copy), latest_copy->tick);
+    }
+    g_slist_free(joining);
+    joining = NULL;
+}
+
+// Queues a client for a join snapshot at the end of the next tick. Must be called with the lock held.
+static void queue_join_snapshot(client_t *client) {
+    joining = g_slist_append(joining, client);
+    wake_simulation();
+}
+
+// Gives a client its snake in response to its hello, either a recovered one or a new one. Its join snapshot follows
+// at the end of the next tick, which also introduces it to everyone else. Returns true if the client belongs to
+// another shard now, in which case the calling shard must pass it on.
+static bool join_client(shard_t *shard, client_t *client, msg_client_hello *hello) {
+    lock_clients();
+
+    checkpoint_player_t *orphan = NULL;
+    if (hello->player_id != 0 && orphaned_snakes != NULL) {
+        orphan = g_hash_table_lookup(orphaned_snakes, GUINT_TO_POINTER(hello->player_id));
+    }
+    if (orphan && orphan->resume_token != hello->resume_token) {
+        // The snake stays put for its own player to come back to.
+        log_warn("join_client: Client [%d] asked for player %d without its resume token", client->client_socket,
+                 hello->player_id);
+        orphan = NULL;
+    }
+
+    if (orphan) {
+        place_snake(client, &orphan->snake);
+        client->resume_token = orphan->resume_token;
+        g_hash_table_remove(orphaned_snakes, GUINT_TO_POINTER(hello->player_id));
+        log_info("join_client: Client [%d] resumed player %d", client->client_socket, client->player_id);
+    } else {
+        snake_t snake;
+        snake.player_id = take_player_id();
+        snake.x = WIDTH / 2;
+        snake.y = HEIGHT / 2;
+        place_snake(client, &snake);
+        client->resume_token = new_resume_token();
+        log_info("join_client: Client [%d] joined as player %d", client->client_socket, client->player_id);
+    }
+
+    msg_server_welcome welcome;
+    welcome.player_id = client->player_id;
+    welcome.resume_token = client->resume_token;
+    send_to_client(client, MSG_SERVER_WELCOME, &welcome);
+
+    // Until its snapshot is queued, nothing else is sent to the client so the snapshot always comes first.
+    client->joined = true;
+    client->role = ROLE_PLAYER;
+    client->joined_ns = metrics_now();
+    client->score = 0;
+    client->awaiting_snapshot = true;
+    // Existing players pick up the new snake with their next snapshot.
+    players.moved_ticks[client->slot] = tick + 1;
+    world_changed_tick = tick + 1;
+    if (lockstep) {
+        broadcast_new_snake(client->slot);
+    }
+
+    // A client moving to another shard waits for its snapshot once it gets there, so the snapshot cannot overtake it.
+    bool moved = false;
+    int owner = (int) (client->player_id % shard_count);
+    if (owner != shard->index) {
+        client->shard = owner;
+        moved = true;
+    } else {
+        queue_join_snapshot(client);
+    }
+
+    flush_clients();
+    pthread_mutex_unlock(&clients_mutex);
+    return moved;
+}
+
+// Lets a client watch the game without a snake. It is sent what a player is, starting with a join snapshot at the end
+// of the next tick. Having no player id to be partitioned by, it stays on the shard it is on.
+static void spectate_client(client_t *client, msg_client_spectate *spectate) {
+    lock_clients();
+
+    client->role = spectate->relay ? ROLE_RELAY : ROLE_SPECTATOR;
+    client->player_id = 0;
+    msg_server_welcome welcome;
+    welcome.player_id = 0;
+    welcome.resume_token = 0;
+    send_to_client(client, MSG_SERVER_WELCOME, &welcome);
+
+    client->joined = true;
+    client->joined_ns = metrics_now();
+    client->awaiting_snapshot = true;
+    queue_join_snapshot(client);
+
+    flush_clients();
+    pthread_mutex_unlock(&clients_mutex);
+
+    log_info("spectate_client: Client [%d] is watching%s", client->client_socket,
+             client->role == ROLE_RELAY ? " as a relay" : "");
+}
+
+// Queues a joining client's snapshot, then catches it up on what happened since the copy was made.
+static void send_join_snapshot(client_t *client, world_copy_t *copy, uint64_t copy_tick) {
+    // Encoding the world happens outside the lock, so joining never holds up the game. The snapshot is then queued
+    // like any other message, so it goes out in order with whatever the client was sent before and after it.
+    size_t size;
+    const unsigned char *encoded = world_copy_encode(copy, &size);
+
+    lock_clients();
+    if (encoded == NULL || !reserve_tx(client, size)) {
+        // The client cannot be sent anything else without its snapshot, so it is disconnected, which its shard
+        // notices as the socket closing.
+        log_error("send_join_snapshot: Could not queue a snapshot for player %d, disconnecting it", client->player_id);
+        client->end_reason = SESSION_ERROR;
+        shutdown(client->client_socket, SHUT_RDWR);
+        pthread_mutex_unlock(&clients_mutex);
+        return;
+    }
+    memcpy(client->tx_buffer + client->tx_used, encoded, size);
+    client->tx_used += size;
+    metrics_message_out(MSG_WORLD_SNAPSHOT, size);
+    log_debug("send_join_snapshot: Queued player %d a %d byte snapshot of %d snakes", client->player_id, size,
+              copy->snake_count);
+
+    send_departures_since(client, copy_tick);
+    if (is_lockstep_client(client)) {
+        // A lockstep client was sent no inputs while it waited, so it is caught up on where the snakes are now instead.
+        send_moves_since(client, copy_tick);
+    }
+    client->last_snapshot_tick = copy_tick;
+    client->last_far_snapshot_tick = copy_tick;
+    client->awaiting_snapshot = false;
+    // The first ping completes the handshake, giving the server a round trip estimate right away.
+    send_ping(client);
+    flush_clients();
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Sends a lockstep client whose world went astray a new join snapshot, which it gets the same way as its first one.
+static void resync_client(client_t *client, msg_resync_request *request) {
+    lock_clients();
+    if (is_lockstep_client(client) && !client->awaiting_snapshot) {
+        log_warn("resync_client: Player %d lost track of the world by tick %d, sending a new snapshot",
+                 client->player_id, request->tick);
+        metrics_count(COUNTER_LOCKSTEP_RESYNCS, 1);
+        client->awaiting_snapshot = true;
+        queue_join_snapshot(client);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Takes a token from the client's bucket, refilling it for the time since the last input. Returns false if the
+// client is over its input rate.
+static bool take_input_token(client_t *client) {
+    uint64_t now = metrics_now();
+    client->input_tokens += (double) (now - client->input_refill_ns) * INPUT_RATE / 1e9;
+    if (client->input_tokens > INPUT_BURST) {
+        client->input_tokens = INPUT_BURST;
+    }
+    client->input_refill_ns = now;
+
+    if (client->input_tokens < 1) {
+        return false;
+    }
+    client->input_tokens -= 1;
+    return true;
+}
+
+// Hands an arrow key to the next tick. Keys that arrive before the tick picks them up replace each other, so only
+// the latest one moves the snake.
+static void queue_input(client_t *client, uint32_t key_code) {
+    if (!take_input_token(client)) {
+        log_debug("queue_input: [%d] is over its input rate, dropping key %d", client->client_socket, key_code);
+        metrics_count(COUNTER_INPUTS_DROPPED, 1);
+        return;
+    }
+
+    // Sequentially consistent along with simulation_idle, so either the simulation sees the key before it sleeps or
+    // this sees it asleep.
+    if (__atomic_exchange_n(&client->pending_key, key_code, __ATOMIC_SEQ_CST) != 0) {
+        metrics_count(COUNTER_INPUTS_COALESCED, 1);
+    }
+    if (__atomic_load_n(&simulation_idle, __ATOMIC_SEQ_CST)) {
+        lock_clients();
+        wake_simulation();
+        pthread_mutex_unlock(&clients_mutex);
+    }
+}
+
+// Whether the client connected through the unix listening socket, and so is on the same host.
+static bool is_local_client(client_t *client) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    return getsockname(client->client_socket, (struct sockaddr *) &address, &length) == 0 &&
+           address.ss_family == AF_UNIX;
+}
+
+// Moves a local client over to a shared memory ring. The ring is announced as the last message on the socket, so the
+// client reads everything before it from the socket and everything after it from the ring.
+static void attach_ring(client_t *client, msg_ring_request *request) {
+    if (client->ring) {
+        log_error("attach_ring: Client [%d] already has a ring", client->client_socket);
+        return;
+    }
+    if (!is_local_client(client)) {
+        log_error("attach_ring: Client [%d] asked for a ring but is not on a unix socket", client->client_socket);
+        return;
+    }
+
+    ring_t *ring = malloc(sizeof(ring_t));
+    if (ring == NULL || ring_create(ring, request->capacity ? request->capacity : RING_DEFAULT_CAPACITY)) {
+        log_error("attach_ring: Could not create a ring for [%d]", client->client_socket);
+        free(ring);
+        return;
+    }
+
+    msg_ring_ready ready;
+    ready.capacity = (uint32_t) ring->capacity;
+    unsigned char message[MAX_MESSAGE_SIZE];
+    size_t size = encode_message(message, MSG_RING_READY, &ready);
+    int fds[2] = {ring->memory_fd, ring->event_fd};
+
+    // The client is held out of the pipeline until the pipeline is done with it, leaving its socket to this thread.
+    // Everything queued for the client until then has to reach the socket ahead of the ring's announcement, so the
+    // ring is only announced once the socket took all of it. Whatever is queued after that goes through the ring.
+    lock_clients();
+    client->held = true;
+    pthread_mutex_unlock(&clients_mutex);
+    wait_for_pipeline(client);
+    lock_clients();
+    bool queued = queue_unsent(client, client->tx_buffer, client->tx_used);
+    client->tx_used = 0;
+    pthread_mutex_unlock(&clients_mutex);
+
+    bool announced = queued && write_unsent(client) && client->unsent_used == 0 &&
+                     send_fds(client->client_socket, message, size, fds, 2) > 0;
+    lock_clients();
+    if (announced) {
+        client->ring = ring;
+        client->link.bytes_sent += size;
+        ring = NULL;
+    }
+    client->held = false;
+    // Anything the socket had no room for goes out with the next tick instead.
+    flush_clients();
+    pthread_mutex_unlock(&clients_mutex);
+
+    if (ring) {
+        log_error("attach_ring: Could not send the ring to [%d]", client->client_socket);
+        ring_destroy(ring);
+        free(ring);
+        return;
+    }
+    log_info("attach_ring: Client [%d] reads through a %d byte ring now", client->client_socket,
+             client->ring->capacity);
+}
+
+// Frees what a client holds once it is off every list.
+static void free_client(client_t *client) {
+    if (client->ring) {
+        ring_destroy(client->ring);
+        free(client->ring);
+    }
+    free(client->tx_buffer);
+    free(client->unsent);
+    pool_free(&client_pool, client);
+}
+
+// Queues a record of a player's finished session for the store.
+static void store_session(client_t *client) {
+    session_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.player_id = client->player_id;
+    record.score = client->score;
+    record.play_time_ms = (uint32_t) ((metrics_now() - client->joined_ns) / 1000000);
+    record.end_reason = client->end_reason;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.ended_at_ms = (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+
+    store_append(session_store, &record);
+}
+
+// Removes a client that disconnected and tells everyone else it is gone.
+static void drop_client(shard_t *shard, client_t *client) {
+    log_info("drop_client: Shutting down client [%d]", client->client_socket);
+
+    shard->clients = g_slist_remove(shard->clients, client);
+    socket_loop_remove(shard->loop, client->watch_id);
+    timer_wheel_cancel(&shard->wheel, &client->idle_timer);
+
+    lock_clients();
+    // Remove the finished client from the player table.
+    remove_player(client);
+    joining = g_slist_remove(joining, client);
+    // Inform remaining clients of this disconnect.
+    if (has_snake(client)) {
+        broadcast_disconnect(client->player_id);
+        metrics_observe(HISTOGRAM_FANOUT, players.count);
+        log_departure(client->player_id);
+        flush_clients();
+        if (session_store) {
+            store_session(client);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    metrics_count(COUNTER_CONNECTIONS_CLOSED, 1);
+
+    // The socket cannot be closed, and its number reused, while the pipeline may still write to it. Shutting it down
+    // first makes any write the sender still has for it fail right away.
+    shutdown(client->client_socket, SHUT_RDWR);
+    wait_for_pipeline(client);
+    close(client->client_socket);
+    free_client(client);
+}
+
+// The current tick of the shards' timer wheels. Every shard counts from the same clock, so a client's heard_tick
+// still means the same after it moves to another shard. A shard only turns its wheel when a timer is due, so this is
+// read from the clock rather than from the wheel.
+static uint64_t wheel_now() {
+    return metrics_now() / (TIMER_TICK_MS * 1000000ull);
+}
+
+// Sets the shard's timer fd to fire on the given wheel tick, or unsets it for UINT64_MAX.
+static void set_shard_timer(shard_t *shard, uint64_t wheel_tick) {
+    if (wheel_tick == shard->timer_tick) {
+        return;
+    }
+    struct itimerspec deadline;
+    memset(&deadline, 0, sizeof(deadline));
+    if (wheel_tick != UINT64_MAX) {
+        uint64_t ms = wheel_tick * TIMER_TICK_MS;
+        deadline.it_value.tv_sec = (time_t) (ms / 1000);
+        deadline.it_value.tv_nsec = (long) (ms % 1000) * 1000000;
+    }
+    if (timerfd_settime(shard->timer_fd, TFD_TIMER_ABSTIME, &deadline, NULL)) {
+        log_error("set_shard_timer: Could not set the timer of shard %d: %s", shard->index, strerror(errno));
+        return;
+    }
+    shard->timer_tick = wheel_tick;
+}
+
+// Wheel ticks a client may go without sending anything, which is longer once it has joined and answers pings.
+static uint64_t idle_ticks(client_t *client) {
+    return (client->joined ? idle_timeout_ms : HELLO_TIMEOUT_MS) / TIMER_TICK_MS;
+}
+
+static void handle_idle_timer(wheel_timer_t *timer, void *shard_ptr);
+
+// Sets the client's deadline to be heard from by. Receiving does not move the deadline; instead, a timer that fires
+// for a client heard from since is simply set again, so a busy client costs the wheel nothing.
+static void arm_idle_timer(shard_t *shard, client_t *client) {
+    if (idle_timeout_ms == 0) {
+        return;
+    }
+    if (shard->wheel.count == 0) {
+        // A wheel with nothing on it is not turned, so it is brought up to date first. Nothing can fire.
+        timer_wheel_advance(&shard->wheel, wheel_now(), handle_idle_timer, shard);
+    }
+    timer_wheel_add(&shard->wheel, &client->idle_timer, client->heard_tick + idle_ticks(client), client);
+    if (client->idle_timer.expires < shard->timer_tick) {
+        set_shard_timer(shard, client->idle_timer.expires);
+    }
+}
+
+// Disconnects a client that went quiet, such as one whose network went down without closing the connection.
+static void handle_idle_timer(wheel_timer_t *timer, void *shard_ptr) {
+    shard_t *shard = (shard_t *) shard_ptr;
+    client_t *client = (client_t *) timer->data;
+
+    // A wheel catching up on ticks it slept through can be behind when the client was heard from.
+    if (client->heard_tick + idle_ticks(client) > shard->wheel.now) {
+        arm_idle_timer(shard, client);
+        return;
+    }
+
+    log_info("handle_idle_timer: Heard nothing from client [%d] for %d ms, disconnecting it", client->client_socket,
+             (int) ((shard->wheel.now - client->heard_tick) * TIMER_TICK_MS));
+    metrics_count(COUNTER_CLIENTS_TIMED_OUT, 1);
+    client->end_reason = SESSION_TIMEOUT;
+    drop_client(shard, client);
+}
+
+// What became of a client after its messages were handled.
+typedef enum {
+    CLIENT_KEEP,
+    CLIENT_CLOSED, // The client disconnected or broke the protocol and must be dropped.
+    CLIENT_MOVED // The client now belongs to another shard.
+} client_state_t;
+
+static client_state_t handle_message(shard_t *shard, client_t *client, message_t message_type, void *message_ptr) {
+    if (message_type == MSG_CLIENT_HELLO || message_type == MSG_CLIENT_SPECTATE) {
+        if (client->joined) {
+            log_error("handle_message: Client [%d] sent a second hello", client->client_socket);
+            return CLIENT_KEEP;
+        } else if (message_type == MSG_CLIENT_SPECTATE) {
+            spectate_client(client, (msg_client_spectate *) message_ptr);
+        } else if (join_client(shard, client, (msg_client_hello *) message_ptr)) {
+            return CLIENT_MOVED;
+        }
+        // The hello timeout gives way to the idle timeout.
+        arm_idle_timer(shard, client);
+    } else if (!client->joined) {
+        log_error("handle_message: Client [%d] sent message type %d before hello", client->client_socket,
+                  message_type);
+    } else if (message_type == MSG_PONG) {
+        uint32_t sent_us = ((msg_pong *) message_ptr)->timestamp_us;
+        uint32_t rtt_us = (uint32_t) (metrics_now() / 1000) - sent_us;
+        lock_clients();
+        link_rtt_sample(&client->link, rtt_us);
+        pthread_mutex_unlock(&clients_mutex);
+        log_debug("handle_message: [%d] round trip %d us", client->client_socket, rtt_us);
+    } else if (message_type == MSG_RING_REQUEST) {
+        attach_ring(client, (msg_ring_request *) message_ptr);
+    } else if (message_type == MSG_RESYNC_REQUEST) {
+        resync_client(client, (msg_resync_request *) message_ptr);
+    } else if (message_type == MSG_CLIENT_KEYPRESS) {
+        msg_client_keypress *keypress_message = (msg_client_keypress *) message_ptr;
+
+        log_info("handle_message: Received keypress from [%d]: %d", client->client_socket,
+                 keypress_message->key_code);
+
+        if (keypress_message->key_code == 27) {
+            log_info("handle_message: Client [%d] disconnected", client->client_socket);
+            client->end_reason = SESSION_QUIT;
+            return CLIENT_CLOSED;
+        }
+        if (client->role != ROLE_PLAYER) {
+            return CLIENT_KEEP;
+        }
+        switch (keypress_message->key_code) {
+            case KEY_UP:
+            case KEY_DOWN:
+            case KEY_LEFT:
+            case KEY_RIGHT:
+                queue_input(client, keypress_message->key_code);
+                break;
+            default:
+                break;
+        }
+    } else {
+        log_error("handle_message: Received unknown message type %d", message_type);
+    }
+    return CLIENT_KEEP;
+}
+
+// Handles every whole message in the client's receive buffer, leaving a partial one for when the rest arrives.
+static client_state_t handle_buffered_messages(shard_t *shard, client_t *client) {
+    while (client->rx_used > 0) {
+        // Everything decoded for the previous message is released at once.
+        arena_reset(shard->arena);
+
+        message_t message_type;
+        void *message_ptr;
+        ssize_t consumed = decode_message(client->rx_buffer, client->rx_used, shard->arena, &message_type,
+                                          &message_ptr);
+        if (consumed < 0) {
+            log_error("handle_buffered_messages: Client [%d] sent an invalid message", client->client_socket);
+            client->end_reason = SESSION_ERROR;
+            return CLIENT_CLOSED;
+        } else if (consumed == 0) {
+            if (client->rx_used == sizeof(client->rx_buffer)) {
+                log_error("handle_buffered_messages: Client [%d] sent an oversized message", client->client_socket);
+                client->end_reason = SESSION_ERROR;
+                return CLIENT_CLOSED;
+            }
+            break;
+        }
+
+        // The message is decoded into the arena, so its bytes can go before it is handled. That way the buffer only
+        // holds unhandled bytes if the client moves to another shard.
+        client->rx_used -= consumed;
+        memmove(client->rx_buffer, client->rx_buffer + consumed, client->rx_used);
+
+        client_state_t state = handle_message(shard, client, message_type, message_ptr);
+        if (state != CLIENT_KEEP) {
+            return state;
+        }
+    }
+    return CLIENT_KEEP;
+}
+
+// Keeps received bytes for later, for a client on its way to another shard. Returns false if they do not fit.
+static bool buffer_bytes(client_t *client, const unsigned char *bytes, size_t size) {
+    if (size > sizeof(client->rx_buffer) - client->rx_used) {
+        log_error("buffer_bytes: Client [%d] sent too much while moving shards", client->client_socket);
+        client->end_reason = SESSION_ERROR;
+        return false;
+    }
+    memcpy(client->rx_buffer + client->rx_used, bytes, size);
+    client->rx_used += size;
+    return true;
+}
+
+// Stops reading a client that belongs to another shard now. It is passed on once nothing more can arrive here.
+static void move_client(shard_t *shard, client_t *client) {
+    shard->clients = g_slist_remove(shard->clients, client);
+    timer_wheel_cancel(&shard->wheel, &client->idle_timer);
+    if (socket_loop_detach(shard->loop, client->watch_id)) {
+        post_to_shard(client->shard, SHARD_ADOPT_CLIENT, client, NULL, 0);
+    }
+}
+
+// Handles bytes received from a client, a buffer at a time.
+static void receive_bytes(shard_t *shard, client_t *client, const unsigned char *bytes, size_t size) {
+    if (client->shard != shard->index) {
+        // Still draining the socket before the client moves on.
+        if (!buffer_bytes(client, bytes, size)) {
+            drop_client(shard, client);
+        }
+        return;
+    }
+
+    while (size > 0) {
+        size_t space = sizeof(client->rx_buffer) - client->rx_used;
+        size_t amount = size < space ? size : space;
+        memcpy(client->rx_buffer + client->rx_used, bytes, amount);
+        client->rx_used += amount;
+        bytes += amount;
+        size -= amount;
+
+        client_state_t state = handle_buffered_messages(shard, client);
+        if (state == CLIENT_CLOSED) {
+            drop_client(shard, client);
+            return;
+        } else if (state == CLIENT_MOVED) {
+            // The rest goes with the client.
+            if (!buffer_bytes(client, bytes, size)) {
+                drop_client(shard, client);
+                return;
+            }
+            move_client(shard, client);
+            return;
+        }
+    }
+}
+
+static void handle_shard_event(shard_t *shard, shard_event_t *event) {
+    if (event->type == SHARD_ADOPT_CLIENT) {
+        client_t *client = event->client;
+        shard->clients = g_slist_append(shard->clients, client);
+        client->watch_id = socket_loop_recv(shard->loop, client->client_socket, client);
+        // Whatever brought the client here, a connection, a hello or a hand off, was just heard from it.
+        client->heard_tick = wheel_now();
+        arm_idle_timer(shard, client);
+
+        if (client->joined && client->awaiting_snapshot) {
+            // A client that moved here on joining waits for its snapshot now.
+            lock_clients();
+            queue_join_snapshot(client);
+            pthread_mutex_unlock(&clients_mutex);
+        }
+
+        // A client moving in may have sent more after its hello.
+        if (handle_buffered_messages(shard, client) == CLIENT_CLOSED) {
+            drop_client(shard, client);
+        }
+    } else if (event->type == SHARD_SEND_SNAPSHOT) {
+        // The client may have disconnected since the copy was made and its slot gone to another client, so the slot
+        // only counts if it still has a client of this shard waiting on a snapshot, with the same id. Spectators all
+        // have id 0, so the event may go to another spectator waiting on the shard, which is just as good: every
+        // waiting one has an event of its own coming.
+        lock_clients();
+        client_t *client = event->slot < players.end ? (client_t *) players.owners[event->slot] : NULL;
+        if (client && (client->shard != shard->index || !client->joined || !client->awaiting_snapshot ||
+                       client->player_id != event->player_id)) {
+            client = NULL;
+        }
+        pthread_mutex_unlock(&clients_mutex);
+        // Only this shard drops its clients, so the client stays until the snapshot is queued.
+        if (client) {
+            send_join_snapshot(client, event->copy, event->copy_tick);
+        }
+        world_copy_unref(event->copy);
+    }
+}
+
+// Handles everything posted to the shard's inbox.
+static void drain_inbox(shard_t *shard) {
+    queue_node_t *node;
+    while ((node = mpsc_queue_pop(&shard->inbox)) != NULL) {
+        shard_event_t *event = (shard_event_t *) node;
+        if (running) {
+            handle_shard_event(shard, event);
+        } else if (event->type == SHARD_ADOPT_CLIENT) {
+            // Clients are still in the player table, where shutdown or a hand off finds them.
+            shard->clients = g_slist_append(shard->clients, event->client);
+        } else if (event->copy) {
+            world_copy_unref(event->copy);
+        }
+        free(event);
+    }
+}
+
+static void handle_shard_socket(socket_event_t event, void *data, const unsigned char *bytes, ssize_t size,
+                                void *shard_ptr) {
+    shard_t *shard = (shard_t *) shard_ptr;
+
+    if (data == shard) {
+        // The wake fd.
+        uint64_t count;
+        if (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            log_error("handle_shard_socket: Could not read wake fd: %s", strerror(errno));
+        }
+        drain_inbox(shard);
+        return;
+    }
+    if (data == &shard->wheel) {
+        // The timer fd.
+        uint64_t expirations;
+        if (read(shard->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+            log_error("handle_shard_socket: Could not read timer fd: %s", strerror(errno));
+        }
+        timer_wheel_advance(&shard->wheel, wheel_now(), handle_idle_timer, shard);
+        set_shard_timer(shard, timer_wheel_next(&shard->wheel));
+        return;
+    }
+
+    client_t *client = (client_t *) data;
+    switch (event) {
+        case SOCKET_DATA:
+            client->heard_tick = wheel_now();
+            receive_bytes(shard, client, bytes, (size_t) size);
+            break;
+        case SOCKET_CLOSED:
+            if (size < 0) {
+                log_error("handle_shard_socket: Could not read from client [%d]: %s", client->client_socket,
+                          strerror((int) -size));
+                client->end_reason = SESSION_ERROR;
+            } else {
+                log_info("handle_shard_socket: client [%d] disconnected", client->client_socket);
+            }
+            drop_client(shard, client);
+            break;
+        case SOCKET_DETACHED:
+            post_to_shard(client->shard, SHARD_ADOPT_CLIENT, client, NULL, 0);
+            break;
+        default:
+            break;
+    }
+}
+
+// Shard thread. Waits on its clients' sockets and its inbox, and handles whatever is ready.
+static void * run_shard(void *shard_ptr) {
+    // Block SIGINT since the main thread takes care of that.
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+    shard_t *shard = (shard_t *) shard_ptr;
+
+    unsigned char scratch[CLIENT_ARENA_SIZE];
+    arena_t arena;
+    arena_init(&arena, scratch, sizeof(scratch));
+    shard->arena = &arena;
+
+    socket_loop_poll(shard->loop, shard->wake_fd, shard);
+    socket_loop_poll(shard->loop, shard->timer_fd, &shard->wheel);
+
+    while (running) {
+        if (socket_loop_wait(shard->loop, handle_shard_socket, shard) < 0 && errno != EINTR) {
+            log_error("run_shard: Could not wait for clients: %s", strerror(errno));
+        }
+    }
+
+    drain_inbox(shard);
+
+    if (!upgrading) {
+        // On a hand off the sockets and client structs belong to the hand off instead.
+        while (shard->clients) {
+            client_t *client = (client_t *) shard->clients->data;
+            client->end_reason = SESSION_SHUTDOWN;
+            drop_client(shard, client);
+        }
+    }
+    g_slist_free(shard->clients);
+    shard->clients = NULL;
+
+    return NULL;
+}
+
+// Ticks to rewind the world by when judging the client's input. A key press reaches the server about a round trip
+// after the snapshot the player was looking at left it, so that is how far back the player's world is, up to the
+// rewind limit.
+static uint64_t rewind_ticks(client_t *client) {
+    if (client->bot) {
+        return 0;
+    }
+    uint64_t ticks = (client->link.srtt_us + TICK_MS * 500) / (TICK_MS * 1000);
+    uint64_t limit = rewind_limit_ms / TICK_MS;
+    return ticks < limit ? ticks : limit;
+}
+
+// Applies the client's pending key, if any. A snake cannot move onto a cell another snake is on, judged by the world
+// as the player saw it rather than the current one. Returns true if the snake moved.
+static bool apply_input(client_t *client) {
+    if (!has_snake(client)) {
+        return false;
+    }
+
+    uint32_t key_code = __atomic_exchange_n(&client->pending_key, 0, __ATOMIC_ACQUIRE);
+    int x = players.xs[client->slot];
+    int y = players.ys[client->slot];
+    switch (key_code) {
+        case KEY_UP:
+            y--;
+            break;
+        case KEY_DOWN:
+            y++;
+            break;
+        case KEY_LEFT:
+            x--;
+            break;
+        case KEY_RIGHT:
+            x++;
+            break;
+        default:
+            return false;
+    }
+
+    // The last tick left the current world. The player cannot have seen the world from before it joined.
+    uint64_t current_tick = tick - 1;
+    uint64_t rewind = rewind_ticks(client);
+    uint64_t seen_tick = current_tick > rewind ? current_tick - rewind : 0;
+    if (seen_tick < client->history.since_tick) {
+        seen_tick = client->history.since_tick;
+    }
+    if (!world_history_has(&world_history, seen_tick)) {
+        seen_tick = current_tick;
+    }
+
+    if (world_history_has(&world_history, seen_tick) &&
+        world_history_occupied(&world_history, seen_tick, x, y, &client->history)) {
+        log_debug("apply_input: [%d] ran into a snake at %d,%d, %d ticks back", client->client_socket, x, y,
+                  current_tick - seen_tick);
+        metrics_count(COUNTER_MOVES_BLOCKED, 1);
+        return false;
+    }
+    if (seen_tick != current_tick && world_history_occupied(&world_history, current_tick, x, y, &client->history)) {
+        // Taken by now, but free in the world the player saw.
+        metrics_count(COUNTER_MOVES_FORGIVEN, 1);
+    }
+
+    log_debug("apply_input: [%d] moved to %d,%d", client->client_socket, x, y);
+    players.xs[client->slot] = (int16_t) x;
+    players.ys[client->slot] = (int16_t) y;
+    return true;
+}
+
+// Bytes sent to the client that it has not read yet, or -1 if that is not known.
+static int unread_bytes(client_t *client) {
+    if (client->ring) {
+        return (int) ring_used(client->ring);
+    }
+    int queued = 0;
+    if (ioctl(client->client_socket, SIOCOUTQ, &queued)) {
+        return -1;
+    }
+    return queued;
+}
+
+// Picks a new update rate for the client from its link estimates.
+static void adapt_update_rate(client_t *client) {
+    int send_queue = unread_bytes(client);
+    if (send_queue < 0) {
+        send_queue = 0;
+    }
+
+    size_t unsent = __atomic_load_n(&client->unsent_used, __ATOMIC_RELAXED);
+    detail_level_t old_detail = client->link.detail;
+    if (!link_adapt(&client->link, send_queue, unsent, metrics_now())) {
+        return;
+    }
+
+    if (old_detail == DETAIL_REDUCED && client->link.detail == DETAIL_FULL) {
+        // Far snakes that moved since the last far snapshot have not been sent yet.
+        client->last_snapshot_tick = client->last_far_snapshot_tick;
+    }
+
+    log_info("adapt_update_rate: Player %d now updates every %d ticks (%d Hz) with %s detail, rtt %d us, "
+             "send queue %d bytes, unsent %zu bytes, throughput %d B/s", client->player_id,
+             client->link.update_interval, 1000 / TICK_MS / client->link.update_interval,
+             detail_level_name(client->link.detail), client->link.srtt_us, send_queue, unsent,
+             client->link.throughput_bps);
+}
+
+// Whether a snapshot due for the client has to wait because the client has not taken the ones before it yet. The
+// snapshot after it covers everything since the last one that went out, so nothing is lost by skipping it. Only looks
+// at what the sender and the last ping already measured, so the lock is not held across a syscall per client.
+static bool is_backlogged(client_t *client) {
+    return link_backlogged(&client->link, __atomic_load_n(&client->unsent_used, __ATOMIC_RELAXED));
+}
+
+static bool is_near(int x, int y, int other_x, int other_y) {
+    return abs(x - other_x) <= NEAR_DISTANCE && abs(y - other_y) <= NEAR_DISTANCE;
+}
+
+// Points every bot at the nearest player, using one flow field for all of them. Must be called with the lock held.
+static void steer_bots() {
+    if (bot_count == 0) {
+        return;
+    }
+
+    guint count = players.count;
+    if (count > bot_buffer_capacity) {
+        // The bots keep their last keys until there is room to steer them again.
+        snake_t *targets = realloc(bot_targets, sizeof(snake_t) * count * 2);
+        if (targets == NULL) {
+            log_error("steer_bots: No memory to steer bots among %u snakes", count);
+            return;
+        }
+        bot_targets = targets;
+        snake_t *obstacles = realloc(bot_obstacles, sizeof(snake_t) * count * 2);
+        if (obstacles == NULL) {
+            log_error("steer_bots: No memory to steer bots among %u snakes", count);
+            return;
+        }
+        bot_obstacles = obstacles;
+        bot_buffer_capacity = count * 2;
+    }
+
+    uint32_t target_count = 0;
+    uint32_t obstacle_count = 0;
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        if (players.player_ids[slot] != 0) {
+            bot_obstacles[obstacle_count++] = snake_at(slot);
+            if (!((client_t *) players.owners[slot])->bot) {
+                bot_targets[target_count++] = snake_at(slot);
+            }
+        }
+    }
+
+    if (target_count == 0) {
+        if (tick % BOT_RALLY_TICKS == 1) {
+            bot_rally.x = (int16_t) (rand() % WIDTH);
+            bot_rally.y = (int16_t) (rand() % HEIGHT);
+        }
+        bot_targets[target_count++] = bot_rally;
+    }
+
+    flow_field_build(&bot_field, bot_targets, target_count, bot_obstacles, obstacle_count);
+
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client && client->bot) {
+            snake_t snake = snake_at(slot);
+            client->pending_key = flow_field_step(&bot_field, &snake);
+        }
+    }
+}
+
+// Moves every snake with pending input, judging each move by the world its player saw. Must be called with the lock
+// held.
+static void move_snakes() {
+    // Moves are judged against earlier ticks, so the one being recorded is never looked at while the snakes move.
+    world_history_begin(&world_history, tick);
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client == NULL) {
+            continue;
+        }
+        if (apply_input(client)) {
+            client->score++;
+            players.moved_ticks[slot] = tick;
+            world_changed_tick = tick;
+        }
+        if (players.player_ids[slot] != 0) {
+            snake_t snake = snake_at(slot);
+            world_history_record(&world_history, tick, &client->history, &snake);
+        }
+    }
+}
+
+static int compare_tick_inputs(const void *a, const void *b) {
+    uint32_t id_a = ((const tick_input_t *) a)->player_id;
+    uint32_t id_b = ((const tick_input_t *) b)->player_id;
+    return id_a < id_b ? -1 : id_a > id_b;
+}
+
+// Doubles the room for a tick's inputs. Returns false if there is no memory for more.
+static bool grow_tick_inputs() {
+    uint32_t capacity = tick_inputs_capacity ? tick_inputs_capacity * 2 : 64;
+    tick_input_t *inputs = realloc(tick_inputs, sizeof(tick_input_t) * capacity);
+    if (inputs == NULL) {
+        return false;
+    }
+    tick_inputs = inputs;
+    bool *moved = realloc(tick_moved, sizeof(bool) * capacity);
+    if (moved == NULL) {
+        return false;
+    }
+    tick_moved = moved;
+    tick_inputs_capacity = capacity;
+    return true;
+}
+
+// Moves every snake with pending input the way the lockstep clients will, then hands the pipeline the inputs to send
+// them. Once a second they are sent a hash of the world as well. Must be called with the lock held.
+static void move_snakes_lockstep(tick_result_t *result) {
+    uint32_t count = 0;
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client == NULL || !has_snake(client)) {
+            continue;
+        }
+        if (count == tick_inputs_capacity && !grow_tick_inputs()) {
+            // The keys not taken yet wait for the next tick.
+            log_error("move_snakes_lockstep: No memory for more than %d inputs on tick %d", count, tick);
+            break;
+        }
+        int direction = lockstep_direction(__atomic_exchange_n(&client->pending_key, 0, __ATOMIC_ACQUIRE));
+        if (direction < 0) {
+            continue;
+        }
+        tick_inputs[count].player_id = players.player_ids[slot];
+        tick_inputs[count].direction = (uint8_t) direction;
+        count++;
+    }
+
+    // The step does not care about order, but the inputs are sent sorted by id, which is what makes them compress well.
+    qsort(tick_inputs, count, sizeof(tick_input_t), compare_tick_inputs);
+    if (count > 0 && lockstep_step(&lockstep_grid, &players, tick_inputs, count, tick_moved) < 0) {
+        // No snake moved, so the clients must not move theirs either: the tick goes out as if there was no input.
+        log_error("move_snakes_lockstep: No memory to step tick %d, dropping its %d inputs", tick, count);
+        count = 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (tick_moved[i]) {
+            uint32_t slot = player_table_find(&players, tick_inputs[i].player_id);
+            ((client_t *) players.owners[slot])->score++;
+            players.moved_ticks[slot] = tick;
+            world_changed_tick = tick;
+        } else {
+            metrics_count(COUNTER_MOVES_BLOCKED, 1);
+        }
+    }
+
+    // A tick without inputs changes nothing, so none are sent at all. The result keeps its buffer from earlier ticks.
+    if (count > 0 && reserve_buffer(&result->inputs, 0, &result->inputs_capacity, tick_inputs_max_size(count))) {
+        result->inputs_size = encode_tick_inputs(result->inputs, (uint32_t) tick, tick_inputs, count);
+    } else if (count > 0) {
+        log_error("move_snakes_lockstep: No memory to send the inputs of tick %d", tick);
+    }
+    result->hash_due = tick % LOCKSTEP_HASH_TICKS == 0;
+    if (result->hash_due) {
+        result->hash.tick = (uint32_t) tick;
+        result->hash.hash = lockstep_hash(&players);
+    }
+}
+
+// Hands a client's queued messages to the pipeline, along with what its encoder needs to know to send it the tick.
+// Must be called with the lock held.
+static void add_recipient(tick_result_t *result, client_t *client, bool snapshot) {
+    if (result->recipient_count == result->recipient_capacity) {
+        uint32_t capacity = result->recipient_capacity ? result->recipient_capacity * 2 : 64;
+        tick_recipient_t *recipients = realloc(result->recipients, sizeof(tick_recipient_t) * capacity);
+        if (recipients == NULL) {
+            log_error("add_recipient: No memory to send tick %d to [%d]", tick, client->client_socket);
+            return;
+        }
+        // New slots have no buffer yet.
+        memset(recipients + result->recipient_capacity, 0,
+               sizeof(tick_recipient_t) * (capacity - result->recipient_capacity));
+        result->recipients = recipients;
+        result->recipient_capacity = capacity;
+    }
+
+    tick_recipient_t *recipient = &result->recipients[result->recipient_count++];
+    recipient->client = client;
+    recipient->fd = client->client_socket;
+    recipient->ring = client->ring;
+    recipient->player_id = client->player_id;
+    recipient->x = players.xs[client->slot];
+    recipient->y = players.ys[client->slot];
+    recipient->lockstep = is_lockstep_client(client);
+    recipient->snapshot = snapshot;
+    if (snapshot) {
+        // With reduced detail, snakes far from the client's own snake only go out on every
+        // LINK_FAR_SNAPSHOT_FACTOR'th snapshot.
+        recipient->reduced = client->link.detail == DETAIL_REDUCED;
+        recipient->far_due = !recipient->reduced || tick - client->last_far_snapshot_tick >=
+                                                    client->link.update_interval * LINK_FAR_SNAPSHOT_FACTOR;
+        recipient->since = client->last_snapshot_tick;
+        recipient->far_since = client->last_far_snapshot_tick;
+        client->last_snapshot_tick = tick;
+        if (recipient->far_due) {
+            client->last_far_snapshot_tick = tick;
+        }
+    }
+
+    // The pipeline takes over the queued messages, and the client carries on with the buffer the slot had on an earlier
+    // tick, which the sender emptied.
+    unsigned char *spare = recipient->buffer;
+    size_t spare_capacity = recipient->capacity;
+    recipient->buffer = client->tx_buffer;
+    recipient->used = client->tx_used;
+    recipient->capacity = client->tx_capacity;
+    client->tx_buffer = spare;
+    client->tx_used = 0;
+    client->tx_capacity = spare_capacity;
+    __atomic_add_fetch(&client->inflight, 1, __ATOMIC_RELAXED);
+}
+
+// Copies every snake that some recipient of the tick is sent into the result. Must be called with the lock held.
+static void collect_sent_snakes(tick_result_t *result) {
+    uint64_t oldest = UINT64_MAX;
+    for (uint32_t i = 0; i < result->recipient_count; i++) {
+        tick_recipient_t *recipient = &result->recipients[i];
+        if (recipient->snapshot) {
+            uint64_t since = recipient->reduced && recipient->far_due ? recipient->far_since : recipient->since;
+            oldest = since < oldest ? since : oldest;
+        }
+    }
+    if (oldest == UINT64_MAX || players.count == 0) {
+        return;
+    }
+
+    if (players.count > result->snake_capacity) {
+        uint32_t capacity = players.count * 2;
+        sent_snake_t *snakes = realloc(result->snakes, sizeof(sent_snake_t) * capacity);
+        if (snakes != NULL) {
+            result->snakes = snakes;
+        }
+        uint32_t *fanouts = realloc(result->fanouts, sizeof(uint32_t) * capacity);
+        if (fanouts != NULL) {
+            result->fanouts = fanouts;
+        }
+        if (snakes == NULL || fanouts == NULL) {
+            log_error("collect_sent_snakes: No memory for the snakes of tick %d", tick);
+            return;
+        }
+        result->snake_capacity = capacity;
+    }
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        if (players.player_ids[slot] != 0 && players.moved_ticks[slot] > oldest) {
+            result->snakes[result->snake_count].snake = snake_at(slot);
+            result->snakes[result->snake_count].moved_tick = players.moved_ticks[slot];
+            result->snake_count++;
+        }
+    }
+    memset(result->fanouts, 0, sizeof(uint32_t) * result->snake_count);
+}
+
+// Frees what a tick result grew over its uses.
+static void free_tick_result(tick_result_t *result) {
+    free(result->snakes);
+    free(result->fanouts);
+    free(result->inputs);
+    for (uint32_t i = 0; i < result->recipient_capacity; i++) {
+        free(result->recipients[i].buffer);
+    }
+    free(result->recipients);
+}
+
+// The tick the client is next due a ping on. Pings are spread over the interval by player id rather than everyone
+// being pinged on the same tick.
+static uint64_t next_ping_tick(client_t *client) {
+    if (client->ping_tick == 0) {
+        client->ping_tick = tick + (PING_INTERVAL_TICKS - (tick + client->player_id) % PING_INTERVAL_TICKS) %
+                                   PING_INTERVAL_TICKS;
+    }
+    return client->ping_tick;
+}
+
+// Records the world as it stands for a tick that was not run, as move_snakes would have. Must be called with the lock
+// held.
+static void record_unchanged_world(uint64_t at_tick) {
+    world_history_begin(&world_history, at_tick);
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client != NULL && players.player_ids[slot] != 0) {
+            snake_t snake = snake_at(slot);
+            world_history_record(&world_history, at_tick, &client->history, &snake);
+        }
+    }
+}
+
+// Whether the next tick would change nothing and send nothing but pings: no bots, no input, nobody joining, nothing
+// queued and every snake that moved already sent to everyone. If so, wake_tick is set to the first tick a client is
+// due a ping on, or UINT64_MAX if none is. Must be called with the lock held.
+static bool world_idle(uint64_t *wake_tick) {
+    if (bot_count > 0 || joining != NULL) {
+        return false;
+    }
+    *wake_tick = UINT64_MAX;
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client == NULL) {
+            continue;
+        }
+        if (__atomic_load_n(&client->pending_key, __ATOMIC_SEQ_CST) != 0 || client->tx_used > 0 ||
+            __atomic_load_n(&client->unsent_used, __ATOMIC_RELAXED) > 0) {
+            return false;
+        }
+        if (!client->joined || client->awaiting_snapshot) {
+            continue;
+        }
+        if (!is_lockstep_client(client) && client->last_far_snapshot_tick < world_changed_tick) {
+            return false;
+        }
+        uint64_t ping_tick = next_ping_tick(client);
+        if (ping_tick < *wake_tick) {
+            *wake_tick = ping_tick;
+        }
+    }
+    return true;
+}
+
+// Moves every snake with pending input, then hands the pipeline the tick's messages for every client with something
+// to send. Clients are sent the snakes that moved once their update interval is up, and pinged if they are due a ping
+// within ping_early ticks. The tick's result is filled into one the sender is done with.
+static void run_tick(tick_result_t *result, uint64_t ping_early) {
+    lock_clients();
+    tick++;
+
+    steer_bots();
+
+    result->tick = tick;
+    result->snake_count = 0;
+    result->inputs_size = 0;
+    result->hash_due = false;
+    result->recipient_count = 0;
+
+    if (lockstep) {
+        move_snakes_lockstep(result);
+    } else {
+        move_snakes();
+    }
+
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client == NULL || !client->joined || client->awaiting_snapshot || client->bot) {
+            continue;
+        }
+
+        if (next_ping_tick(client) <= tick + ping_early) {
+            adapt_update_rate(client);
+            send_ping(client);
+            client->ping_tick = tick + PING_INTERVAL_TICKS;
+        }
+
+        if (client->held) {
+            continue;
+        }
+        bool snapshot = !is_lockstep_client(client) &&
+                        tick - client->last_snapshot_tick >= client->link.update_interval && !is_backlogged(client);
+        bool inputs = is_lockstep_client(client) && (result->inputs_size > 0 || result->hash_due);
+        // A client whose socket had no room for everything is handed to the sender every tick until it has, so the
+        // rest is tried again.
+        bool unsent = __atomic_load_n(&client->unsent_used, __ATOMIC_RELAXED) > 0;
+        if (snapshot || inputs || unsent || client->tx_used > 0) {
+            add_recipient(result, client, snapshot);
+        }
+    }
+    collect_sent_snakes(result);
+
+    if (joining != NULL) {
+        publish_world_copy();
+    }
+
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Blocks while the queue is full.
+static void stage_push(stage_queue_t *stage, tick_result_t *result) {
+    while (sem_wait(&stage->room) && errno == EINTR) {
+    }
+    spsc_queue_push(&stage->queue, result);
+    sem_post(&stage->filled);
+}
+
+// Blocks while the queue is empty.
+static tick_result_t * stage_pop(stage_queue_t *stage) {
+    while (sem_wait(&stage->filled) && errno == EINTR) {
+    }
+    tick_result_t *result = spsc_queue_pop(&stage->queue);
+    sem_post(&stage->room);
+    return result;
+}
+
+static int stage_queue_init(stage_queue_t *stage, uint32_t capacity) {
+    if (spsc_queue_init(&stage->queue, capacity)) {
+        return -1;
+    }
+    sem_init(&stage->filled, 0, 0);
+    sem_init(&stage->room, 0, capacity);
+    return 0;
+}
+
+static void stage_queue_destroy(stage_queue_t *stage) {
+    spsc_queue_destroy(&stage->queue);
+    sem_destroy(&stage->filled);
+    sem_destroy(&stage->room);
+}
+
+static bool reserve_recipient(tick_recipient_t *recipient, size_t size) {
+    return reserve_buffer(&recipient->buffer, recipient->used, &recipient->capacity, size);
+}
+
+// Encodes a recipient's messages for the tick after whatever it had queued.
+static void encode_recipient(tick_result_t *result, tick_recipient_t *recipient) {
+    if (recipient->snapshot) {
+        for (uint32_t i = 0; i < result->snake_count; i++) {
+            sent_snake_t *sent = &result->snakes[i];
+            uint64_t since = recipient->since;
+            if (recipient->reduced && sent->snake.player_id != recipient->player_id &&
+                !is_near(recipient->x, recipient->y, sent->snake.x, sent->snake.y)) {
+                if (!recipient->far_due) {
+                    continue;
+                }
+                since = recipient->far_since;
+            }
+            if (sent->moved_tick <= since || !reserve_recipient(recipient, MAX_MESSAGE_SIZE)) {
+                continue;
+            }
+            msg_snake_update message;
+            message.snake = sent->snake;
+            recipient->used += encode_message(recipient->buffer + recipient->used, MSG_SNAKE_UPDATE, &message);
+            __atomic_add_fetch(&result->fanouts[i], 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (recipient->lockstep) {
+        if (result->inputs_size > 0 && reserve_recipient(recipient, result->inputs_size)) {
+            memcpy(recipient->buffer + recipient->used, result->inputs, result->inputs_size);
+            recipient->used += result->inputs_size;
+            metrics_message_out(MSG_TICK_INPUTS, result->inputs_size);
+        }
+        if (result->hash_due && reserve_recipient(recipient, MAX_MESSAGE_SIZE)) {
+            recipient->used += encode_message(recipient->buffer + recipient->used, MSG_STATE_HASH, &result->hash);
+        }
+    }
+}
+
+// Encoder thread. Encodes its share of the recipients of each tick, then passes the tick on to the sender.
+static void * run_encoder(void *index_ptr) {
+    int index = (int) (intptr_t) index_ptr;
+    while (true) {
+        tick_result_t *result = stage_pop(&encode_queues[index]);
+        if (result != &pipeline_stop) {
+            uint64_t start = metrics_now();
+            uint32_t first = (uint32_t) ((uint64_t) result->recipient_count * index / encoder_count);
+            uint32_t last = (uint32_t) ((uint64_t) result->recipient_count * (index + 1) / encoder_count);
+            for (uint32_t i = first; i < last; i++) {
+                encode_recipient(result, &result->recipients[i]);
+            }
+            metrics_observe(HISTOGRAM_TICK_ENCODE, metrics_now() - start);
+        }
+        stage_push(&send_queues[index], result);
+        if (result == &pipeline_stop) {
+            return NULL;
+        }
+    }
+}
+
+// Whether the recipient has anything to write to its socket: its own bytes, or ones its socket had no room for before.
+static bool has_socket_write(tick_recipient_t *recipient) {
+    return recipient->ring == NULL && (recipient->used > 0 || recipient->client->unsent_used > 0);
+}
+
+// Writes out every recipient's messages for a tick in one batch, then lets go of the clients. A socket only takes what
+// it has room for, and the rest waits with the client for the next tick it is handed to the pipeline on.
+static void send_tick_result(socket_writer_t *tick_writer, socket_write_t **writes, uint32_t *writes_capacity,
+                             tick_result_t *result) {
+    if (result->recipient_count > *writes_capacity) {
+        *writes_capacity = result->recipient_count * 2;
+        *writes = realloc(*writes, sizeof(socket_write_t) * *writes_capacity);
+    }
+
+    int count = 0;
+    for (uint32_t i = 0; i < result->recipient_count; i++) {
+        tick_recipient_t *recipient = &result->recipients[i];
+        client_t *client = recipient->client;
+        if (recipient->ring && recipient->used > 0) {
+            ssize_t written_amount = write_to_ring(client, recipient->buffer, recipient->used);
+            if (written_amount > 0) {
+                __atomic_add_fetch(&client->link.bytes_sent, written_amount, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+        if (!has_socket_write(recipient)) {
+            continue;
+        }
+        (*writes)[count].fd = recipient->fd;
+        if (client->unsent_used > 0) {
+            // The tick's bytes have to wait behind the ones from before.
+            bool queued = queue_unsent(client, recipient->buffer, recipient->used);
+            recipient->used = 0;
+            if (!queued) {
+                continue;
+            }
+            (*writes)[count].buffer = client->unsent;
+            (*writes)[count].size = client->unsent_used;
+        } else {
+            (*writes)[count].buffer = recipient->buffer;
+            (*writes)[count].size = recipient->used;
+        }
+        count++;
+    }
+    if (count > 0) {
+        socket_writer_write(tick_writer, *writes, count);
+    }
+
+    // The recipients are in the same order as when the batch was made.
+    int written = 0;
+    for (uint32_t i = 0; i < result->recipient_count; i++) {
+        tick_recipient_t *recipient = &result->recipients[i];
+        client_t *client = recipient->client;
+        if (written < count && has_socket_write(recipient)) {
+            socket_write_t *write = &(*writes)[written++];
+            if (write->result < 0) {
+                // The socket failed, which its shard hears about too. Nothing more gets through to it.
+                __atomic_store_n(&client->unsent_used, 0, __ATOMIC_RELAXED);
+            } else {
+                __atomic_add_fetch(&client->link.bytes_sent, write->result, __ATOMIC_RELAXED);
+                if (write->buffer == client->unsent) {
+                    consume_unsent(client, (size_t) write->result);
+                } else {
+                    queue_unsent(client, recipient->buffer + write->result, recipient->used - (size_t) write->result);
+                }
+            }
+        }
+        recipient->used = 0;
+        // The client can be freed as soon as this lets go of it.
+        __atomic_sub_fetch(&client->inflight, 1, __ATOMIC_RELEASE);
+    }
+
+    for (uint32_t i = 0; i < result->snake_count; i++) {
+        if (result->snakes[i].moved_tick == result->tick) {
+            metrics_observe(HISTOGRAM_FANOUT, result->fanouts[i]);
+        }
+    }
+
+    pthread_mutex_lock(&pipeline_mutex);
+    pthread_cond_broadcast(&pipeline_sent);
+    pthread_mutex_unlock(&pipeline_mutex);
+}
+
+// Sender thread. Takes each tick from every encoder, which makes the whole tick, and writes it out.
+static void * run_sender(void *dummy) {
+    socket_writer_t *tick_writer = socket_writer_new(use_io_uring);
+    socket_write_t *writes = NULL;
+    uint32_t writes_capacity = 0;
+
+    while (true) {
+        tick_result_t *result = NULL;
+        for (int i = 0; i < encoder_count; i++) {
+            result = stage_pop(&send_queues[i]);
+        }
+        if (result == &pipeline_stop) {
+            break;
+        }
+        uint64_t start = metrics_now();
+        send_tick_result(tick_writer, &writes, &writes_capacity, result);
+        stage_push(&free_results, result);
+        metrics_observe(HISTOGRAM_TICK_SEND, metrics_now() - start);
+    }
+
+    socket_writer_free(tick_writer);
+    free(writes);
+    return NULL;
+}
+
+// Starts the encoders and the sender. Returns 0 on success or -1 if there is no memory for them.
+static int start_pipeline() {
+    encode_queues = calloc((size_t) encoder_count, sizeof(stage_queue_t));
+    send_queues = calloc((size_t) encoder_count, sizeof(stage_queue_t));
+    encoder_threads = calloc((size_t) encoder_count, sizeof(pthread_t));
+    if (encode_queues == NULL || send_queues == NULL || encoder_threads == NULL) {
+        log_error("start_pipeline: No memory for %d encoders", encoder_count);
+        return -1;
+    }
+    for (int i = 0; i < encoder_count; i++) {
+        if (stage_queue_init(&encode_queues[i], PIPELINE_DEPTH) || stage_queue_init(&send_queues[i], PIPELINE_DEPTH)) {
+            log_error("start_pipeline: No memory for %d encoders", encoder_count);
+            return -1;
+        }
+    }
+    tick_results = calloc(TICK_RESULT_COUNT, sizeof(tick_result_t));
+    if (tick_results == NULL || stage_queue_init(&free_results, TICK_RESULT_COUNT)) {
+        log_error("start_pipeline: No memory for the tick results");
+        return -1;
+    }
+    for (int i = 0; i < TICK_RESULT_COUNT; i++) {
+        stage_push(&free_results, &tick_results[i]);
+    }
+
+    for (int i = 0; i < encoder_count; i++) {
+        pthread_create(&encoder_threads[i], NULL, run_encoder, (void *) (intptr_t) i);
+    }
+    pthread_create(&sender_thread, NULL, run_sender, NULL);
+    return 0;
+}
+
+// Lets the pipeline write out every tick it was handed, then stops it.
+static void stop_pipeline() {
+    for (int i = 0; i < encoder_count; i++) {
+        stage_push(&encode_queues[i], &pipeline_stop);
+    }
+    for (int i = 0; i < encoder_count; i++) {
+        pthread_join(encoder_threads[i], NULL);
+        stage_queue_destroy(&encode_queues[i]);
+    }
+    pthread_join(sender_thread, NULL);
+    for (int i = 0; i < encoder_count; i++) {
+        stage_queue_destroy(&send_queues[i]);
+    }
+    free(encode_queues);
+    free(send_queues);
+    free(encoder_threads);
+
+    for (int i = 0; i < TICK_RESULT_COUNT; i++) {
+        free_tick_result(&tick_results[i]);
+    }
+    free(tick_results);
+    tick_results = NULL;
+    stage_queue_destroy(&free_results);
+}
+
+static void add_ms(struct timespec *time, uint64_t ms) {
+    uint64_t nsec = (uint64_t) time->tv_nsec + ms % 1000 * 1000 * 1000;
+    time->tv_sec += (time_t) (ms / 1000 + nsec / (1000 * 1000 * 1000));
+    time->tv_nsec = (long) (nsec % (1000 * 1000 * 1000));
+}
+
+// Sleeps through ticks for as long as running them would change nothing, until something wakes the simulation or a
+// client is due a ping. The ticks slept through are counted as if they had run, and recorded in the history with the
+// world as it stood, so a tick number still stands for the same time. next_tick is the time of the tick due next, and
+// is moved on past the ticks slept through. Returns whether there were any.
+static bool sleep_while_idle(struct timespec *next_tick) {
+    uint64_t wake_tick;
+    lock_clients();
+    if (!world_idle(&wake_tick)) {
+        pthread_mutex_unlock(&clients_mutex);
+        return false;
+    }
+
+    uint64_t idle_tick = tick;
+    __atomic_store_n(&simulation_idle, true, __ATOMIC_SEQ_CST);
+    // Looked at again once simulation_idle is set, for input queued without the lock just before it was.
+    while (running && world_idle(&wake_tick) && wake_tick > tick + 1) {
+        if (wake_tick == UINT64_MAX) {
+            pthread_cond_wait(&simulation_wake, &clients_mutex);
+            continue;
+        }
+        struct timespec deadline = *next_tick;
+        add_ms(&deadline, (wake_tick - tick - 1) * TICK_MS);
+        if (pthread_cond_timedwait(&simulation_wake, &clients_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    __atomic_store_n(&simulation_idle, false, __ATOMIC_SEQ_CST);
+
+    // The tick due next is the last one whose time has come.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t behind_ns = (int64_t) (now.tv_sec - next_tick->tv_sec) * 1000 * 1000 * 1000 +
+                        (now.tv_nsec - next_tick->tv_nsec);
+    uint64_t skipped = behind_ns > 0 ? (uint64_t) behind_ns / (TICK_MS * 1000 * 1000) : 0;
+    if (skipped > 0) {
+        add_ms(next_tick, skipped * TICK_MS);
+        tick += skipped;
+        if (!lockstep) {
+            uint64_t first = tick - idle_tick > HISTORY_TICKS ? tick - HISTORY_TICKS + 1 : idle_tick + 1;
+            for (uint64_t at_tick = first; at_tick <= tick; at_tick++) {
+                record_unchanged_world(at_tick);
+            }
+        }
+        metrics_count(COUNTER_TICKS_SKIPPED, skipped);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return skipped > 0;
+}
+
+// Simulation thread. Runs a tick every TICK_MS on a fixed schedule, handing each to the pipeline to be sent while the
+// next one runs. With idle sleep on, ticks that would change nothing are slept through instead.
+static void * simulate(void *dummy) {
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+    // The pipeline's threads are started from here so they block SIGINT as well.
+    if (start_pipeline()) {
+        exit(1);
+    }
+
+    struct timespec next_tick;
+    clock_gettime(CLOCK_MONOTONIC, &next_tick);
+
+    while (running) {
+        add_ms(&next_tick, TICK_MS);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL) == EINTR) {
+        }
+
+        // After sleeping, everyone due a ping within half an interval is pinged right away, so an idle world with
+        // many clients still only wakes up about once a second instead of once for each of them.
+        uint64_t ping_early = 0;
+        if (idle_sleep && sleep_while_idle(&next_tick)) {
+            ping_early = PING_INTERVAL_TICKS / 2;
+        }
+
+        // A full pipeline holds the simulation back here, outside the lock.
+        tick_result_t *result = stage_pop(&free_results);
+        uint64_t tick_start = metrics_now();
+        run_tick(result, ping_early);
+        metrics_observe(HISTOGRAM_TICK, metrics_now() - tick_start);
+
+        for (int i = 0; i < encoder_count; i++) {
+            stage_push(&encode_queues[i], result);
+        }
+    }
 
-static void client_signal_handler(int dummy) {
-    log_debug("A client received SIGUSR1");
+    // Whatever is still queued or unsent stays with the clients, to be handed off along with them in an upgrade.
+    stop_pipeline();
+    return NULL;
 }
 
-// Sends updated positions to the connected clients.
-static void update_snake(client_t *connected_client, client_t *changed_client) {
-    msg_snake_update message;
-    message.snake = changed_client->snake;
-    send_message(connected_client->client_socket, MSG_SNAKE_UPDATE, &message);
+// Waits for the simulation to finish once running is off.
+static void stop_simulation() {
+    // A simulation sleeping through idle ticks only notices once woken.
+    lock_clients();
+    wake_simulation();
+    pthread_mutex_unlock(&clients_mutex);
+    pthread_join(simulation_thread, NULL);
 }
 
-// Lets connected clients know that a client disconnected.
-static void send_client_disconnect(client_t *connected_client, client_t *disconnect_client) {
-    msg_client_disconnect message;
-    message.player_id = (uint32_t) disconnect_client->client_socket;
-    send_message(connected_client->client_socket, MSG_CLIENT_DISCONNECT, &message);
+static void interrupt_handler(int dummy) {
+    log_info("interrupt_handler: SIGINT received. Shutting down server...");
+    running = false;
+
+    // The shards disconnect their own clients once they see running is off.
+    for (int i = 0; i < shard_count; i++) {
+        uint64_t one = 1;
+        if (write(shards[i].wake_fd, &one, sizeof(one)) < 0) {
+            log_error("interrupt_handler: Could not wake shard %d", i);
+        }
+    }
+
+    shutdown(server_socket, SHUT_RDWR);
+    if (local_socket != -1) {
+        shutdown(local_socket, SHUT_RDWR);
+    }
 }
 
-// Client thread
-static void * accept_client(void *client_ptr) {
-    // Block SIGINT since the main thread takes care of that.
+// Adds a client to the player table, with the given snake if it has joined as a player, and hands it to a shard.
+// Clients that have joined go straight to the shard that owns their player id, the rest are spread round robin until
+// their hello arrives.
+static void start_client(client_t *client, const snake_t *snake) {
+    // The rest of the client comes zeroed, apart from what a hand off carried over.
+    client->watch_id = -1;
+
+    lock_clients();
+    client->slot = player_table_add(&players, client, client->client_socket);
+    if (client->slot == PLAYER_SLOT_NONE) {
+        pthread_mutex_unlock(&clients_mutex);
+        log_error("start_client: No room in the player table for [%d]", client->client_socket);
+        close(client->client_socket);
+        free_client(client);
+        return;
+    }
+    if (has_snake(client)) {
+        place_snake(client, snake);
+        client->shard = (int) (client->player_id % shard_count);
+    } else {
+        client->shard = (int) (next_shard++ % shard_count);
+    }
+    post_to_shard(client->shard, SHARD_ADOPT_CLIENT, client, NULL, 0);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Starts one shard per core unless told otherwise.
+static void start_shards() {
+    if (shard_count <= 0) {
+        shard_count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (shard_count <= 0) {
+            shard_count = 1;
+        }
+    }
+    log_info("start_shards: Starting %d shards", shard_count);
+
+    shards = calloc((size_t) shard_count, sizeof(shard_t));
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].index = i;
+        shards[i].wake_fd = eventfd(0, EFD_NONBLOCK);
+        shards[i].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        shards[i].timer_tick = UINT64_MAX;
+        timer_wheel_init(&shards[i].wheel, wheel_now());
+        shards[i].loop = socket_loop_new(use_io_uring);
+        mpsc_queue_init(&shards[i].inbox);
+        pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]);
+    }
+}
+
+// Waits for the shards to finish once running is off.
+static void stop_shards() {
+    for (int i = 0; i < shard_count; i++) {
+        wake_shard(&shards[i]);
+        pthread_join(shards[i].thread, NULL);
+        socket_loop_free(shards[i].loop);
+        close(shards[i].wake_fd);
+        close(shards[i].timer_fd);
+    }
+    free(shards);
+    shards = NULL;
+}
+
+// The sending side copies a client's received bytes into the record and the receiving side copies them back out, so
+// each side's buffer must hold what the other's can.
+#if CLIENT_RX_BUFFER_SIZE != HANDOFF_RX_SIZE
+#error "A client's received bytes must be the size of its hand off record's"
+#endif
+
+static void hand_off_client(client_t *client, int handoff_fd) {
+    handoff_session_t session;
+    session.score = client->score;
+    session.play_time_ms = client->joined ? (uint32_t) ((metrics_now() - client->joined_ns) / 1000000) : 0;
+    session.resume_token = client->resume_token;
+    // What the socket had no room for and what was queued since the last tick are for the new process to send.
+    queue_unsent(client, client->tx_buffer, client->tx_used);
+    client->tx_used = 0;
+    handoff_pending_t pending;
+    memset(&pending, 0, sizeof(pending));
+    pending.awaiting_snapshot = client->awaiting_snapshot;
+    pending.rx_used = (uint32_t) client->rx_used;
+    memcpy(pending.rx_buffer, client->rx_buffer, client->rx_used);
+    pending.unsent_size = (uint32_t) client->unsent_used;
+    snake_t snake = snake_at(client->slot);
+    handoff_send_client(handoff_fd, &snake, client->joined, client->role, &session, &pending, client->unsent,
+                        client->client_socket, client->ring);
+}
+
+static void release_client(client_t *client) {
+    // Only this process's references are closed; the connection and its ring live on in the new process.
+    close(client->client_socket);
+    free_client(client);
+}
+
+// Adds the bots to the world. They join like players, only without a socket or a shard.
+static void spawn_bots() {
+    if (bot_count == 0) {
+        return;
+    }
+    if (flow_field_init(&bot_field, WIDTH, HEIGHT)) {
+        bot_count = 0;
+        return;
+    }
+
+    lock_clients();
+    for (uint32_t i = 0; i < bot_count; i++) {
+        client_t *bot = pool_alloc(&client_pool);
+        if (bot == NULL) {
+            log_error("spawn_bots: No memory for more than %d bots", i);
+            break;
+        }
+        memset(bot, 0, sizeof(client_t));
+        bot->client_socket = -1;
+        bot->watch_id = -1;
+        bot->shard = -1;
+        bot->bot = true;
+        bot->joined = true;
+        bot->role = ROLE_PLAYER;
+        bot->slot = player_table_add(&players, bot, -1);
+        if (bot->slot == PLAYER_SLOT_NONE) {
+            log_error("spawn_bots: No room in the player table for more than %d bots", i);
+            pool_free(&client_pool, bot);
+            break;
+        }
+        snake_t snake;
+        snake.player_id = take_player_id();
+        snake.x = (int16_t) (rand() % WIDTH);
+        snake.y = (int16_t) (rand() % HEIGHT);
+        place_snake(bot, &snake);
+        players.moved_ticks[bot->slot] = tick + 1;
+        if (lockstep) {
+            broadcast_new_snake(bot->slot);
+        }
+        link_init(&bot->link, metrics_now());
+    }
+    world_changed_tick = tick + 1;
+    pthread_mutex_unlock(&clients_mutex);
+
+    log_info("spawn_bots: Added %d bots", bot_count);
+}
+
+// Takes the bots out of the world, telling the remaining players they left.
+static void remove_bots() {
+    if (bot_count == 0) {
+        return;
+    }
+
+    lock_clients();
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client && client->bot) {
+            remove_player(client);
+            broadcast_disconnect(client->player_id);
+            pool_free(&client_pool, client);
+        }
+    }
+    flush_clients();
+    pthread_mutex_unlock(&clients_mutex);
+
+    flow_field_destroy(&bot_field);
+    free(bot_targets);
+    free(bot_obstacles);
+    bot_targets = NULL;
+    bot_obstacles = NULL;
+    bot_buffer_capacity = 0;
+}
+
+// Passes the listening socket and every client to a newly started server process.
+static void collect_orphaned_snake(gpointer key, gpointer value, gpointer cursor_ptr) {
+    checkpoint_player_t **cursor = (checkpoint_player_t **) cursor_ptr;
+    **cursor = *(checkpoint_player_t *) value;
+    (*cursor)++;
+}
+
+// Copies the recovered players that have not come back yet into a malloc'd array for the caller to free, and sets
+// count to their number. Returns NULL with a count of 0 if there are none or no memory for them.
+static checkpoint_player_t * collect_orphans(uint32_t *count) {
+    *count = orphaned_snakes ? g_hash_table_size(orphaned_snakes) : 0;
+    if (*count == 0) {
+        return NULL;
+    }
+    checkpoint_player_t *orphans = malloc(sizeof(checkpoint_player_t) * *count);
+    if (orphans == NULL) {
+        log_error("collect_orphans: No memory for %d recovered players", *count);
+        *count = 0;
+        return NULL;
+    }
+    checkpoint_player_t *cursor = orphans;
+    g_hash_table_foreach(orphaned_snakes, collect_orphaned_snake, &cursor);
+    return orphans;
+}
+
+static void hand_off_server(int handoff_fd) {
+    log_info("hand_off_server: Handing off %d clients to the new server process", players.count);
+
+    upgrading = true;
+    running = false;
+
+    // Any input not yet applied is lost, but the snakes must stop moving before they are handed off.
+    stop_simulation();
+    stop_shards();
+    // The new server process brings its own bots.
+    remove_bots();
+
+    // No more sessions end here, so the store is closed before the new process is told anything. Everything this
+    // process stored is on disk by the time the new process loads the store and starts appending to it. Metrics go
+    // first, as scrapes read the store.
+    metrics_stop();
+    if (session_store) {
+        store_close(session_store);
+        session_store = NULL;
+    }
+
+    // Every shard has exited, so the table can be used without the lock from here on.
+    handoff_listeners_t listeners;
+    listeners.listen_fd = server_socket;
+    listeners.local_fd = local_socket;
+    listeners.route_fd = route_socket;
+    listeners.router_fd = router_fd;
+    // Recovered players that have not come back yet follow the clients, so they can still resume with the new process.
+    uint32_t orphan_count;
+    checkpoint_player_t *orphans = collect_orphans(&orphan_count);
+    if (handoff_send_header(handoff_fd, next_player_id, player_id_stride, players.count, orphan_count,
+                            &listeners) == 0) {
+        for (uint32_t slot = 0; slot < players.end; slot++) {
+            if (players.owners[slot]) {
+                hand_off_client((client_t *) players.owners[slot], handoff_fd);
+            }
+        }
+        handoff_send_orphans(handoff_fd, orphans, orphan_count);
+
+        char ack;
+        if (srecv(handoff_fd, &ack, 1) <= 0) {
+            log_error("hand_off_server: The new server process did not confirm the hand off.");
+        }
+    }
+
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        if (players.owners[slot]) {
+            release_client((client_t *) players.owners[slot]);
+        }
+    }
+    player_table_clear(&players);
+    free(orphans);
+}
+
+// Lets the recovered players resume their snakes. Takes over the array. Shards can already be joining clients, so the
+// players are only published under the lock.
+static void adopt_orphans(checkpoint_player_t *orphans, uint32_t count) {
+    GHashTable *table = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (uint32_t i = 0; i < count; i++) {
+        g_hash_table_insert(table, GUINT_TO_POINTER(orphans[i].snake.player_id), &orphans[i]);
+    }
+    lock_clients();
+    orphaned_snakes = table;
+    recovered_snakes = orphans;
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Opens the session store, unless there is none or it is open already. Shards can already be ending sessions, so the
+// store is only published under the lock.
+static void open_session_store() {
+    if (store_path == NULL || session_store != NULL) {
+        return;
+    }
+    store_t *store = store_open(store_path);
+    lock_clients();
+    session_store = store;
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Takes over the listening sockets and clients of a server already running at the given upgrade path. Returns the
+// listening socket or -1 if there is no server to take over from. The unix listening socket, the route socket and the
+// router's connection, if the old server had them, go into local_socket, route_socket and router_fd.
+static int take_over_server(const char *path) {
+    int handoff_fd = connect_unix_socket(path);
+    if (handoff_fd == -1) {
+        log_info("take_over_server: No running server at %s", path);
+        return -1;
+    }
+
+    log_info("take_over_server: Taking over from the server running at %s", path);
+
+    handoff_header_t header;
+    handoff_listeners_t listeners;
+    if (handoff_recv_header(handoff_fd, &header, &listeners)) {
+        close(handoff_fd);
+        return -1;
+    }
+    local_socket = listeners.local_fd;
+    route_socket = listeners.route_fd;
+    router_fd = listeners.router_fd;
+
+    next_player_id = header.next_player_id;
+    player_id_stride = header.player_id_stride;
+    // The old process closed its store before sending the header, so loading it now sees every session it stored.
+    open_session_store();
+
+    bool complete = true;
+    for (uint32_t i = 0; i < header.client_count; i++) {
+        snake_t snake;
+        bool joined;
+        uint32_t role;
+        int client_fd;
+        int ring_fds[2];
+        handoff_session_t session;
+        handoff_pending_t pending;
+        unsigned char *unsent;
+        if (handoff_recv_client(handoff_fd, &snake, &joined, &role, &session, &pending, &unsent, &client_fd,
+                                ring_fds)) {
+            log_error("take_over_server: Lost %d clients during hand off", header.client_count - i);
+            complete = false;
+            break;
+        }
+
+        client_t *client = pool_alloc(&client_pool);
+        if (client == NULL) {
+            log_error("take_over_server: No memory for player %d", snake.player_id);
+            free(unsent);
+            close(client_fd);
+            if (ring_fds[0] != -1) {
+                close(ring_fds[0]);
+                close(ring_fds[1]);
+            }
+            continue;
+        }
+        memset(client, 0, sizeof(client_t));
+        client->client_socket = client_fd;
+        set_nonblocking(client_fd);
+        if (ring_fds[0] != -1) {
+            // The ring carries on from wherever the old process left it.
+            client->ring = malloc(sizeof(ring_t));
+            if (client->ring == NULL || ring_attach(client->ring, ring_fds[0], ring_fds[1])) {
+                log_error("take_over_server: Could not map the ring of player %d", snake.player_id);
+                free(client->ring);
+                client->ring = NULL;
+                // The client would never hear from this process, so it is better off disconnected.
+                shutdown(client_fd, SHUT_RDWR);
+            }
+        }
+        client->player_id = snake.player_id;
+        client->joined = joined;
+        client->role = (client_role_t) role;
+        // A client still waiting for its snapshot is sent one once its shard adopts it, and the start of a message it
+        // was sending is finished by what it sends next.
+        client->awaiting_snapshot = pending.awaiting_snapshot != 0;
+        client->rx_used = pending.rx_used;
+        memcpy(client->rx_buffer, pending.rx_buffer, pending.rx_used);
+        // What the old process had not sent yet goes out first.
+        client->tx_buffer = unsent;
+        client->tx_used = pending.unsent_size;
+        client->tx_capacity = pending.unsent_size;
+        client->input_tokens = INPUT_BURST;
+        client->input_refill_ns = metrics_now();
+        link_init(&client->link, metrics_now());
+        // The session carries on, so the time already played counts too.
+        client->score = session.score;
+        client->joined_ns = metrics_now() - (uint64_t) session.play_time_ms * 1000000;
+        client->resume_token = session.resume_token;
+        start_client(client, &snake);
+
+        log_info("take_over_server: Took over player %d on fd [%d]", snake.player_id, client_fd);
+    }
+
+    checkpoint_player_t *orphans;
+    if (complete && header.orphan_count > 0 && handoff_recv_orphans(handoff_fd, header.orphan_count, &orphans) == 0) {
+        adopt_orphans(orphans, header.orphan_count);
+        log_info("take_over_server: %d recovered players can still resume", header.orphan_count);
+    }
+
+    char ack = 1;
+    ssend(handoff_fd, &ack, 1);
+    close(handoff_fd);
+
+    return listeners.listen_fd;
+}
+
+// Periodically copies the world under the lock and writes it to the checkpoint file outside of it.
+static void * checkpoint_clients(void *checkpoint_ptr) {
     sigset_t signal_mask;
     sigemptyset(&signal_mask);
     sigaddset(&signal_mask, SIGINT);
     pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
 
-    signal(SIGUSR1, client_signal_handler);
-
-    client_t *client = (client_t *) client_ptr;
+    checkpoint_t *checkpoint = (checkpoint_t *) checkpoint_ptr;
+    checkpoint_player_t *snakes = NULL;
+    uint32_t capacity = 0;
 
     while (running) {
-        log_debug("accept_client: Awaiting messages from [%d]", client->client_socket);
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        add_ms(&deadline, CHECKPOINT_INTERVAL_MS);
+        // Shutdown wakes this early rather than waiting out the interval.
+        lock_clients();
+        while (running && pthread_cond_timedwait(&checkpoint_wake, &clients_mutex, &deadline) != ETIMEDOUT) {
+        }
+        if (!running) {
+            pthread_mutex_unlock(&clients_mutex);
+            break;
+        }
 
-        message_t message_type;
-        void **message_ptr = malloc(sizeof(void *));
-        ssize_t read_amount = recv_message(client->client_socket, &message_type, message_ptr);
-        if (read_amount < 0) {
-            if (errno == EINTR) {
-                // Thread was interrupted by main thread. Continuing will check running to see if shutdown should occur.
-                // A signal handler may be necessary for this.
+        // Recovered players that have not come back yet are kept, so a second crash does not lose them.
+        uint32_t count = players.count + (orphaned_snakes ? g_hash_table_size(orphaned_snakes) : 0);
+        if (count > capacity) {
+            // The buffer only grows with the world, so steady state checkpoints do not allocate. Without the memory to
+            // grow it this checkpoint is skipped, and the previous one stays the newest on disk.
+            checkpoint_player_t *grown = realloc(snakes, sizeof(checkpoint_player_t) * count * 2);
+            if (grown == NULL) {
+                pthread_mutex_unlock(&clients_mutex);
+                log_error("checkpoint_clients: No memory to checkpoint %d snakes", count);
                 continue;
             }
-        } else if (read_amount == 0) {
-            log_info("accept_client: client [%d] disconnected", client->client_socket);
-            break;
+            snakes = grown;
+            capacity = count * 2;
         }
+        checkpoint_player_t *cursor = snakes;
+        for (uint32_t slot = 0; slot < players.end; slot++) {
+            // Bots are spawned afresh by each server, so there is nothing to restore them to.
+            client_t *client = (client_t *) players.owners[slot];
+            if (players.player_ids[slot] != 0 && !client->bot) {
+                cursor->snake = snake_at(slot);
+                cursor->resume_token = client->resume_token;
+                cursor++;
+            }
+        }
+        if (orphaned_snakes) {
+            g_hash_table_foreach(orphaned_snakes, collect_orphaned_snake, &cursor);
+        }
+        uint32_t player_id = next_player_id;
+        pthread_mutex_unlock(&clients_mutex);
 
-        if (message_type == MSG_CLIENT_KEYPRESS) {
-            msg_client_keypress *keypress_message = (msg_client_keypress *) *message_ptr;
+        checkpoint_write(checkpoint, player_id, snakes, (uint32_t) (cursor - snakes));
+    }
 
-            log_info("accept_client: Received keypress from [%d]: %d", client->client_socket, keypress_message->key_code);
+    free(snakes);
+    checkpoint_close(checkpoint);
+    return NULL;
+}
 
-            if (keypress_message->key_code == 27) {
-                log_info("accept_client: Client [%d] disconnected", client->client_socket);
-                break;
-            }
-            bool snake_changed = false;
-            switch (keypress_message->key_code) {
-                case KEY_UP:
-                    log_debug("accept_client: [%d] pressed up", client->client_socket);
-                    client->snake.y--;
-                    snake_changed = true;
-                    break;
-                case KEY_DOWN:
-                    log_debug("accept_client: [%d] pressed down", client->client_socket);
-                    client->snake.y++;
-                    snake_changed = true;
-                    break;
-                case KEY_LEFT:
-                    log_debug("accept_client: [%d] pressed left", client->client_socket);
-                    client->snake.x--;
-                    snake_changed = true;
-                    break;
-                case KEY_RIGHT:
-                    log_debug("accept_client: [%d] pressed right", client->client_socket);
-                    client->snake.x++;
-                    snake_changed = true;
-                    break;
-                default:
-                    break;
-            }
-            if (snake_changed) {
-                // Update the snake's position for each client.
-                pthread_mutex_lock(&clients_mutex);
-                g_slist_foreach(clients, (GFunc) update_snake, client);
-                pthread_mutex_unlock(&clients_mutex);
-            }
-        } else {
-            log_error("accept_client: Received unknown message type %d", message_type);
-        }
+static void sample_send_queue(client_t *client, int *totals) {
+    if (client->bot) {
+        totals[3]++;
+        return;
+    }
 
-        if (*message_ptr) {
-            free(*message_ptr);
+    int queued = unread_bytes(client);
+    if (queued >= 0) {
+        totals[0] += queued;
+        if (queued > totals[1]) {
+            totals[1] = queued;
         }
-        free(message_ptr);
     }
+    if (has_snake(client)) {
+        totals[2]++;
+    } else if (client->joined) {
+        totals[client->role == ROLE_RELAY ? 5 : 4]++;
+    }
+}
 
-    log_info("accept_client: Shutting down client [%d]", client->client_socket);
+static void sample_update_rate(client_t *client, FILE *out) {
+    if (has_snake(client) && !client->bot) {
+        fprintf(out, "csnake_client_update_hz{player=\"%u\",detail=\"%s\"} %d\n"
+                                  "csnake_client_rtt_seconds{player=\"%u\"} %g\n",
+                client->player_id, detail_level_name(client->link.detail),
+                1000 / TICK_MS / client->link.update_interval, client->player_id,
+                client->link.srtt_us / 1e6);
+    }
+}
 
-    pthread_mutex_lock(&clients_mutex);
-    // Remove the finished client from the global client list.
-    clients = g_slist_remove(clients, client);
-    // Inform remaining clients of this disconnect.
-    g_slist_foreach(clients, (GFunc) send_client_disconnect, client);
+// Gauges that are sampled from the player table when metrics are scraped.
+static void sample_clients(FILE *out) {
+    // Queued bytes, largest queue, joined players, bots, spectators and relays.
+    int totals[6] = {0, 0, 0, 0, 0, 0};
+
+    lock_clients();
+    guint connected = players.count;
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        if (players.owners[slot]) {
+            sample_send_queue((client_t *) players.owners[slot], totals);
+        }
+    }
+    fprintf(out, "# HELP csnake_client_update_hz Snapshot rate chosen for each client.\n"
+                 "# TYPE csnake_client_update_hz gauge\n# TYPE csnake_client_rtt_seconds gauge\n");
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        if (players.owners[slot]) {
+            sample_update_rate((client_t *) players.owners[slot], out);
+        }
+    }
     pthread_mutex_unlock(&clients_mutex);
 
-    close(client->client_socket);
-    free(client);
+    fprintf(out, "# TYPE csnake_clients_connected gauge\ncsnake_clients_connected %u\n", connected - totals[3]);
+    fprintf(out, "# TYPE csnake_bots gauge\ncsnake_bots %d\n", totals[3]);
+    fprintf(out, "# TYPE csnake_clients_joined gauge\ncsnake_clients_joined %d\n", totals[2]);
+    fprintf(out, "# HELP csnake_spectators Clients watching without a snake, directly or as a relay.\n"
+                 "# TYPE csnake_spectators gauge\ncsnake_spectators{kind=\"viewer\"} %d\n"
+                 "csnake_spectators{kind=\"relay\"} %d\n", totals[4], totals[5]);
+    fprintf(out, "# HELP csnake_send_queue_bytes Bytes waiting in client socket send buffers and rings.\n"
+                 "# TYPE csnake_send_queue_bytes gauge\ncsnake_send_queue_bytes %d\n", totals[0]);
+    fprintf(out, "# TYPE csnake_send_queue_max_bytes gauge\ncsnake_send_queue_max_bytes %d\n", totals[1]);
 
-    return NULL;
+    if (session_store) {
+        player_stats_t top[LEADERBOARD_METRICS_SIZE];
+        uint32_t count = store_top(session_store, top, LEADERBOARD_METRICS_SIZE);
+        fprintf(out, "# HELP csnake_leaderboard_best_score Best session score of the top players.\n"
+                     "# TYPE csnake_leaderboard_best_score gauge\n");
+        for (uint32_t i = 0; i < count; i++) {
+            fprintf(out, "csnake_leaderboard_best_score{rank=\"%u\",player=\"%u\"} %u\n", i + 1, top[i].player_id,
+                    top[i].best_score);
+        }
+    }
 }
 
-static void shutdown_client(gpointer data, gpointer dummy) {
-    client_t *client = (client_t *) data;
+// Loads the last checkpoint so returning players can resume their snakes.
+static void recover_world(const char *path) {
+    uint32_t snake_count;
+    checkpoint_player_t *recovered;
+    if (checkpoint_read(path, &next_player_id, &recovered, &snake_count)) {
+        log_error("recover_world: Starting with an empty world.");
+        return;
+    }
+
+    adopt_orphans(recovered, snake_count);
+}
+
+// Sets up a client for a newly accepted connection and hands it to a shard.
+static void accept_connection(int client_socket) {
+    client_t *client = pool_alloc(&client_pool);
+    if (client == NULL) {
+        log_error("accept_connection: No memory for client on fd [%d]", client_socket);
+        close(client_socket);
+        return;
+    }
+    // Slab memory is not zeroed, and most of a new client starts out as zero. The client gets its snake once its
+    // hello arrives.
+    memset(client, 0, sizeof(client_t));
+    client->client_socket = client_socket;
+    // Only the sender writes to the socket, and it never waits for room.
+    set_nonblocking(client_socket);
+    client->role = ROLE_PLAYER;
+    client->input_tokens = INPUT_BURST;
+    client->input_refill_ns = metrics_now();
+    link_init(&client->link, metrics_now());
+    metrics_count(COUNTER_CONNECTIONS_OPENED, 1);
 
-    log_info("shutdown_client: Disconnecting client [%d]", client->client_socket);
-    //pthread_kill(client->client_thread, SIGUSR1);
-    shutdown(client->client_socket, SHUT_RD);
+    // Hand the client to a shard and add it to the player table.
+    start_client(client, NULL);
 
-    // Main thread should wait until client shuts down.
-    pthread_join(client->client_thread, NULL);
+    struct sockaddr_storage client_address;
+    socklen_t client_length = sizeof(client_address);
+    if (getpeername(client_socket, (struct sockaddr *) &client_address, &client_length) == 0) {
+        if (client_address.ss_family == AF_UNIX) {
+            log_info("accept_connection: Accepted local connection on fd [%d]", client_socket);
+        } else {
+            log_info("accept_connection: Accepted connection from %s on fd [%d]",
+                     inet_ntoa(((struct sockaddr_in *) &client_address)->sin_addr), client_socket);
+        }
+    }
 }
 
-static void interrupt_handler(int dummy) {
-    log_info("interrupt_handler: SIGINT received. Shutting down server...");
-    running = false;
+// Gives this server its share of the player ids, as the backend with the given index out of count behind a router.
+// Ids already handed out stay as they are, so it only ever skips ahead.
+static void partition_player_ids(uint32_t index, uint32_t count) {
+    if (count == 0 || index >= count) {
+        log_error("partition_player_ids: Backend %d of %d makes no sense", index, count);
+        return;
+    }
+    lock_clients();
+    player_id_stride = count;
+    while ((next_player_id - 1) % count != index) {
+        next_player_id++;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    log_info("partition_player_ids: Serving as backend %d of %d from player %d on", index, count, next_player_id);
+}
 
-    log_debug("run_server: Copying client list");
-    pthread_mutex_lock(&clients_mutex);
-    GSList *clients_copy = g_slist_copy(clients);
+static void close_router() {
+    socket_loop_remove(server_loop, router_watch_id);
+    close(router_fd);
+    router_fd = -1;
+    router_watch_id = -1;
+}
+
+// Players this server has, which the router balances the backends by.
+static uint32_t count_players() {
+    uint32_t count = 0;
+    lock_clients();
+    for (uint32_t slot = 0; slot < players.end; slot++) {
+        client_t *client = (client_t *) players.owners[slot];
+        if (client && !client->bot && client->role == ROLE_PLAYER) {
+            count++;
+        }
+    }
     pthread_mutex_unlock(&clients_mutex);
+    return count;
+}
 
-    log_info("run_server: Attempting to shut down all clients");
-    // Shutdown the clients using a copy of the client list to avoid deadlock and potential other issues.
-    g_slist_foreach(clients_copy, shutdown_client, NULL);
+// Handles a message from the lobby router.
+static void handle_router() {
+    route_message_t message;
+    int client_fd;
+    if (route_recv(router_fd, &message, &client_fd)) {
+        log_info("handle_router: The router disconnected");
+        close_router();
+        return;
+    }
 
-    shutdown(server_socket, SHUT_RDWR);
+    if (message.type == ROUTE_HELLO) {
+        partition_player_ids(message.backend, message.value);
+    } else if (message.type == ROUTE_CLIENT && client_fd != -1) {
+        // The player's hello is still unread, so it goes through the same handshake as a player connecting directly.
+        accept_connection(client_fd);
+    } else if (message.type == ROUTE_LOAD_QUERY) {
+        if (route_send(router_fd, ROUTE_LOAD, 0, count_players(), -1)) {
+            log_error("handle_router: Could not tell the router the load");
+        }
+    } else {
+        log_error("handle_router: Unexpected message type %d from the router", message.type);
+        if (client_fd != -1) {
+            close(client_fd);
+        }
+    }
 }
 
-static void send_current_clients_to_new_client(client_t *connected_client, client_t *new_client) {
-    msg_snake_update message;
-    message.snake = connected_client->snake;
-    send_message(new_client->client_socket, MSG_SNAKE_UPDATE, &message);
+static void handle_server_socket(socket_event_t event, void *data, const unsigned char *bytes, ssize_t size,
+                                 void *handoff_fd_ptr) {
+    if (data == &router_fd) {
+        handle_router();
+    } else if (data == &route_socket) {
+        if (event != SOCKET_ACCEPTED || size < 0) {
+            return;
+        }
+        // A restarted router replaces the one before it.
+        if (router_fd != -1) {
+            log_info("handle_server_socket: A new router replaces the old one");
+            close_router();
+        }
+        router_fd = (int) size;
+        router_watch_id = socket_loop_poll(server_loop, router_fd, &router_fd);
+        log_info("handle_server_socket: A router connected on fd [%d]", router_fd);
+    } else if (data == &upgrade_socket) {
+        int handoff_fd = accept(upgrade_socket, NULL, NULL);
+        if (handoff_fd < 0) {
+            log_error("handle_server_socket: accept error on upgrade socket: %s", strerror(errno));
+            return;
+        }
+        *(int *) handoff_fd_ptr = handoff_fd;
+    } else if (event == SOCKET_ACCEPTED) {
+        if (size < 0) {
+            log_error("handle_server_socket: accept error: %s", strerror((int) -size));
+            return;
+        }
+        accept_connection((int) size);
+    } else if (event == SOCKET_CLOSED && running) {
+        log_error("handle_server_socket: The server socket failed: %s", strerror((int) -size));
+        running = false;
+    }
 }
 
 void run_server(char *host, unsigned short port_num) {
     signal(SIGINT, interrupt_handler);
+    // A client that goes away while being written to must only drop that client, not the server.
+    signal(SIGPIPE, SIG_IGN);
 
-    // Open a socket for listening.
-    server_socket = listen_socket(host, port_num);
+    pool_init(&client_pool, sizeof(client_t), CLIENTS_PER_SLAB);
+    player_table_init(&players);
+
+    // Timed waits count on the same clock as the tick schedule.
+    pthread_condattr_t wake_attributes;
+    pthread_condattr_init(&wake_attributes);
+    pthread_condattr_setclock(&wake_attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&simulation_wake, &wake_attributes);
+    pthread_cond_init(&checkpoint_wake, &wake_attributes);
+    pthread_condattr_destroy(&wake_attributes);
+    // The board is too small for bands on several threads to win back what their barriers cost each tick.
+    if (lockstep && lockstep_grid_init(&lockstep_grid, WIDTH, HEIGHT, 1)) {
+        log_error("run_server: Running without lockstep");
+        lockstep = false;
+    }
+    world_history_init(&world_history);
+
+    // Clients taken over from another server process go straight to the shards.
+    start_shards();
+
+    server_socket = -1;
+    if (upgrade_path) {
+        server_socket = take_over_server(upgrade_path);
+    }
+
+    // A server that took over from another one opened the store once the old one had closed it.
+    open_session_store();
+
+    // A server that took over from another one already has the live world.
+    if (recover_checkpoint && checkpoint_path && server_socket == -1) {
+        recover_world(checkpoint_path);
+    }
+
+    if (server_socket == -1) {
+        // Open a socket for listening.
+        server_socket = listen_socket(host, port_num);
+    }
 
     if (server_socket == -1) {
         log_error("run_server: Could not open server socket.");
+        running = false;
+        stop_shards();
+        if (session_store) {
+            store_close(session_store);
+        }
         return;
     }
 
-    struct sockaddr_in client_address;
-    socklen_t client_length = sizeof(client_address);
+    if (local_socket != -1 && local_path == NULL) {
+        log_info("run_server: Closing the unix listening socket taken over, as no local path was given.");
+        close(local_socket);
+        local_socket = -1;
+    } else if (local_path && local_socket == -1) {
+        local_socket = listen_unix_socket(local_path);
+    }
 
-    while (running) {
+    if (upgrade_path) {
+        // Listen for the next server process that wants to take over from this one.
+        upgrade_socket = listen_unix_socket(upgrade_path);
+    }
+
+    if (route_socket != -1 && route_path == NULL) {
+        log_info("run_server: Leaving the router taken over, as no route path was given.");
+        close(route_socket);
+        route_socket = -1;
+        if (router_fd != -1) {
+            close(router_fd);
+            router_fd = -1;
+        }
+        player_id_stride = 1;
+    } else if (route_path && route_socket == -1) {
+        route_socket = listen_unix_socket(route_path);
+    }
+
+    if (metrics_path) {
+        metrics_set_sampler(sample_clients);
+        metrics_start(metrics_path);
+    }
+
+    srand((unsigned int) time(NULL));
+    spawn_bots();
+
+    pthread_create(&simulation_thread, NULL, simulate, NULL);
+
+    bool checkpointing = false;
+    if (checkpoint_path) {
+        checkpoint_t *checkpoint = checkpoint_open(checkpoint_path);
+        if (checkpoint) {
+            pthread_create(&checkpoint_thread, NULL, checkpoint_clients, checkpoint);
+            checkpointing = true;
+        }
+    }
+
+    socket_loop_t *loop = socket_loop_new(use_io_uring);
+    server_loop = loop;
+    int accept_id = socket_loop_accept(loop, server_socket, &server_socket);
+    int local_accept_id = -1;
+    if (local_socket != -1) {
+        local_accept_id = socket_loop_accept(loop, local_socket, &local_socket);
+    }
+    int route_accept_id = -1;
+    if (route_socket != -1) {
+        route_accept_id = socket_loop_accept(loop, route_socket, &route_socket);
+    }
+    if (router_fd != -1) {
+        // The router of the server this one took over from carries on with this one.
+        router_watch_id = socket_loop_poll(loop, router_fd, &router_fd);
+    }
+    if (upgrade_socket != -1) {
+        socket_loop_poll(loop, upgrade_socket, &upgrade_socket);
+    }
+
+    int handoff_fd = -1;
+    while (running && handoff_fd == -1) {
         log_debug("run_server: Awaiting connections");
-        // Block until client connection received.
-        int client_socket = accept(server_socket, (struct sockaddr *) &client_address, &client_length);
-        if (client_socket < 0) {
-            log_error("run_server: accept error: %s", strerror(errno));
-            continue;
+        // Block until a client connects or a new server process asks to take over.
+        if (socket_loop_wait(loop, handle_server_socket, &handoff_fd) < 0 && errno != EINTR) {
+            log_error("run_server: Could not wait for connections: %s", strerror(errno));
         }
+    }
 
-        // Initialize client struct.
-        client_t *client = malloc(sizeof(client_t));
-        client->client_socket = client_socket;
-        client->snake.player_id = (uint32_t) client_socket;
-        client->snake.x = WIDTH / 2;
-        client->snake.y = HEIGHT / 2;
-
-        // Run the client thread and track the thread in the client struct
-        pthread_t client_thread;
-        pthread_create(&client_thread, NULL, accept_client, client);
-        client->client_thread = client_thread;
-
-        pthread_mutex_lock(&clients_mutex);
-        // Send the existing players' data to the new player.
-        g_slist_foreach(clients, (GFunc) send_current_clients_to_new_client, client);
-        // Add the client to the global client list.
-        clients = g_slist_append(clients, client);
-        // Send the new player's data to the existing players. This sends the client's data to itself as well, so that
-        // the client can know it's own starting position.
-        g_slist_foreach(clients, (GFunc) update_snake, client);
-        pthread_mutex_unlock(&clients_mutex);
+    // Accepting stops before the listening socket is handed off, so no connection is taken by this process after.
+    socket_loop_remove(loop, accept_id);
+    if (local_accept_id != -1) {
+        socket_loop_remove(loop, local_accept_id);
+    }
+    if (route_accept_id != -1) {
+        socket_loop_remove(loop, route_accept_id);
+    }
+    if (router_fd != -1) {
+        // Nothing more is read from the router, so a hand off can pass its connection on mid-stream.
+        socket_loop_remove(loop, router_watch_id);
+    }
+    socket_loop_free(loop);
+    server_loop = NULL;
 
-        log_info("run_server: Accepted connection from %s on fd [%d]", inet_ntoa(client_address.sin_addr),
-                 client_socket);
+    if (handoff_fd != -1) {
+        hand_off_server(handoff_fd);
+        close(handoff_fd);
     }
 
+    // When handing off this only closes this process's reference to the listening sockets.
     close(server_socket);
 
-    log_info("run_server: Server shutdown complete.");
+    if (local_socket != -1) {
+        close(local_socket);
+        if (!upgrading) {
+            unlink(local_path);
+        }
+    }
+
+    if (router_fd != -1) {
+        close(router_fd);
+    }
+    if (route_socket != -1) {
+        close(route_socket);
+        if (!upgrading) {
+            unlink(route_path);
+        }
+    }
+
+    if (upgrade_socket != -1) {
+        close(upgrade_socket);
+        if (!upgrading) {
+            // After a hand off the path belongs to the new server process.
+            unlink(upgrade_path);
+        }
+    }
+
+    if (!upgrading) {
+        // A hand off already stopped the simulation and the shards.
+        stop_simulation();
+        stop_shards();
+        remove_bots();
+    }
+
+    if (checkpointing) {
+        lock_clients();
+        pthread_cond_signal(&checkpoint_wake);
+        pthread_mutex_unlock(&clients_mutex);
+        pthread_join(checkpoint_thread, NULL);
+    }
+
+    metrics_stop();
+
+    // Every shard has stopped, so no more sessions can end.
+    if (session_store) {
+        store_close(session_store);
+        session_store = NULL;
+    }
+
+    pool_destroy(&client_pool);
+    player_table_destroy(&players);
+    if (lockstep) {
+        lockstep_grid_destroy(&lockstep_grid);
+    }
+
+    free(tick_inputs);
+    free(tick_moved);
+
+    if (latest_copy) {
+        world_copy_unref(latest_copy);
+        latest_copy = NULL;
+    }
+
+    if (orphaned_snakes) {
+        g_hash_table_destroy(orphaned_snakes);
+        free(recovered_snakes);
+    }
+
+    if (upgrading) {
+        log_info("run_server: Hand off complete.");
+    } else {
+        log_info("run_server: Server shutdown complete.");
+    }
 }
@@ -5,6 +5,59 @@
 #ifndef CSNAKE_SERVER_H
 #define CSNAKE_SERVER_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// Enables hot upgrades through a unix socket at the given path. A server started with a path that another server is
+// already listening on takes over that server's listening socket and clients instead of opening its own.
+void server_set_upgrade_path(char *path);
+
+// Serves live metrics in the Prometheus text format on a unix socket at the given path.
+void server_set_metrics_path(char *path);
+
+// Records every finished session in an append-only store at the given path, for the leaderboard.
+void server_set_store_path(char *path);
+
+// Periodically writes the world to a memory mapped checkpoint file at the given path.
+void server_set_checkpoint_path(char *path);
+// Restores the world from the checkpoint file on startup, so reconnecting players get their snakes back.
+void server_set_recover(bool recover);
+
+// Number of worker threads the clients are spread over. Defaults to one per core.
+void server_set_worker_count(int count);
+
+// Number of threads that encode each tick's messages while the next tick is simulated. A single sender thread writes
+// them out. Defaults to 1.
+void server_set_encoder_count(int count);
+
+// Uses io_uring for client sockets where the kernel supports it, falling back to poll otherwise.
+void server_set_io_uring(bool enabled);
+
+// Adds bots that chase the players, or roam together when nobody is playing.
+void server_set_bot_count(uint32_t count);
+
+// Also accepts clients on a unix socket at the given path. Clients connected there may ask for a shared memory ring.
+void server_set_local_path(char *path);
+
+// Accepts players passed on by a lobby router through a unix socket at the given path. The router decides which of
+// its backends hands out which player ids, so they stay unique across its rooms.
+void server_set_route_path(char *path);
+
+// How far back in time a player's input may be judged, to make up for the player's round trip. Defaults to 150 ms.
+void server_set_rewind_limit(uint32_t limit_ms);
+
+// Disconnects clients that send nothing for this long, which catches connections whose other end vanished without
+// closing them. Joined clients answer a ping every second. Defaults to 10 seconds, or never if 0.
+void server_set_idle_timeout(uint32_t timeout_ms);
+
+// Sends players the inputs of each tick instead of the snakes that moved, for them to move the snakes themselves.
+// Spectators are still sent positions.
+void server_set_lockstep(bool enabled);
+
+// Has the simulation sleep through ticks while nothing moves and nothing is waiting to be sent, waking for input, for
+// clients that join and for pings, so an idle server uses next to no CPU.
+void server_set_idle_sleep(bool enabled);
+
 void run_server(char *host, unsigned short port_num);
 
 #endif //CSNAKE_SERVER_H
@@ -0,0 +1,47 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stdlib.h>
+
+#include "snapshot.h"
+#include "messages.h"
+
+world_copy_t * world_copy_new(uint64_t tick, uint32_t capacity) {
+    world_copy_t *copy = malloc(sizeof(world_copy_t));
+    copy->refcount = 1;
+    copy->tick = tick;
+    copy->snake_count = 0;
+    copy->snakes = malloc(sizeof(snake_t) * (capacity ? capacity : 1));
+    pthread_mutex_init(&copy->encode_mutex, NULL);
+    copy->encoded = NULL;
+    copy->encoded_size = 0;
+    return copy;
+}
+
+world_copy_t * world_copy_ref(world_copy_t *copy) {
+    __atomic_fetch_add(&copy->refcount, 1, __ATOMIC_RELAXED);
+    return copy;
+}
+
+void world_copy_unref(world_copy_t *copy) {
+    if (__atomic_sub_fetch(&copy->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    pthread_mutex_destroy(&copy->encode_mutex);
+    free(copy->encoded);
+    free(copy->snakes);
+    free(copy);
+}
+
+const unsigned char * world_copy_encode(world_copy_t *copy, size_t *size) {
+    pthread_mutex_lock(&copy->encode_mutex);
+    if (copy->encoded == NULL) {
+        copy->encoded = serialize_world_snapshot(copy->snakes, copy->snake_count, &copy->encoded_size);
+    }
+    pthread_mutex_unlock(&copy->encode_mutex);
+
+    *size = copy->encoded_size;
+    return copy->encoded;
+}
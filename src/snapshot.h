@@ -0,0 +1,37 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_SNAPSHOT_H
+#define CSNAKE_SNAPSHOT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "snake.h"
+
+//
+// Immutable copy of the world taken at the end of a tick. New players are sent their join snapshot from a copy, so
+// encoding and writing it never happens under clients_mutex. Copies are reference counted and the compressed message
+// is built once per copy, however many clients it is sent to.
+//
+
+typedef struct {
+    int refcount;
+    uint64_t tick; // Tick the copy is valid for. May be moved forward under clients_mutex if nothing changed.
+    uint32_t snake_count;
+    snake_t *snakes;
+    pthread_mutex_t encode_mutex;
+    unsigned char *encoded;
+    size_t encoded_size;
+} world_copy_t;
+
+// Creates a copy with room for the given number of snakes and a reference count of 1.
+world_copy_t * world_copy_new(uint64_t tick, uint32_t capacity);
+world_copy_t * world_copy_ref(world_copy_t *copy);
+void world_copy_unref(world_copy_t *copy);
+// Returns the copy as a serialized MSG_WORLD_SNAPSHOT, encoding it on first use, or NULL if there is no memory to
+// encode it.
+const unsigned char * world_copy_encode(world_copy_t *copy, size_t *size);
+
+#endif //CSNAKE_SNAPSHOT_H
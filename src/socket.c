@@ -4,13 +4,16 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
+#include "common.h"
 #include "log.h"
 #include "socket.h"
 
@@ -138,6 +141,191 @@ int listen_socket(const char *host, unsigned short port_num) {
     return -1;
 }
 
+static int configure_unix_address(struct sockaddr_un *address, const char *path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        log_error("configure_unix_address: path too long: %s", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int connect_unix_socket(const char *path) {
+    assert(path != NULL);
+
+    struct sockaddr_un address;
+    if (configure_unix_address(&address, path)) {
+        return -1;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        log_error("connect_unix_socket: socket error: %s", strerror(errno));
+        return -1;
+    }
+
+    if (connect(socket_fd, (struct sockaddr *) &address, sizeof(address))) {
+        log_debug("connect_unix_socket: Could not connect to %s: %s", path, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+int listen_unix_socket(const char *path) {
+    assert(path != NULL);
+
+    log_info("listen_unix_socket: attempting to listen on %s", path);
+
+    struct sockaddr_un address;
+    if (configure_unix_address(&address, path)) {
+        return -1;
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        log_error("listen_unix_socket: socket error: %s", strerror(errno));
+        return -1;
+    }
+
+    // A stale socket file from a previous process would make bind fail.
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address))) {
+        log_error("listen_unix_socket: bind error: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    if (listen(listen_fd, 1024)) {
+        log_error("listen_unix_socket: listen error: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    log_info("listen_unix_socket: listening on fd [%d]", listen_fd);
+    return listen_fd;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_error("set_nonblocking: fcntl error on fd [%d]: %s", fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t send_fds(int fd, void *message, size_t size, const int *fds, int fd_count) {
+    assert(fd_count >= 0 && fd_count <= MAX_PASSED_FDS);
+
+    struct iovec iov;
+    iov.iov_base = message;
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+
+    if (fd_count > 0) {
+        header.msg_control = control;
+        header.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+        struct cmsghdr *control_header = CMSG_FIRSTHDR(&header);
+        control_header->cmsg_level = SOL_SOCKET;
+        control_header->cmsg_type = SCM_RIGHTS;
+        control_header->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(control_header), fds, sizeof(int) * fd_count);
+    }
+
+    ssize_t written_amount;
+    do {
+        written_amount = sendmsg(fd, &header, MSG_NOSIGNAL);
+    } while (written_amount < 0 && errno == EINTR);
+
+    if (written_amount < 0) {
+        log_error("send_fds: sendmsg error: %s", strerror(errno));
+        return written_amount;
+    }
+
+    // The descriptors went out with the first byte, so any remainder is plain data.
+    if ((size_t) written_amount < size) {
+        ssize_t rest = ssend(fd, (char *) message + written_amount, size - written_amount);
+        if (rest <= 0) {
+            return rest;
+        }
+    }
+
+    return size;
+}
+
+ssize_t recv_some_fds(int fd, void *buffer, size_t size, int *fds, int *fd_count) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+
+    ssize_t read_amount;
+    do {
+        read_amount = recvmsg(fd, &header, MSG_CMSG_CLOEXEC);
+    } while (read_amount < 0 && errno == EINTR);
+
+    if (read_amount <= 0) {
+        if (read_amount < 0) {
+            log_error("recv_some_fds: recvmsg error: %s", strerror(errno));
+        }
+        return read_amount;
+    }
+
+    *fd_count = 0;
+    struct cmsghdr *control_header;
+    for (control_header = CMSG_FIRSTHDR(&header); control_header != NULL;
+         control_header = CMSG_NXTHDR(&header, control_header)) {
+        if (control_header->cmsg_level == SOL_SOCKET && control_header->cmsg_type == SCM_RIGHTS) {
+            int count = (int) ((control_header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds + *fd_count, CMSG_DATA(control_header), sizeof(int) * count);
+            *fd_count += count;
+        }
+    }
+
+    if (header.msg_flags & MSG_CTRUNC) {
+        log_error("recv_some_fds: control data was truncated, some descriptors were lost");
+    }
+
+    return read_amount;
+}
+
+ssize_t recv_fds(int fd, void *buffer, size_t size, int *fds, int *fd_count) {
+    ssize_t read_amount = recv_some_fds(fd, buffer, size, fds, fd_count);
+    if (read_amount <= 0) {
+        return read_amount;
+    }
+
+    if ((size_t) read_amount < size) {
+        ssize_t rest = srecv(fd, (char *) buffer + read_amount, size - read_amount);
+        if (rest <= 0) {
+            return rest;
+        }
+    }
+
+    return size;
+}
+
 static char * string_to_hex(const char * string, size_t size) {
     char *result = malloc(size * 2 + 1);
     char *buffer = result;
@@ -153,9 +341,11 @@ ssize_t ssend(int fd, void *message, size_t size) {
     size_t left = size;
     ssize_t written_amount;
 
-    char *hex = string_to_hex(message, size);
-    log_debug("ssend: Sending hex data: %s", hex);
-    free(hex);
+    if (DEBUG) {
+        char *hex = string_to_hex(message, size);
+        log_debug("ssend: Sending hex data: %s", hex);
+        free(hex);
+    }
 
     do {
         log_debug("ssend: Sending %d bytes", left);
@@ -182,8 +372,15 @@ ssize_t srecv(int fd, void *buffer, size_t size) {
         log_debug("srecv: Reading %d bytes", left);
 
         read_amount = read(fd, read_buffer, left);
-        if (read_amount < 0) {
-            log_error("srecv: read error: %s", strerror(errno));
+        if (read_amount < 0 && errno == EINTR && left < size) {
+            // Part of the data was already consumed, so give up only once the whole buffer is read.
+            continue;
+        } else if (read_amount < 0) {
+            if (errno == EINTR) {
+                log_debug("srecv: read interrupted");
+            } else {
+                log_error("srecv: read error: %s", strerror(errno));
+            }
             return read_amount;
         } else if (read_amount == 0) {
             return read_amount;
@@ -193,9 +390,11 @@ ssize_t srecv(int fd, void *buffer, size_t size) {
         }
     } while (left > 0);
 
-    char *hex = string_to_hex(buffer, size);
-    log_debug("srecv: Received hex data: %s", hex);
-    free(hex);
+    if (DEBUG) {
+        char *hex = string_to_hex(buffer, size);
+        log_debug("srecv: Received hex data: %s", hex);
+        free(hex);
+    }
 
     return size;
 }
\ No newline at end of file
@@ -5,10 +5,81 @@
 #ifndef CSNAKE_SOCKET_H
 #define CSNAKE_SOCKET_H
 
+#include <stdbool.h>
+#include <sys/types.h>
+
+// The most descriptors send_fds and recv_fds will move in one call.
+#define MAX_PASSED_FDS 16
+
 int connect_socket(const char *host, unsigned short port_num);
 int listen_socket(const char *host, unsigned short port_num);
 
+int connect_unix_socket(const char *path);
+int listen_unix_socket(const char *path);
+
+// Makes writes to the socket return instead of waiting for room. Returns 0 on success or -1 otherwise.
+int set_nonblocking(int fd);
+
 ssize_t ssend(int fd, void *message, size_t size);
 ssize_t srecv(int fd, void *buffer, size_t size);
 
+// Like ssend/srecv, but also pass open file descriptors over a unix socket using SCM_RIGHTS.
+ssize_t send_fds(int fd, void *message, size_t size, const int *fds, int fd_count);
+ssize_t recv_fds(int fd, void *buffer, size_t size, int *fds, int *fd_count);
+// Like recv_fds, but returns after a single read with whatever had arrived.
+ssize_t recv_some_fds(int fd, void *buffer, size_t size, int *fds, int *fd_count);
+
+//
+// Event loop over a set of sockets for the server. It runs on io_uring where the kernel supports it, with multishot
+// accept and receive into provided buffers, and falls back to poll otherwise. A loop belongs to a single thread.
+//
+
+typedef enum {
+    SOCKET_DATA, // Bytes arrived on a socket added with socket_loop_recv.
+    SOCKET_CLOSED, // The peer closed the socket, or size is a negative errno. It is no longer watched after this.
+    SOCKET_ACCEPTED, // A listening socket accepted a connection. size is the new fd, or a negative errno.
+    SOCKET_READY, // A socket added with socket_loop_poll can be read.
+    SOCKET_DETACHED // A socket given to socket_loop_detach is no longer watched.
+} socket_event_t;
+
+typedef void (*socket_handler_t)(socket_event_t event, void *data, const unsigned char *bytes, ssize_t size,
+                                 void *context);
+
+typedef struct socket_loop socket_loop_t;
+
+socket_loop_t * socket_loop_new(bool use_uring);
+void socket_loop_free(socket_loop_t *loop);
+bool socket_loop_uses_uring(socket_loop_t *loop);
+// Each returns an id for socket_loop_remove, or -1. The data pointer is passed back with every event.
+int socket_loop_recv(socket_loop_t *loop, int fd, void *data);
+int socket_loop_accept(socket_loop_t *loop, int fd, void *data);
+int socket_loop_poll(socket_loop_t *loop, int fd, void *data);
+// Stops watching a socket. Safe to call from a handler; no more events are delivered for it.
+void socket_loop_remove(socket_loop_t *loop, int id);
+// Stops watching a socket that is moving to another loop, without losing bytes already taken from it. Returns true if
+// that happened right away. Otherwise SOCKET_DATA may still arrive until a SOCKET_DETACHED says it is done.
+bool socket_loop_detach(socket_loop_t *loop, int id);
+// Waits for events and hands each to the handler. Returns -1 if interrupted by a signal or on error.
+int socket_loop_wait(socket_loop_t *loop, socket_handler_t handler, void *context);
+
+//
+// Writes a batch of buffers to their sockets without waiting for room in them. With io_uring the whole batch goes to
+// the kernel in one system call.
+//
+
+typedef struct {
+    int fd;
+    const void *buffer;
+    size_t size;
+    ssize_t result; // Set by socket_writer_write to the bytes written, which may be fewer than size, or -1.
+} socket_write_t;
+
+typedef struct socket_writer socket_writer_t;
+
+socket_writer_t * socket_writer_new(bool use_uring);
+void socket_writer_free(socket_writer_t *writer);
+// Writes as much of every buffer as its socket has room for. The writes of a batch are not ordered, so a socket must
+// not appear in a batch more than once.
+void socket_writer_write(socket_writer_t *writer, socket_write_t *writes, int count);
+
 #endif //CSNAKE_SOCKET_H
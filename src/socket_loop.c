@@ -0,0 +1,509 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "socket.h"
+#include "uring.h"
+
+#define LOOP_RING_ENTRIES 256
+// Receive buffers shared by every socket of a loop. The count must be a power of two.
+#define LOOP_BUFFER_COUNT 256
+#define LOOP_BUFFER_SIZE 2048
+#define LOOP_BUFFER_GROUP 0
+#define WRITER_RING_ENTRIES 256
+
+// Completions of cancel requests carry this instead of a watch.
+#define CANCEL_USER_DATA UINT64_MAX
+
+typedef enum {
+    WATCH_FREE,
+    WATCH_RECV,
+    WATCH_ACCEPT,
+    WATCH_POLL
+} watch_kind_t;
+
+typedef struct {
+    watch_kind_t kind;
+    int fd;
+    void *data;
+    // Bumped when the watch is removed, so completions still in flight for an old watch are told apart.
+    uint32_t generation;
+    bool detaching; // Cancelled, but still delivering what was received until the kernel lets go.
+} watch_t;
+
+struct socket_loop {
+    bool use_uring;
+    watch_t *watches;
+    int capacity;
+    int *free_ids;
+    int free_count;
+
+    uring_t ring;
+    uring_buffers_t buffers;
+
+    // Only used by the poll backend. They grow with the watches, so a steady loop waits without allocating.
+    struct pollfd *pollfds;
+    int *poll_ids;
+    int poll_capacity;
+    unsigned char recv_buffer[LOOP_BUFFER_SIZE];
+};
+
+struct socket_writer {
+    bool use_uring;
+    uring_t ring;
+};
+
+socket_loop_t * socket_loop_new(bool use_uring) {
+    socket_loop_t *loop = calloc(1, sizeof(socket_loop_t));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    if (use_uring && uring_init(&loop->ring, LOOP_RING_ENTRIES) == 0) {
+        if (uring_buffers_init(&loop->ring, &loop->buffers, LOOP_BUFFER_GROUP, LOOP_BUFFER_COUNT,
+                               LOOP_BUFFER_SIZE) == 0) {
+            loop->use_uring = true;
+        } else {
+            uring_exit(&loop->ring);
+        }
+    }
+    if (use_uring && !loop->use_uring) {
+        log_info("socket_loop_new: Falling back to poll");
+    }
+    return loop;
+}
+
+void socket_loop_free(socket_loop_t *loop) {
+    if (loop->use_uring) {
+        uring_buffers_destroy(&loop->ring, &loop->buffers);
+        uring_exit(&loop->ring);
+    }
+    free(loop->watches);
+    free(loop->free_ids);
+    free(loop->pollfds);
+    free(loop->poll_ids);
+    free(loop);
+}
+
+bool socket_loop_uses_uring(socket_loop_t *loop) {
+    return loop->use_uring;
+}
+
+static uint64_t watch_user_data(socket_loop_t *loop, int id) {
+    return ((uint64_t) loop->watches[id].generation << 32) | (uint32_t) id;
+}
+
+// Starts the multishot request behind a watch. It stays armed until it completes without IORING_CQE_F_MORE.
+static void arm_watch(socket_loop_t *loop, int id) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe == NULL) {
+        log_error("arm_watch: Submission queue is full");
+        return;
+    }
+
+    watch_t *watch = &loop->watches[id];
+    sqe->fd = watch->fd;
+    sqe->user_data = watch_user_data(loop, id);
+    switch (watch->kind) {
+        case WATCH_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = LOOP_BUFFER_GROUP;
+            break;
+        case WATCH_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            break;
+        case WATCH_POLL:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = POLLIN;
+            break;
+        default:
+            break;
+    }
+}
+
+static int add_watch(socket_loop_t *loop, watch_kind_t kind, int fd, void *data) {
+    int id;
+    if (loop->free_count > 0) {
+        id = loop->free_ids[--loop->free_count];
+    } else {
+        int capacity = loop->capacity ? loop->capacity * 2 : 16;
+        watch_t *watches = realloc(loop->watches, sizeof(watch_t) * capacity);
+        if (watches == NULL) {
+            log_error("add_watch: No memory to watch fd [%d]", fd);
+            return -1;
+        }
+        loop->watches = watches;
+        int *free_ids = realloc(loop->free_ids, sizeof(int) * capacity);
+        if (free_ids == NULL) {
+            log_error("add_watch: No memory to watch fd [%d]", fd);
+            return -1;
+        }
+        loop->free_ids = free_ids;
+        for (int i = capacity - 1; i > loop->capacity; i--) {
+            loop->watches[i].kind = WATCH_FREE;
+            loop->watches[i].generation = 0;
+            loop->free_ids[loop->free_count++] = i;
+        }
+        id = loop->capacity;
+        loop->watches[id].generation = 0;
+        loop->capacity = capacity;
+    }
+
+    loop->watches[id].kind = kind;
+    loop->watches[id].detaching = false;
+    loop->watches[id].fd = fd;
+    loop->watches[id].data = data;
+    if (loop->use_uring) {
+        arm_watch(loop, id);
+    }
+    return id;
+}
+
+int socket_loop_recv(socket_loop_t *loop, int fd, void *data) {
+    return add_watch(loop, WATCH_RECV, fd, data);
+}
+
+int socket_loop_accept(socket_loop_t *loop, int fd, void *data) {
+    return add_watch(loop, WATCH_ACCEPT, fd, data);
+}
+
+int socket_loop_poll(socket_loop_t *loop, int fd, void *data) {
+    return add_watch(loop, WATCH_POLL, fd, data);
+}
+
+static void cancel_watch(socket_loop_t *loop, int id) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = watch_user_data(loop, id);
+        sqe->user_data = CANCEL_USER_DATA;
+    }
+}
+
+static void free_watch(socket_loop_t *loop, int id) {
+    loop->watches[id].kind = WATCH_FREE;
+    loop->watches[id].generation++;
+    loop->free_ids[loop->free_count++] = id;
+}
+
+void socket_loop_remove(socket_loop_t *loop, int id) {
+    if (id < 0 || id >= loop->capacity || loop->watches[id].kind == WATCH_FREE) {
+        return;
+    }
+
+    // The request holds a reference to the socket, so it has to be cancelled for a close to take effect. A detaching
+    // watch already was.
+    if (loop->use_uring && !loop->watches[id].detaching) {
+        cancel_watch(loop, id);
+    }
+    free_watch(loop, id);
+}
+
+bool socket_loop_detach(socket_loop_t *loop, int id) {
+    if (!loop->use_uring) {
+        // Nothing is read ahead of the handler, so whatever was not delivered yet is still in the socket.
+        socket_loop_remove(loop, id);
+        return true;
+    }
+
+    cancel_watch(loop, id);
+    loop->watches[id].detaching = true;
+    return false;
+}
+
+// Delivers a close and stops watching the socket, unless the handler already did.
+static void close_watch(socket_loop_t *loop, int id, ssize_t error, socket_handler_t handler, void *context) {
+    uint32_t generation = loop->watches[id].generation;
+    handler(SOCKET_CLOSED, loop->watches[id].data, NULL, error, context);
+    if (loop->watches[id].generation == generation) {
+        socket_loop_remove(loop, id);
+    }
+}
+
+static bool is_watched(socket_loop_t *loop, int id, uint32_t generation) {
+    return id < loop->capacity && loop->watches[id].kind != WATCH_FREE && loop->watches[id].generation == generation;
+}
+
+static void handle_completion(socket_loop_t *loop, uint64_t user_data, int32_t res, uint32_t flags,
+                              socket_handler_t handler, void *context) {
+    int id = (int) (uint32_t) user_data;
+    uint32_t generation = (uint32_t) (user_data >> 32);
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        uint16_t buffer_id = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+        if (res > 0 && is_watched(loop, id, generation)) {
+            handler(SOCKET_DATA, loop->watches[id].data, uring_buffer(&loop->buffers, buffer_id), res, context);
+        }
+        uring_buffer_return(&loop->buffers, buffer_id);
+    }
+
+    if (!is_watched(loop, id, generation)) {
+        return;
+    }
+
+    watch_t *watch = &loop->watches[id];
+    if (watch->detaching) {
+        if (res == 0) {
+            close_watch(loop, id, 0, handler, context);
+        } else if (!(flags & IORING_CQE_F_MORE)) {
+            // The last completion of the cancelled request, so nothing more was taken from the socket.
+            void *data = watch->data;
+            free_watch(loop, id);
+            handler(SOCKET_DETACHED, data, NULL, 0, context);
+        }
+        return;
+    }
+
+    switch (watch->kind) {
+        case WATCH_RECV:
+            if (res == 0) {
+                close_watch(loop, id, 0, handler, context);
+                return;
+            } else if (res < 0 && res != -ENOBUFS) {
+                close_watch(loop, id, res, handler, context);
+                return;
+            }
+            // Out of buffers ends the request, which is simply started again once some are back.
+            break;
+        case WATCH_ACCEPT:
+            if (res == -EINVAL || res == -EBADF) {
+                // The listening socket was shut down.
+                close_watch(loop, id, res, handler, context);
+                return;
+            }
+            handler(SOCKET_ACCEPTED, watch->data, NULL, res, context);
+            break;
+        case WATCH_POLL:
+            if (res < 0) {
+                close_watch(loop, id, res, handler, context);
+                return;
+            }
+            handler(SOCKET_READY, watch->data, NULL, res, context);
+            break;
+        default:
+            break;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE) && is_watched(loop, id, generation)) {
+        arm_watch(loop, id);
+    }
+}
+
+static int uring_wait(socket_loop_t *loop, socket_handler_t handler, void *context) {
+    if (uring_submit(&loop->ring, 1) < 0) {
+        return -1;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+        // The entry is released first, since the handler may queue new requests.
+        uint64_t user_data = cqe->user_data;
+        int32_t res = cqe->res;
+        uint32_t flags = cqe->flags;
+        uring_cqe_seen(&loop->ring);
+
+        if (user_data != CANCEL_USER_DATA) {
+            handle_completion(loop, user_data, res, flags, handler, context);
+        }
+    }
+    return 0;
+}
+
+// Reads everything a ready socket has without blocking.
+static void poll_recv(socket_loop_t *loop, int id, socket_handler_t handler, void *context) {
+    uint32_t generation = loop->watches[id].generation;
+    while (is_watched(loop, id, generation)) {
+        ssize_t read_amount = recv(loop->watches[id].fd, loop->recv_buffer, sizeof(loop->recv_buffer),
+                                   MSG_DONTWAIT);
+        if (read_amount > 0) {
+            handler(SOCKET_DATA, loop->watches[id].data, loop->recv_buffer, read_amount, context);
+        } else if (read_amount == 0) {
+            close_watch(loop, id, 0, handler, context);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            close_watch(loop, id, -errno, handler, context);
+        }
+    }
+}
+
+static int poll_wait(socket_loop_t *loop, socket_handler_t handler, void *context) {
+    if (loop->capacity > loop->poll_capacity) {
+        struct pollfd *pollfds = realloc(loop->pollfds, sizeof(struct pollfd) * loop->capacity);
+        if (pollfds == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        loop->pollfds = pollfds;
+        int *poll_ids = realloc(loop->poll_ids, sizeof(int) * loop->capacity);
+        if (poll_ids == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        loop->poll_ids = poll_ids;
+        loop->poll_capacity = loop->capacity;
+    }
+
+    int count = 0;
+    for (int id = 0; id < loop->capacity; id++) {
+        if (loop->watches[id].kind != WATCH_FREE) {
+            loop->pollfds[count].fd = loop->watches[id].fd;
+            loop->pollfds[count].events = POLLIN;
+            loop->poll_ids[count] = id;
+            count++;
+        }
+    }
+
+    if (poll(loop->pollfds, (nfds_t) count, -1) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int id = loop->poll_ids[i];
+        short revents = loop->pollfds[i].revents;
+        // Watches removed, or replaced, by an earlier handler are skipped.
+        if (revents == 0 || loop->watches[id].kind == WATCH_FREE || loop->watches[id].fd != loop->pollfds[i].fd) {
+            continue;
+        }
+
+        if (revents & POLLNVAL) {
+            close_watch(loop, id, -EBADF, handler, context);
+            continue;
+        }
+
+        switch (loop->watches[id].kind) {
+            case WATCH_RECV:
+                poll_recv(loop, id, handler, context);
+                break;
+            case WATCH_ACCEPT: {
+                int fd = accept(loop->watches[id].fd, NULL, NULL);
+                handler(SOCKET_ACCEPTED, loop->watches[id].data, NULL, fd < 0 ? -errno : fd, context);
+                break;
+            }
+            case WATCH_POLL:
+                handler(SOCKET_READY, loop->watches[id].data, NULL, revents, context);
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+int socket_loop_wait(socket_loop_t *loop, socket_handler_t handler, void *context) {
+    if (loop->use_uring) {
+        return uring_wait(loop, handler, context);
+    }
+    return poll_wait(loop, handler, context);
+}
+
+socket_writer_t * socket_writer_new(bool use_uring) {
+    socket_writer_t *writer = calloc(1, sizeof(socket_writer_t));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->use_uring = use_uring && uring_init(&writer->ring, WRITER_RING_ENTRIES) == 0;
+    return writer;
+}
+
+void socket_writer_free(socket_writer_t *writer) {
+    if (writer->use_uring) {
+        uring_exit(&writer->ring);
+    }
+    free(writer);
+}
+
+// Sends up to a ring's worth of writes and waits for all of them. A socket without room for all of its buffer takes
+// what fits. If the ring fails, the writes it still held count as failed and the writer falls back to plain sends,
+// since their completions could otherwise be matched to a later batch.
+static void uring_write_batch(socket_writer_t *writer, socket_write_t *writes, int count) {
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&writer->ring);
+        if (sqe == NULL) {
+            // Nothing of the writes left out was sent, so they are simply tried again later.
+            log_error("uring_write_batch: Submission queue is full, deferring %d writes", count - i);
+            for (int j = i; j < count; j++) {
+                writes[j].result = 0;
+            }
+            count = i;
+            break;
+        }
+        writes[i].result = -1;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = writes[i].fd;
+        sqe->addr = (uint64_t) (uintptr_t) writes[i].buffer;
+        sqe->len = (uint32_t) writes[i].size;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        sqe->user_data = (uint64_t) i;
+    }
+
+    int completed = 0;
+    bool submitted = false;
+    while (completed < count) {
+        struct io_uring_cqe *cqe = uring_peek_cqe(&writer->ring);
+        if (cqe == NULL) {
+            // Submitting and waiting for the whole batch is normally the only system call.
+            if (uring_submit(&writer->ring, submitted ? 1 : (unsigned) count) < 0 && errno != EINTR) {
+                log_error("uring_write_batch: io_uring_enter error: %s", strerror(errno));
+                uring_exit(&writer->ring);
+                writer->use_uring = false;
+                return;
+            }
+            submitted = true;
+            continue;
+        }
+
+        socket_write_t *pending = &writes[cqe->user_data];
+        int32_t res = cqe->res;
+        uring_cqe_seen(&writer->ring);
+        completed++;
+
+        if (res == -EAGAIN || res == -EWOULDBLOCK) {
+            pending->result = 0;
+        } else if (res < 0) {
+            log_error("uring_write_batch: send error: %s", strerror(-res));
+            pending->result = -1;
+        } else {
+            pending->result = res;
+        }
+    }
+}
+
+static void send_batch(socket_write_t *writes, int count) {
+    for (int i = 0; i < count; i++) {
+        ssize_t written_amount;
+        do {
+            written_amount = send(writes[i].fd, writes[i].buffer, writes[i].size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (written_amount < 0 && errno == EINTR);
+        if (written_amount < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            written_amount = 0;
+        } else if (written_amount < 0) {
+            log_error("socket_writer_write: send error: %s", strerror(errno));
+        }
+        writes[i].result = written_amount;
+    }
+}
+
+void socket_writer_write(socket_writer_t *writer, socket_write_t *writes, int count) {
+    for (int i = 0; i < count; i += WRITER_RING_ENTRIES) {
+        int batch = count - i < WRITER_RING_ENTRIES ? count - i : WRITER_RING_ENTRIES;
+        // A ring that failed partway through is given up, so the rest of the writes go out as plain sends.
+        if (writer->use_uring) {
+            uring_write_batch(writer, writes + i, batch);
+        } else {
+            send_batch(writes + i, batch);
+        }
+    }
+}
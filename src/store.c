@@ -0,0 +1,466 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "store.h"
+
+#define STATS_PER_SLAB 256
+// Records read at a time when loading the store.
+#define LOAD_CHUNK 1024
+// Seconds the writer waits before trying a failed batch again.
+#define RETRY_SECONDS 1
+
+struct store {
+    int fd;
+    // Bytes of whole, flushed records in the file. Only touched by the writer thread once it starts.
+    off_t committed_size;
+    pthread_t writer_thread;
+
+    // Sessions appended since the writer last took them. Guarded by mutex.
+    pthread_mutex_t mutex;
+    pthread_cond_t appended;
+    session_record_t *pending;
+    size_t pending_count;
+    size_t pending_capacity;
+    bool closing;
+
+    // The batch being written, only touched by the writer thread. A batch that could not be written stays here and
+    // is written again along with whatever was appended since.
+    session_record_t *batch;
+    size_t batch_count;
+    size_t batch_capacity;
+
+    // Totals of every session on disk. Guarded by index_mutex.
+    pthread_mutex_t index_mutex;
+    GHashTable *players;
+    pool_t stats_pool;
+    player_stats_t *leaderboard[STORE_LEADERBOARD_SIZE];
+    uint32_t leaderboard_count;
+};
+
+const char * session_end_name(session_end_t reason) {
+    switch (reason) {
+        case SESSION_CLOSED:
+            return "closed";
+        case SESSION_QUIT:
+            return "quit";
+        case SESSION_ERROR:
+            return "error";
+        case SESSION_SHUTDOWN:
+            return "shutdown";
+        case SESSION_TIMEOUT:
+            return "timeout";
+        default:
+            return "unknown";
+    }
+}
+
+// FNV-1a over every field before the checksum.
+static uint32_t record_checksum(const session_record_t *record) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *) record;
+    for (size_t i = 0; i < offsetof(session_record_t, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool ranks_above(const player_stats_t *a, const player_stats_t *b) {
+    if (a->best_score != b->best_score) {
+        return a->best_score > b->best_score;
+    }
+    return a->player_id < b->player_id;
+}
+
+// Moves a player whose best score went up to its place on the leaderboard. Best scores never go down, so a player
+// that drops off the end can only come back by improving, which brings it here again.
+static void update_leaderboard(store_t *store, player_stats_t *stats) {
+    int index = -1;
+    for (uint32_t i = 0; i < store->leaderboard_count; i++) {
+        if (store->leaderboard[i] == stats) {
+            index = (int) i;
+            break;
+        }
+    }
+
+    if (index == -1) {
+        if (store->leaderboard_count < STORE_LEADERBOARD_SIZE) {
+            index = (int) store->leaderboard_count++;
+        } else if (ranks_above(stats, store->leaderboard[STORE_LEADERBOARD_SIZE - 1])) {
+            index = STORE_LEADERBOARD_SIZE - 1;
+        } else {
+            return;
+        }
+        store->leaderboard[index] = stats;
+    }
+
+    while (index > 0 && ranks_above(store->leaderboard[index], store->leaderboard[index - 1])) {
+        player_stats_t *above = store->leaderboard[index - 1];
+        store->leaderboard[index - 1] = store->leaderboard[index];
+        store->leaderboard[index] = above;
+        index--;
+    }
+}
+
+// Adds a session to the totals. Must be called with index_mutex held, or before the writer starts.
+static void index_record(store_t *store, const session_record_t *record) {
+    player_stats_t *stats = g_hash_table_lookup(store->players, GUINT_TO_POINTER(record->player_id));
+    if (stats == NULL) {
+        stats = pool_alloc(&store->stats_pool);
+        if (stats == NULL) {
+            log_error("index_record: No memory for player %d", record->player_id);
+            return;
+        }
+        memset(stats, 0, sizeof(player_stats_t));
+        stats->player_id = record->player_id;
+        g_hash_table_insert(store->players, GUINT_TO_POINTER(record->player_id), stats);
+    }
+
+    stats->sessions++;
+    stats->total_score += record->score;
+    stats->total_play_time_ms += record->play_time_ms;
+    if (record->score > stats->best_score || stats->sessions == 1) {
+        stats->best_score = record->score;
+        update_leaderboard(store, stats);
+    }
+}
+
+// Writes the whole buffer, carrying on after short writes.
+static int write_all(int fd, const void *buffer, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) buffer;
+    while (size > 0) {
+        ssize_t written_amount = write(fd, bytes, size);
+        if (written_amount < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written_amount;
+        size -= (size_t) written_amount;
+    }
+    return 0;
+}
+
+// Reads the records already in the file into the index. Bad records at the end are a torn append and are cut off so
+// appends follow the last good one, unless the store is only being read, in which case they may be an append still
+// under way. A bad record with good ones after it is skipped but left alone. Returns 0 on success or -1 otherwise.
+static int load_store(store_t *store, const char *path, bool writable) {
+    store_header_t header;
+    ssize_t read_amount = read(store->fd, &header, sizeof(header));
+    if (read_amount == 0 && !writable) {
+        return 0;
+    }
+    if (read_amount == 0) {
+        header.magic = STORE_MAGIC;
+        header.version = STORE_VERSION;
+        if (write_all(store->fd, &header, sizeof(header)) || fdatasync(store->fd)) {
+            log_error("load_store: Could not write the header of %s: %s", path, strerror(errno));
+            return -1;
+        }
+        store->committed_size = sizeof(header);
+        return 0;
+    }
+    if (read_amount != sizeof(header) || header.magic != STORE_MAGIC || header.version != STORE_VERSION) {
+        log_error("load_store: %s is not a session store", path);
+        return -1;
+    }
+
+    session_record_t *records = malloc(sizeof(session_record_t) * LOAD_CHUNK);
+    if (records == NULL) {
+        return -1;
+    }
+
+    // The file ends at size, and good_size is where the last good record ends.
+    off_t size = sizeof(header);
+    off_t good_size = sizeof(header);
+    uint64_t record_count = 0;
+    uint64_t skipped_count = 0;
+    while ((read_amount = read(store->fd, records, sizeof(session_record_t) * LOAD_CHUNK)) > 0) {
+        // A regular file only reads short at its end, so a partial record here is the torn end of the file.
+        size_t count = (size_t) read_amount / sizeof(session_record_t);
+        for (size_t i = 0; i < count; i++) {
+            size += sizeof(session_record_t);
+            if (records[i].checksum != record_checksum(&records[i])) {
+                continue;
+            }
+            // Bad records between the last good one and this one stay in the file.
+            skipped_count += (uint64_t) (size - good_size) / sizeof(session_record_t) - 1;
+            index_record(store, &records[i]);
+            good_size = size;
+            record_count++;
+        }
+        size += read_amount - (ssize_t) (count * sizeof(session_record_t));
+    }
+    free(records);
+
+    if (read_amount < 0) {
+        log_error("load_store: Could not read %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (skipped_count > 0) {
+        log_warn("load_store: Skipped %llu bad records in %s", (unsigned long long) skipped_count, path);
+    }
+    if (good_size < size && !writable) {
+        log_info("load_store: Ignoring %ld bytes after the last good record of %s", (long) (size - good_size), path);
+    } else if (good_size < size) {
+        log_warn("load_store: Cutting off %ld bytes of a torn append at byte %ld of %s", (long) (size - good_size),
+                 (long) good_size, path);
+        if (ftruncate(store->fd, good_size)) {
+            log_error("load_store: ftruncate error: %s", strerror(errno));
+            return -1;
+        }
+    }
+    store->committed_size = good_size;
+
+    log_info("load_store: Loaded %llu sessions of %d players from %s", (unsigned long long) record_count,
+             g_hash_table_size(store->players), path);
+    return 0;
+}
+
+// Takes everything appended since the last batch into the batch. Must be called with mutex held.
+static void take_pending(store_t *store) {
+    if (store->batch_count == 0) {
+        // Swap buffers so appends carry on into the other one while this batch is written.
+        session_record_t *batch = store->pending;
+        size_t batch_capacity = store->pending_capacity;
+        store->pending = store->batch;
+        store->pending_capacity = store->batch_capacity;
+        store->batch = batch;
+        store->batch_count = store->pending_count;
+        store->batch_capacity = batch_capacity;
+        store->pending_count = 0;
+        return;
+    }
+
+    // A failed batch is still waiting, so what was appended since goes after it.
+    size_t count = store->batch_count + store->pending_count;
+    if (count > store->batch_capacity) {
+        session_record_t *batch = realloc(store->batch, sizeof(session_record_t) * count);
+        if (batch == NULL) {
+            // The appended sessions wait in pending for a later batch.
+            return;
+        }
+        store->batch = batch;
+        store->batch_capacity = count;
+    }
+    memcpy(store->batch + store->batch_count, store->pending, sizeof(session_record_t) * store->pending_count);
+    store->batch_count = count;
+    store->pending_count = 0;
+}
+
+// Writes and flushes the batch after the last committed record. Anything a failed write left behind is cut off again,
+// so a later batch never lands after a torn record. Returns 0 on success or -1 otherwise.
+static int commit_batch(store_t *store) {
+    if (lseek(store->fd, 0, SEEK_END) != store->committed_size && ftruncate(store->fd, store->committed_size)) {
+        log_error("commit_batch: Could not cut off a torn write: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t size = sizeof(session_record_t) * store->batch_count;
+    if (write_all(store->fd, store->batch, size) == 0 && fdatasync(store->fd) == 0) {
+        store->committed_size += (off_t) size;
+        return 0;
+    }
+
+    log_error("commit_batch: Could not write %zu sessions: %s", store->batch_count, strerror(errno));
+    if (ftruncate(store->fd, store->committed_size)) {
+        log_error("commit_batch: ftruncate error: %s", strerror(errno));
+    }
+    return -1;
+}
+
+// Writer thread. Takes everything appended since its last write, writes it in one go and flushes it with one
+// fdatasync. Sessions that end during the flush wait for the next one, which is what groups them. A batch that fails
+// is kept and tried again a little later.
+static void * write_sessions(void *store_ptr) {
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+    store_t *store = (store_t *) store_ptr;
+
+    bool failed = false;
+    while (true) {
+        pthread_mutex_lock(&store->mutex);
+        if (failed) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += RETRY_SECONDS;
+            while (!store->closing && pthread_cond_timedwait(&store->appended, &store->mutex, &deadline) != ETIMEDOUT);
+        }
+        while (store->batch_count == 0 && store->pending_count == 0 && !store->closing) {
+            pthread_cond_wait(&store->appended, &store->mutex);
+        }
+        take_pending(store);
+        bool closing = store->closing;
+        pthread_mutex_unlock(&store->mutex);
+        if (store->batch_count == 0) {
+            break;
+        }
+
+        size_t batch_count = store->batch_count;
+        for (size_t i = 0; i < batch_count; i++) {
+            store->batch[i].checksum = record_checksum(&store->batch[i]);
+        }
+        failed = commit_batch(store) != 0;
+        if (failed) {
+            if (closing) {
+                // Nothing waits for the disk to come back once the store is closing.
+                log_error("write_sessions: Dropping %zu sessions the store could not write", batch_count);
+                store->batch_count = 0;
+            }
+            continue;
+        }
+        metrics_count(COUNTER_SESSIONS_STORED, batch_count);
+        metrics_observe(HISTOGRAM_COMMIT_BATCH, batch_count);
+
+        // Only sessions that made it to disk show up in queries.
+        pthread_mutex_lock(&store->index_mutex);
+        for (size_t i = 0; i < batch_count; i++) {
+            index_record(store, &store->batch[i]);
+        }
+        pthread_mutex_unlock(&store->index_mutex);
+        store->batch_count = 0;
+    }
+
+    return NULL;
+}
+
+store_t * store_open(const char *path) {
+    store_t *store = calloc(1, sizeof(store_t));
+    if (store == NULL) {
+        return NULL;
+    }
+    store->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store->fd == -1) {
+        log_error("store_open: Could not open %s: %s", path, strerror(errno));
+        free(store);
+        return NULL;
+    }
+
+    store->players = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pool_init(&store->stats_pool, sizeof(player_stats_t), STATS_PER_SLAB);
+
+    if (load_store(store, path, true)) {
+        g_hash_table_destroy(store->players);
+        pool_destroy(&store->stats_pool);
+        close(store->fd);
+        free(store);
+        return NULL;
+    }
+
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->appended, NULL);
+    pthread_mutex_init(&store->index_mutex, NULL);
+    pthread_create(&store->writer_thread, NULL, write_sessions, store);
+
+    log_info("store_open: Storing sessions in %s", path);
+    return store;
+}
+
+void store_close(store_t *store) {
+    pthread_mutex_lock(&store->mutex);
+    store->closing = true;
+    pthread_cond_signal(&store->appended);
+    pthread_mutex_unlock(&store->mutex);
+    pthread_join(store->writer_thread, NULL);
+
+    pthread_mutex_destroy(&store->mutex);
+    pthread_cond_destroy(&store->appended);
+    pthread_mutex_destroy(&store->index_mutex);
+    g_hash_table_destroy(store->players);
+    pool_destroy(&store->stats_pool);
+    free(store->pending);
+    free(store->batch);
+    close(store->fd);
+    free(store);
+}
+
+void store_append(store_t *store, const session_record_t *record) {
+    pthread_mutex_lock(&store->mutex);
+    if (store->pending_count == store->pending_capacity) {
+        size_t capacity = store->pending_capacity ? store->pending_capacity * 2 : 256;
+        session_record_t *pending = realloc(store->pending, sizeof(session_record_t) * capacity);
+        if (pending == NULL) {
+            pthread_mutex_unlock(&store->mutex);
+            log_error("store_append: No memory to queue the session of player %d", record->player_id);
+            return;
+        }
+        store->pending = pending;
+        store->pending_capacity = capacity;
+    }
+    store->pending[store->pending_count++] = *record;
+    pthread_cond_signal(&store->appended);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+uint32_t store_top(store_t *store, player_stats_t *players, uint32_t count) {
+    pthread_mutex_lock(&store->index_mutex);
+    if (count > store->leaderboard_count) {
+        count = store->leaderboard_count;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        players[i] = *store->leaderboard[i];
+    }
+    pthread_mutex_unlock(&store->index_mutex);
+    return count;
+}
+
+bool store_player(store_t *store, uint32_t player_id, player_stats_t *stats) {
+    pthread_mutex_lock(&store->index_mutex);
+    player_stats_t *found = g_hash_table_lookup(store->players, GUINT_TO_POINTER(player_id));
+    if (found) {
+        *stats = *found;
+    }
+    pthread_mutex_unlock(&store->index_mutex);
+    return found != NULL;
+}
+
+int store_print_top(const char *path, uint32_t count, FILE *out) {
+    // The file is normally that of a live server, so it is only read: nothing is created, written or cut off, and
+    // there is no writer thread.
+    store_t store;
+    memset(&store, 0, sizeof(store));
+    store.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (store.fd == -1) {
+        log_error("store_print_top: Could not open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    store.players = g_hash_table_new(g_direct_hash, g_direct_equal);
+    pool_init(&store.stats_pool, sizeof(player_stats_t), STATS_PER_SLAB);
+
+    int result = load_store(&store, path, false);
+    if (result == 0) {
+        if (count > store.leaderboard_count) {
+            count = store.leaderboard_count;
+        }
+        fprintf(out, "rank player best_score sessions total_score play_time_s\n");
+        for (uint32_t i = 0; i < count; i++) {
+            const player_stats_t *player = store.leaderboard[i];
+            fprintf(out, "%u %u %u %u %llu %llu\n", i + 1, player->player_id, player->best_score, player->sessions,
+                    (unsigned long long) player->total_score,
+                    (unsigned long long) (player->total_play_time_ms / 1000));
+        }
+    }
+
+    g_hash_table_destroy(store.players);
+    pool_destroy(&store.stats_pool);
+    close(store.fd);
+    return result;
+}
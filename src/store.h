@@ -0,0 +1,77 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_STORE_H
+#define CSNAKE_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//
+// Append-only store of finished sessions. The file holds a header followed by fixed size records, each with its own
+// checksum, so a crash part way through an append only loses the torn record at the end. Appending only copies the
+// record into memory; a writer thread writes whatever piled up since its last write and flushes it with a single
+// fdatasync, so a burst of sessions ending shares one flush. Per-player totals and a leaderboard are kept in memory
+// and rebuilt from the file on open.
+//
+
+#define STORE_MAGIC 0x43535353 // "CSSS"
+#define STORE_VERSION 1
+
+// Players the leaderboard keeps in order, and so the most store_top returns.
+#define STORE_LEADERBOARD_SIZE 100
+
+typedef enum {
+    SESSION_CLOSED,  // The connection closed.
+    SESSION_QUIT,    // The player pressed escape.
+    SESSION_ERROR,   // The client broke the protocol, its socket failed or it fell too far behind.
+    SESSION_SHUTDOWN, // The server shut down.
+    SESSION_TIMEOUT   // The client went quiet, for example because its network went down.
+} session_end_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} store_header_t;
+
+typedef struct {
+    uint32_t player_id;
+    uint32_t score; // Moves the snake made.
+    uint64_t ended_at_ms; // Wall clock time the session ended, in milliseconds since the epoch.
+    uint32_t play_time_ms;
+    uint32_t end_reason;
+    uint32_t reserved;
+    uint32_t checksum;
+} session_record_t;
+
+typedef struct {
+    uint32_t player_id;
+    uint32_t sessions;
+    uint32_t best_score;
+    uint64_t total_score;
+    uint64_t total_play_time_ms;
+} player_stats_t;
+
+typedef struct store store_t;
+
+// Opens or creates a store and loads its index. Returns NULL on failure.
+store_t * store_open(const char *path);
+// Writes out any sessions still waiting, then closes the store.
+void store_close(store_t *store);
+// Queues a finished session. Never waits on the disk.
+void store_append(store_t *store, const session_record_t *record);
+
+// Copies up to count players with the best scores, best first. Only sessions already on disk count. Returns the number
+// of players copied.
+uint32_t store_top(store_t *store, player_stats_t *players, uint32_t count);
+// Copies a player's totals. Returns false if the player has no sessions on disk.
+bool store_player(store_t *store, uint32_t player_id, player_stats_t *stats);
+
+// Prints the leaderboard of the store at the given path. Returns 0 on success or -1 otherwise.
+int store_print_top(const char *path, uint32_t count, FILE *out);
+
+const char * session_end_name(session_end_t reason);
+
+#endif //CSNAKE_STORE_H
@@ -0,0 +1,155 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// The furthest ahead a timer can be put.
+#define MAX_DELTA ((1ull << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+static void link_timer(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Moves every timer in a slot onto a list of its own, so they can be handled while the slot fills up again.
+static void take_slot(wheel_timer_t *head, wheel_timer_t *list) {
+    if (head->next == head) {
+        list->next = list;
+        list->prev = list;
+        return;
+    }
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->next = head;
+    head->prev = head;
+}
+
+// Puts a timer in the slot of the lowest level that reaches its deadline.
+static void place_timer(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (delta < 1ull << ((level + 1) * TIMER_WHEEL_BITS)) {
+            int slot = (int) ((timer->expires >> (level * TIMER_WHEEL_BITS)) & SLOT_MASK);
+            link_timer(&wheel->slots[level][slot], timer);
+            return;
+        }
+    }
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+}
+
+void timer_wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t expires, void *data) {
+    if (timer_wheel_pending(timer)) {
+        unlink_timer(timer);
+    } else {
+        wheel->count++;
+    }
+
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    } else if (expires - wheel->now > MAX_DELTA) {
+        expires = wheel->now + MAX_DELTA;
+    }
+    timer->expires = expires;
+    timer->data = data;
+    place_timer(wheel, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (timer_wheel_pending(timer)) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+bool timer_wheel_pending(const wheel_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+// Moves the timers of the level's current slot down to the levels below, now that the wheel has come round to it.
+static void cascade(timer_wheel_t *wheel, int level) {
+    int slot = (int) ((wheel->now >> (level * TIMER_WHEEL_BITS)) & SLOT_MASK);
+    wheel_timer_t list;
+    take_slot(&wheel->slots[level][slot], &list);
+    while (list.next != &list) {
+        wheel_timer_t *timer = list.next;
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_handler_t handler, void *context) {
+    while (wheel->now < now) {
+        if (wheel->count == 0) {
+            // Nothing can fire, so there is no need to turn the wheel a tick at a time.
+            wheel->now = now;
+            return;
+        }
+        wheel->now++;
+
+        // Each level comes round to its next slot whenever the levels below it wrap, the highest one first so its
+        // timers can fall through the rest.
+        int top = 0;
+        while (top + 1 < TIMER_WHEEL_LEVELS &&
+               (wheel->now & ((1ull << ((top + 1) * TIMER_WHEEL_BITS)) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            cascade(wheel, level);
+        }
+
+        // The handler may add or cancel timers, including ones on this list.
+        wheel_timer_t list;
+        take_slot(&wheel->slots[0][wheel->now & SLOT_MASK], &list);
+        while (list.next != &list) {
+            wheel_timer_t *timer = list.next;
+            unlink_timer(timer);
+            wheel->count--;
+            handler(timer, context);
+        }
+    }
+}
+
+uint64_t timer_wheel_next(const timer_wheel_t *wheel) {
+    if (wheel->count == 0) {
+        return UINT64_MAX;
+    }
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        // The first slot the level comes round to that has timers in it.
+        int shift = level * TIMER_WHEEL_BITS;
+        for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; i++) {
+            uint64_t at = ((wheel->now >> shift) + i) << shift;
+            const wheel_timer_t *head = &wheel->slots[level][(at >> shift) & SLOT_MASK];
+            if (head->next != head) {
+                next = at < next ? at : next;
+                break;
+            }
+        }
+    }
+    return next;
+}
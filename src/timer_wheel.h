@@ -0,0 +1,54 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_TIMER_WHEEL_H
+#define CSNAKE_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Hierarchical timer wheel for deadlines on many connections at once. Time is counted in whole wheel ticks. The first
+// level has a slot for each of the next TIMER_WHEEL_SLOTS ticks, and each level above covers TIMER_WHEEL_SLOTS times
+// the span of the one below it. A timer goes into the slot of the lowest level that reaches its deadline, and is moved
+// down a level whenever the wheel comes round to its slot, so adding, cancelling and expiring a timer are all O(1)
+// however many timers there are. A wheel is not thread safe and is meant to be owned by a single thread.
+//
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// Four levels reach 2^24 ticks ahead, which is over 19 days with 100 ms ticks. Later deadlines are cut short to that.
+#define TIMER_WHEEL_LEVELS 4
+
+// Embedded in whatever the timer belongs to. A zeroed timer is not pending.
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;
+    uint64_t expires; // Tick the timer fires on.
+    void *data; // Passed back when the timer fires.
+} wheel_timer_t;
+
+typedef struct {
+    uint64_t now; // Last tick the wheel was advanced to.
+    uint32_t count; // Timers pending.
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // The head of each slot's list.
+} timer_wheel_t;
+
+// Called for each timer that expires. The timer is no longer pending, and may be added again.
+typedef void (*timer_handler_t)(wheel_timer_t *timer, void *context);
+
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+// Schedules a timer for the given tick, replacing its earlier deadline if it had one. A deadline that has passed
+// fires on the next tick.
+void timer_wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t expires, void *data);
+// Does nothing if the timer is not pending.
+void timer_wheel_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+bool timer_wheel_pending(const wheel_timer_t *timer);
+// Moves the wheel on to the given tick, firing every timer due by then in order of their deadlines, to the tick.
+void timer_wheel_advance(timer_wheel_t *wheel, uint64_t now, timer_handler_t handler, void *context);
+// The tick the wheel next needs advancing to, for sleeping until then, or UINT64_MAX if no timer is pending. Timers
+// on the higher levels only give the tick they move down a level on, so advancing to it may fire nothing.
+uint64_t timer_wheel_next(const timer_wheel_t *wheel);
+
+#endif //CSNAKE_TIMER_WHEEL_H
@@ -0,0 +1,203 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "uring.h"
+
+// There is no libc wrapper for these, and liburing is not a dependency.
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned arg_count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, arg_count);
+}
+
+// Multishot receive has no feature flag of its own. IORING_OP_SEND_ZC arrived in the same kernel release (6.0), so
+// its presence is the test.
+static bool has_multishot(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        return false;
+    }
+
+    bool supported = false;
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        supported = probe->last_op >= IORING_OP_SEND_ZC &&
+                    (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    memset(ring, 0, sizeof(uring_t));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = io_uring_setup(entries, &params);
+    if (ring->fd < 0) {
+        log_info("uring_init: io_uring is not available: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !has_multishot(ring->fd)) {
+        log_info("uring_init: The kernel's io_uring is too old for multishot receives");
+        close(ring->fd);
+        return -1;
+    }
+
+    // With a single mmap the completion ring shares the submission ring's mapping.
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring->sq_ring_size) {
+        ring->sq_ring_size = cq_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        log_error("uring_init: Could not map the rings: %s", strerror(errno));
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        log_error("uring_init: Could not map the submission entries: %s", strerror(errno));
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+
+    unsigned char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_exit(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    // Closing the ring cancels whatever is still in flight.
+    close(ring->fd);
+}
+
+struct io_uring_sqe * uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        uring_submit(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_count) {
+    // Without a kernel polling thread the kernel takes every queued entry during the call.
+    unsigned queued = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return io_uring_enter(ring->fd, queued, wait_count, flags);
+}
+
+struct io_uring_cqe * uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buffers_init(uring_t *ring, uring_buffers_t *buffers, uint16_t group, unsigned count, size_t buffer_size) {
+    buffers->ring_size = count * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED) {
+        return -1;
+    }
+    buffers->buffers = malloc(count * buffer_size);
+    if (buffers->buffers == NULL) {
+        munmap(buffers->ring, buffers->ring_size);
+        return -1;
+    }
+    buffers->count = count;
+    buffers->buffer_size = buffer_size;
+    buffers->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) buffers->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_error("uring_buffers_init: Could not register receive buffers: %s", strerror(errno));
+        free(buffers->buffers);
+        munmap(buffers->ring, buffers->ring_size);
+        return -1;
+    }
+
+    buffers->ring->tail = 0;
+    for (unsigned i = 0; i < count; i++) {
+        uring_buffer_return(buffers, (uint16_t) i);
+    }
+    return 0;
+}
+
+unsigned char * uring_buffer(uring_buffers_t *buffers, uint16_t id) {
+    return buffers->buffers + (size_t) id * buffers->buffer_size;
+}
+
+void uring_buffer_return(uring_buffers_t *buffers, uint16_t id) {
+    unsigned short tail = buffers->ring->tail;
+    struct io_uring_buf *buf = &buffers->ring->bufs[tail & (buffers->count - 1)];
+    buf->addr = (uint64_t) (uintptr_t) uring_buffer(buffers, id);
+    buf->len = (uint32_t) buffers->buffer_size;
+    buf->bid = id;
+    __atomic_store_n(&buffers->ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+void uring_buffers_destroy(uring_t *ring, uring_buffers_t *buffers) {
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = buffers->group;
+    io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    free(buffers->buffers);
+    munmap(buffers->ring, buffers->ring_size);
+}
@@ -0,0 +1,66 @@
+/**
+ * Author: Jeremy Wood
+ */
+
+#ifndef CSNAKE_URING_H
+#define CSNAKE_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+//
+// Thin wrapper around the io_uring system calls, used by the io_uring socket backend. Only the pieces the server
+// needs are here: a submission and completion ring plus a ring of provided receive buffers. A ring is not thread safe.
+//
+
+typedef struct {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+// Buffers the kernel picks from when a receive completes, so no buffer is tied up by an idle socket.
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    unsigned char *buffers;
+    unsigned count;
+    size_t buffer_size;
+    uint16_t group;
+} uring_buffers_t;
+
+// Returns -1 if io_uring is unavailable, or lacks the multishot operations the backend relies on.
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+
+// Returns a zeroed entry to fill in, submitting what is queued first if the ring is full.
+struct io_uring_sqe * uring_get_sqe(uring_t *ring);
+// Submits everything queued and waits for at least wait_count completions, all in one system call.
+int uring_submit(uring_t *ring, unsigned wait_count);
+// Returns the next completion or NULL if there is none. It must be released with uring_cqe_seen.
+struct io_uring_cqe * uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+// count must be a power of two.
+int uring_buffers_init(uring_t *ring, uring_buffers_t *buffers, uint16_t group, unsigned count, size_t buffer_size);
+unsigned char * uring_buffer(uring_buffers_t *buffers, uint16_t id);
+// Gives a buffer back to the kernel once its data has been handled.
+void uring_buffer_return(uring_buffers_t *buffers, uint16_t id);
+void uring_buffers_destroy(uring_t *ring, uring_buffers_t *buffers);
+
+#endif //CSNAKE_URING_H